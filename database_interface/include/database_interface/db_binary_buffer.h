@@ -0,0 +1,150 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#ifndef _DB_BINARY_BUFFER_H_
+#define _DB_BINARY_BUFFER_H_
+
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "database_interface/db_field.h"
+
+namespace database_interface {
+
+//! Binary data that is either owned, or a view over memory that lives elsewhere
+/*! Unlike std::vector<char>, large data does not have to be copied into the buffer: it can
+  refer to a caller-owned buffer, to a memory-mapped file, or to the result of the query it
+  was read with. Copies of a BinaryBuffer share the data. 
+
+  Example, inserting a file without reading it into memory first:
+
+    DBField<BinaryBuffer> bag_;
+    ...
+    object.bag_.data().mapFile("/tmp/recording.bag");
+    database.insertIntoDatabase(&object);
+ */
+class BinaryBuffer
+{
+ private:
+  //! Keeps alive the memory the data is in; empty for caller-owned memory
+  boost::shared_ptr<const void> holder_;
+  const char *data_;
+  size_t size_;
+
+ public:
+  BinaryBuffer() : data_(NULL), size_(0) {}
+
+  //! A view over memory owned by the caller, which must outlive the buffer and its copies
+  BinaryBuffer(const char *data, size_t size) : data_(data), size_(size) {}
+
+  //! A view over memory that is kept alive as long as holder is
+  BinaryBuffer(const char *data, size_t size, const boost::shared_ptr<const void> &holder) : 
+    holder_(holder), data_(data), size_(size) {}
+
+  //! Copies the data into memory owned by the buffer
+  void assign(const char *data, size_t size);
+
+  //! Maps a file into memory, read-only; the buffer refers to the mapped file
+  bool mapFile(const std::string &filename);
+
+  void clear() {holder_.reset(); data_ = NULL; size_ = 0;}
+
+  const char* data() const {return data_;}
+  size_t size() const {return size_;}
+  bool empty() const {return size_ == 0;}
+};
+
+//! A BinaryBuffer has no text form
+template<>
+struct DBStreamable<BinaryBuffer>
+{
+  static bool streamableFromString(BinaryBuffer &/*data*/, const std::string &/*str*/) {return false;}
+  static bool streamableToString(const BinaryBuffer &/*data*/, std::string &/*str*/) {return false;}
+};
+
+template<>
+struct DBWireBinary<BinaryBuffer>
+{
+  static std::string sqlType() {return "bytea";}
+  static bool fromWireBinary(BinaryBuffer &data, const char* binary, size_t length)
+  {
+    data.assign(binary, length);
+    return true;
+  }
+};
+
+//! A binary field that writes its data from where it is, and reads it without copying
+/*! When loaded with loadFromDatabase, the field refers to the query result, which is kept
+  until the field is changed or destroyed. */
+template <>
+class DBField<BinaryBuffer> : public DBFieldData<BinaryBuffer>
+{
+ public:
+  DBField(Type type, DBClass *owner, std::string name, std::string table_name, bool write_permission) : 
+    DBFieldData<BinaryBuffer>(type, owner, name, table_name, write_permission) {}
+
+  //! The copy shares the data of the original
+  DBField(DBClass *owner, const DBField<BinaryBuffer> *other) : DBFieldData<BinaryBuffer>(owner, other) 
+  {
+    data_ = other->data_;
+  }
+
+  virtual bool fromBinary(const char* binary, size_t length) 
+  {
+    data_.assign(binary, length);
+    return true;
+  }
+
+  virtual bool fromBinaryResult(const char* binary, size_t length, 
+                                const boost::shared_ptr<const void> &holder)
+  {
+    data_ = BinaryBuffer(binary, length, holder);
+    return true;
+  }
+
+  virtual bool toBinary(const char* &binary, size_t &length) const 
+  {
+    //an empty value still needs a pointer, as a NULL one would be sent as an SQL NULL
+    binary = data_.empty() ? "" : data_.data();
+    length = data_.size();
+    return true;
+  }
+};
+
+} //namespace
+
+#endif
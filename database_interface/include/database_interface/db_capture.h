@@ -0,0 +1,138 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+
+#ifndef _DB_CAPTURE_H_
+#define _DB_CAPTURE_H_
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+
+#include <ros/ros.h>
+
+namespace database_interface {
+
+//! A parameter of a captured statement
+struct CapturedParameter
+{
+  enum Kind {TEXT = 0, BINARY = 1, NULL_VALUE = 2};
+  Kind kind;
+  std::string value;
+};
+
+//! A statement sent to the server, as recorded by a CaptureWriter
+struct CapturedStatement
+{
+  //! The text of the statement, with $1, $2, ... for its parameters
+  std::string query;
+  std::vector<CapturedParameter> params;
+  //! 0 for text results, 1 for binary
+  int result_format;
+  //! The server process id of the connection the statement was sent on
+  int connection_id;
+  //! When the statement was sent, in microseconds since the capture started
+  long long start_usec;
+  //! How long the statement took, including the network, in microseconds
+  long long duration_usec;
+  //! Whether the statement succeeded
+  bool ok;
+  //! Whether the statement was sent as a read, which does not change the database
+  /*! Statements are reads when they come from operations that can go to a replica (getList,
+    countList, loadFromDatabase, ...), not from their text: a SELECT can call a function that
+    writes, or draw from a sequence. */
+  bool read_only;
+};
+
+//! Records the statements sent by PostgresqlDatabase to a compact binary file
+/*! See PostgresqlDatabase::setCapture(...). The text of each distinct statement is only 
+  written the first time it is seen; after that, statements refer to it by number. Numbers
+  are written as varints, so a typical statement takes a few bytes plus its parameters.
+  The same writer can be shared by several database instances, in different threads. The
+  file can be read back with a CaptureReader, and replayed with the query_replay tool.
+ */
+class CaptureWriter
+{
+ private:
+  FILE *file_;
+  boost::mutex mutex_;
+  ros::WallTime start_;
+  //! The number of each statement text written so far
+  std::map<std::string, unsigned long> shapes_;
+  long long last_start_usec_;
+
+  void writeVarint(unsigned long long value);
+  void writeBytes(const char *data, size_t length);
+
+ public:
+  CaptureWriter(const std::string &filename);
+  ~CaptureWriter();
+
+  bool isOpen() const {return file_ != NULL;}
+
+  //! Records a statement; the parameters are as passed to PQsendQueryParams
+  void record(const std::string &query, int num_params, const char* const *param_values,
+              const int *param_lengths, const int *param_formats, int result_format, 
+              int connection_id, const ros::WallTime &start, const ros::WallTime &end, bool ok,
+              bool read_only);
+};
+
+//! Reads back the file written by a CaptureWriter
+class CaptureReader
+{
+ private:
+  FILE *file_;
+  std::vector<std::string> shapes_;
+  long long last_start_usec_;
+
+  bool readVarint(unsigned long long &value);
+  bool readBytes(size_t length, std::string &data);
+
+ public:
+  CaptureReader(const std::string &filename);
+  ~CaptureReader();
+
+  bool isOpen() const {return file_ != NULL;}
+
+  //! Reads the next statement; returns false at the end of the file or if it is corrupt
+  bool next(CapturedStatement &statement);
+};
+
+} //namespace
+
+#endif
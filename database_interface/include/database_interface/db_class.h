@@ -59,6 +59,11 @@ namespace database_interface {
   Also in the contructor you can set which fields are read from / written to the database by
   default, and which should be only when you specifically ask for them
 
+  Optionally, one of the fields (an integer column in the primary key table) can be marked as
+  the version of the instance, by setting version_field_ in the constructor. Saves then only
+  succeed if the version in the database is still the one the instance was read with, and 
+  increment it; this detects concurrent changes without holding locks.
+
   For an example, see the DatabaseOriginalModel implementation.
  */
 class DBClass
@@ -82,8 +87,12 @@ class DBClass
   /*! Foreign keys are expected to have the *same name* in both tables they join */
   std::map<std::string, DBFieldBase*> foreign_keys_;
 
+  //! The address of the field holding the version of the instance, if any
+  /*! It must also be stored in fields_, so that it is read along with the other fields. */
+  DBFieldBase* version_field_;
+
  public:
-  DBClass() : primary_key_field_(NULL) {}
+  DBClass() : primary_key_field_(NULL), version_field_(NULL) {}
 
   size_t getNumFields() const {return fields_.size();}
 
@@ -104,6 +113,10 @@ class DBClass
   DBFieldBase* getPrimaryKeyField() {return primary_key_field_;}
   const DBFieldBase* getPrimaryKeyField() const {return primary_key_field_;}
 
+  //! Returns the version field, or NULL if the class has none
+  /*! Not const even for a const instance, as saving any of its fields updates it. */
+  DBFieldBase* getVersionField() const {return version_field_;}
+
   //! Returns the name of the foreign key column in a given table that references our primary key
   /*! The list of foreign keys must be inserted here IN THE CONSTRUCTOR, if you have fields
     that live in other tables than the primary key.
@@ -0,0 +1,605 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#ifndef _DB_COLLECTION_H_
+#define _DB_COLLECTION_H_
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "database_interface/postgresql_database.h"
+
+namespace database_interface {
+
+//! An in-memory index over one field of the instances held by a DBCollection
+template <class T>
+class DBIndex
+{
+ public:
+  typedef boost::shared_ptr<T> EntryPtr;
+
+  virtual ~DBIndex() {}
+
+  //! The name of the column this index is on
+  virtual std::string getColumn() const = 0;
+
+  virtual void insert(const EntryPtr &entry) = 0;
+  virtual void erase(const EntryPtr &entry) = 0;
+
+  //! Finds the entries for which "column op value" holds
+  /*! Returns false if this index can not answer the operator, or if the value can not be
+    parsed into the type of the field. */
+  virtual bool lookup(const std::string &op, const std::string &value, 
+                      std::vector<EntryPtr> &result) const = 0;
+};
+
+//! Parses a value from a filter the same way a DBField<F> parses it from the database
+template <class F>
+bool parseIndexKey(const std::string &str, F &key)
+{
+  DBField<F> field(DBFieldBase::TEXT, NULL, "", "", false);
+  if (!field.fromString(str)) return false;
+  key = field.data();
+  return true;
+}
+
+//! Common part of the hash and sorted indexes: a map from field value to entries
+/*! Entries are erased using the value they were inserted with, which they might no longer
+  hold if their field has been changed in the meantime. */
+template <class T, class F, class Map>
+class DBMapIndex : public DBIndex<T>
+{
+ public:
+  typedef boost::shared_ptr<T> EntryPtr;
+
+ protected:
+  DBField<F> T::*member_;
+  std::string column_;
+  Map entries_;
+  //! The value each entry was indexed under
+  std::map<const T*, F> keys_;
+
+ public:
+  DBMapIndex(DBField<F> T::*member) : member_(member)
+  {
+    T example;
+    column_ = (example.*member_).getName();
+  }
+
+  virtual std::string getColumn() const {return column_;}
+
+  virtual void insert(const EntryPtr &entry)
+  {
+    const F &key = ((*entry).*member_).data();
+    entries_.insert(std::make_pair(key, entry));
+    keys_[entry.get()] = key;
+  }
+
+  virtual void erase(const EntryPtr &entry)
+  {
+    typename std::map<const T*, F>::iterator key_it = keys_.find(entry.get());
+    if (key_it == keys_.end()) return;
+    std::pair<typename Map::iterator, typename Map::iterator> range = entries_.equal_range(key_it->second);
+    for (typename Map::iterator it=range.first; it!=range.second; it++)
+    {
+      if (it->second.get() == entry.get())
+      {
+        entries_.erase(it);
+        break;
+      }
+    }
+    keys_.erase(key_it);
+  }
+};
+
+//! Answers equality lookups on a field
+template <class T, class F>
+class DBHashIndex : public DBMapIndex< T, F, boost::unordered_multimap<F, boost::shared_ptr<T> > >
+{
+ public:
+  typedef boost::shared_ptr<T> EntryPtr;
+  typedef boost::unordered_multimap<F, EntryPtr> Map;
+
+  DBHashIndex(DBField<F> T::*member) : DBMapIndex<T, F, Map>(member) {}
+
+  virtual bool lookup(const std::string &op, const std::string &value, 
+                      std::vector<EntryPtr> &result) const
+  {
+    if (op != "=" && op != "==") return false;
+    F key;
+    if (!parseIndexKey(value, key)) return false;
+    std::pair<typename Map::const_iterator, typename Map::const_iterator> range = this->entries_.equal_range(key);
+    for (typename Map::const_iterator it=range.first; it!=range.second; it++)
+    {
+      result.push_back(it->second);
+    }
+    return true;
+  }
+};
+
+//! Answers equality and range lookups on a field
+template <class T, class F>
+class DBSortedIndex : public DBMapIndex< T, F, std::multimap<F, boost::shared_ptr<T> > >
+{
+ public:
+  typedef boost::shared_ptr<T> EntryPtr;
+  typedef std::multimap<F, EntryPtr> Map;
+
+  DBSortedIndex(DBField<F> T::*member) : DBMapIndex<T, F, Map>(member) {}
+
+  virtual bool lookup(const std::string &op, const std::string &value, 
+                      std::vector<EntryPtr> &result) const
+  {
+    F key;
+    if (!parseIndexKey(value, key)) return false;
+    typename Map::const_iterator begin, end;
+    if (op == "=" || op == "==")
+    {
+      begin = this->entries_.lower_bound(key);
+      end = this->entries_.upper_bound(key);
+    }
+    else if (op == "<")
+    {
+      begin = this->entries_.begin();
+      end = this->entries_.lower_bound(key);
+    }
+    else if (op == "<=")
+    {
+      begin = this->entries_.begin();
+      end = this->entries_.upper_bound(key);
+    }
+    else if (op == ">")
+    {
+      begin = this->entries_.upper_bound(key);
+      end = this->entries_.end();
+    }
+    else if (op == ">=")
+    {
+      begin = this->entries_.lower_bound(key);
+      end = this->entries_.end();
+    }
+    else return false;
+    for (typename Map::const_iterator it=begin; it!=end; it++)
+    {
+      result.push_back(it->second);
+    }
+    return true;
+  }
+};
+
+//! Answers "contains" lookups on an array field, by indexing each of its elements
+template <class T, class V>
+class DBInvertedIndex : public DBIndex<T>
+{
+ public:
+  typedef boost::shared_ptr<T> EntryPtr;
+  typedef boost::unordered_multimap<V, EntryPtr> Map;
+
+ protected:
+  DBField< std::vector<V> > T::*member_;
+  std::string column_;
+  Map entries_;
+  //! The elements each entry was indexed under
+  std::map< const T*, std::vector<V> > keys_;
+
+ public:
+  DBInvertedIndex(DBField< std::vector<V> > T::*member) : member_(member)
+  {
+    T example;
+    column_ = (example.*member_).getName();
+  }
+
+  virtual std::string getColumn() const {return column_;}
+
+  virtual void insert(const EntryPtr &entry)
+  {
+    const std::vector<V> &elements = ((*entry).*member_).data();
+    for (size_t i=0; i<elements.size(); i++)
+    {
+      entries_.insert(std::make_pair(elements[i], entry));
+    }
+    keys_[entry.get()] = elements;
+  }
+
+  virtual void erase(const EntryPtr &entry)
+  {
+    typename std::map< const T*, std::vector<V> >::iterator key_it = keys_.find(entry.get());
+    if (key_it == keys_.end()) return;
+    for (size_t i=0; i<key_it->second.size(); i++)
+    {
+      std::pair<typename Map::iterator, typename Map::iterator> range = 
+        entries_.equal_range(key_it->second[i]);
+      for (typename Map::iterator it=range.first; it!=range.second; it++)
+      {
+        if (it->second.get() == entry.get())
+        {
+          entries_.erase(it);
+          break;
+        }
+      }
+    }
+    keys_.erase(key_it);
+  }
+
+  virtual bool lookup(const std::string &op, const std::string &value, 
+                      std::vector<EntryPtr> &result) const
+  {
+    if (op != "contains") return false;
+    V key;
+    if (!parseIndexKey(value, key)) return false;
+    //an element that appears more than once in the same array is indexed more than once
+    std::set<const T*> found;
+    std::pair<typename Map::const_iterator, typename Map::const_iterator> range = entries_.equal_range(key);
+    for (typename Map::const_iterator it=range.first; it!=range.second; it++)
+    {
+      if (found.insert(it->second.get()).second) result.push_back(it->second);
+    }
+    return true;
+  }
+};
+
+//! A local copy of (part of) a table, with optional in-memory indexes
+/*! The collection holds instances of the DBClass T, keyed on the text value of their 
+  primary key. Indexes can be added on any of their fields:
+  - hash indexes answer equality (==) filters
+  - sorted indexes answer equality and range (<, <=, >, >=) filters
+  - inverted indexes on array fields answer contains() filters
+
+  A filter that is a conjunction of comparisons, each of which can be answered by an index,
+  is answered without going to the database. Any other filter is sent to the database. Note
+  that this assumes that the collection holds every instance that might match; if it was 
+  loaded with a filter, it should only be queried for instances within that filter.
+
+  The collection is kept up to date if changes go through its own insertIntoDatabase, 
+  saveToDatabase and deleteFromDatabase functions, or are signalled through notifications
+  whose payload is the primary key of the changed row (see handleNotification). Changes 
+  made by others can also be picked up periodically with refresh(), which only reads what
+  changed since the last load (see DeltaSyncConfig).
+
+  Example:
+
+    DBCollection<Student> students;
+    students.addHashIndex(&Student::student_id_);
+    students.addInvertedIndex(&Student::student_majors_);
+    students.load(database);
+    students.getList(database, vec, contains(dbField("student_majors"), "physics"));
+ */
+template <class T>
+class DBCollection
+{
+ public:
+  typedef boost::shared_ptr<T> EntryPtr;
+
+ protected:
+  //! The entries, keyed on the text value of their primary key
+  std::map<std::string, EntryPtr> entries_;
+
+  std::vector< boost::shared_ptr< DBIndex<T> > > indexes_;
+
+  //! The filter the collection was loaded with; refreshes are restricted to it as well
+  FilterClause where_clause_;
+
+  //! How refresh() finds changes
+  DeltaSyncConfig delta_config_;
+
+  //! Describes how recent the contents are; empty if they have not been loaded yet
+  std::string watermark_;
+
+  static bool getKey(const T &entry, std::string &key)
+  {
+    return entry.getPrimaryKeyField()->toString(key);
+  }
+
+  void addIndex(const boost::shared_ptr< DBIndex<T> > &index)
+  {
+    typename std::map<std::string, EntryPtr>::const_iterator it;
+    for (it=entries_.begin(); it!=entries_.end(); it++) index->insert(it->second);
+    indexes_.push_back(index);
+  }
+
+  //! Looks up a single term in whichever index can answer it
+  bool lookupTerm(const FilterTerm &term, std::vector<EntryPtr> &result) const
+  {
+    for (size_t i=0; i<indexes_.size(); i++)
+    {
+      if (indexes_[i]->getColumn() != term.column_) continue;
+      result.clear();
+      if (term.op_ != "in")
+      {
+        if (indexes_[i]->lookup(term.op_, term.value_, result)) return true;
+        continue;
+      }
+      //a set membership is answered by one equality lookup per value
+      std::set<const T*> found;
+      bool answered = true;
+      for (size_t v=0; v<term.values_.size() && answered; v++)
+      {
+        std::vector<EntryPtr> matches;
+        answered = indexes_[i]->lookup("=", term.values_[v], matches);
+        for (size_t j=0; j<matches.size(); j++)
+        {
+          if (found.insert(matches[j].get()).second) result.push_back(matches[j]);
+        }
+      }
+      if (answered) return true;
+    }
+    return false;
+  }
+
+ public:
+  size_t size() const {return entries_.size();}
+
+  //! Returns the entry with the given primary key, or an empty pointer if there is none
+  EntryPtr find(const std::string &key) const
+  {
+    typename std::map<std::string, EntryPtr>::const_iterator it = entries_.find(key);
+    if (it == entries_.end()) return EntryPtr();
+    return it->second;
+  }
+
+  void getAll(std::vector<EntryPtr> &vec) const
+  {
+    vec.clear();
+    vec.reserve(entries_.size());
+    typename std::map<std::string, EntryPtr>::const_iterator it;
+    for (it=entries_.begin(); it!=entries_.end(); it++) vec.push_back(it->second);
+  }
+
+  void clear()
+  {
+    typename std::map<std::string, EntryPtr>::const_iterator it;
+    for (it=entries_.begin(); it!=entries_.end(); it++)
+    {
+      for (size_t i=0; i<indexes_.size(); i++) indexes_[i]->erase(it->second);
+    }
+    entries_.clear();
+  }
+
+  //! Adds an entry, replacing any entry with the same primary key
+  bool add(const EntryPtr &entry)
+  {
+    std::string key;
+    if (!getKey(*entry, key)) return false;
+    remove(key);
+    entries_[key] = entry;
+    for (size_t i=0; i<indexes_.size(); i++) indexes_[i]->insert(entry);
+    return true;
+  }
+
+  //! Removes the entry with the given primary key. Returns false if there was none.
+  bool remove(const std::string &key)
+  {
+    typename std::map<std::string, EntryPtr>::iterator it = entries_.find(key);
+    if (it == entries_.end()) return false;
+    for (size_t i=0; i<indexes_.size(); i++) indexes_[i]->erase(it->second);
+    entries_.erase(it);
+    return true;
+  }
+
+  //! Updates the indexes after the fields of an entry have been changed
+  void reindex(const EntryPtr &entry)
+  {
+    for (size_t i=0; i<indexes_.size(); i++)
+    {
+      indexes_[i]->erase(entry);
+      indexes_[i]->insert(entry);
+    }
+  }
+
+  template <class F>
+  void addHashIndex(DBField<F> T::*member)
+  {
+    addIndex(boost::shared_ptr< DBIndex<T> >(new DBHashIndex<T, F>(member)));
+  }
+
+  template <class F>
+  void addSortedIndex(DBField<F> T::*member)
+  {
+    addIndex(boost::shared_ptr< DBIndex<T> >(new DBSortedIndex<T, F>(member)));
+  }
+
+  template <class V>
+  void addInvertedIndex(DBField< std::vector<V> > T::*member)
+  {
+    addIndex(boost::shared_ptr< DBIndex<T> >(new DBInvertedIndex<T, V>(member)));
+  }
+
+  //! Answers a filter from the indexes. Returns false if it can not be answered locally.
+  bool select(const FilterClause &clause, std::vector<EntryPtr> &result) const
+  {
+    if (!clause.structured_) return false;
+    if (clause.terms_.empty())
+    {
+      getAll(result);
+      return true;
+    }
+    //start with the entries matching the first term, then keep those that match the others
+    std::vector<EntryPtr> candidates;
+    if (!lookupTerm(clause.terms_[0], candidates)) return false;
+    for (size_t t=1; t<clause.terms_.size(); t++)
+    {
+      std::vector<EntryPtr> matches;
+      if (!lookupTerm(clause.terms_[t], matches)) return false;
+      std::set<const T*> match_set;
+      for (size_t i=0; i<matches.size(); i++) match_set.insert(matches[i].get());
+      std::vector<EntryPtr> remaining;
+      for (size_t i=0; i<candidates.size(); i++)
+      {
+        if (match_set.count(candidates[i].get())) remaining.push_back(candidates[i]);
+      }
+      candidates.swap(remaining);
+    }
+    result.swap(candidates);
+    return true;
+  }
+
+  //! Replaces the contents of the collection with the instances in the database
+  /*! Also records the watermark that later calls to refresh() start from. */
+  bool load(const PostgresqlDatabase &db, const FilterClause clause=FilterClause())
+  {
+    PostgresqlDatabase::PrimaryReadScope primary_reads(db);
+    T example;
+    std::string watermark;
+    if (!db.getChangeWatermark(&example, delta_config_, watermark)) return false;
+    std::vector<EntryPtr> vec;
+    if (!db.getList<T>(vec, clause)) return false;
+    clear();
+    for (size_t i=0; i<vec.size(); i++) add(vec[i]);
+    where_clause_ = clause;
+    watermark_ = watermark;
+    return true;
+  }
+
+  //! Sets how refresh() finds what has changed. Must be set before load().
+  void setDeltaSync(const DeltaSyncConfig &config) {delta_config_ = config;}
+
+  const std::string& getWatermark() const {return watermark_;}
+
+  //! Sets the watermark, for contents that were loaded some other way (e.g. from a snapshot)
+  void setWatermark(const std::string &watermark, const FilterClause clause=FilterClause()) 
+  {
+    watermark_ = watermark;
+    where_clause_ = clause;
+  }
+
+  //! Brings the collection up to date by reading only what changed since the last load or refresh
+  /*! Changed instances replace the ones in the collection (pointers to the old instances held
+    elsewhere are not updated); deleted instances are removed. Instances that no longer 
+    satisfy the filter the collection was loaded with are only removed with KEY_DIFF 
+    delete tracking. */
+  bool refresh(const PostgresqlDatabase &db)
+  {
+    //the watermark, the changes and the deletions must all come from the same server
+    PostgresqlDatabase::PrimaryReadScope primary_reads(db);
+    T example;
+    std::string watermark, changed_clause;
+    if (!db.getChangeWatermark(&example, delta_config_, watermark)) return false;
+    if (!db.getChangedClause(&example, delta_config_, watermark_, watermark, changed_clause)) return false;
+    FilterClause changed(changed_clause);
+    if (!where_clause_.clause_.empty()) changed = changed && where_clause_;
+
+    //removals go first, so that a key deleted and then inserted again is kept
+    std::vector<std::string> keys;
+    if (delta_config_.delete_tracking == DeltaSyncConfig::TOMBSTONE_TABLE)
+    {
+      if (!db.getDeletedKeys(&example, delta_config_, watermark_, keys)) return false;
+    }
+    std::vector<EntryPtr> vec;
+    if (!db.getList<T>(vec, changed)) return false;
+    for (size_t i=0; i<keys.size(); i++) remove(keys[i]);
+    for (size_t i=0; i<vec.size(); i++) add(vec[i]);
+
+    if (delta_config_.delete_tracking == DeltaSyncConfig::KEY_DIFF)
+    {
+      if (!db.getKeyList(&example, keys, where_clause_)) return false;
+      std::set<std::string> existing(keys.begin(), keys.end());
+      std::vector<std::string> removed;
+      typename std::map<std::string, EntryPtr>::const_iterator it;
+      for (it=entries_.begin(); it!=entries_.end(); it++)
+      {
+        if (!existing.count(it->first)) removed.push_back(it->first);
+      }
+      for (size_t i=0; i<removed.size(); i++) remove(removed[i]);
+    }
+    watermark_ = watermark;
+    return true;
+  }
+
+  //! Answers the filter from the indexes if possible, otherwise from the database
+  bool getList(const PostgresqlDatabase &db, std::vector<EntryPtr> &vec, 
+               const FilterClause clause=FilterClause()) const
+  {
+    if (select(clause, vec)) return true;
+    return db.getList<T>(vec, clause);
+  }
+
+  //! Inserts an instance in the database, then adds it to the collection
+  bool insertIntoDatabase(PostgresqlDatabase &db, const EntryPtr &entry)
+  {
+    if (!db.insertIntoDatabase(entry.get())) return false;
+    return add(entry);
+  }
+
+  //! Saves one field of an entry of the collection, then updates the indexes
+  bool saveToDatabase(PostgresqlDatabase &db, const EntryPtr &entry, const DBFieldBase *field)
+  {
+    if (!db.saveToDatabase(field)) return false;
+    reindex(entry);
+    return true;
+  }
+
+  //! Deletes an instance from the database, then removes it from the collection
+  bool deleteFromDatabase(PostgresqlDatabase &db, const EntryPtr &entry)
+  {
+    std::string key;
+    if (!getKey(*entry, key)) return false;
+    if (!db.deleteFromDatabase(entry.get())) return false;
+    remove(key);
+    return true;
+  }
+
+  //! Reloads the entry whose primary key is the payload of the notification
+  /*! If the entry is no longer in the database, it is removed from the collection. Meant for
+    channels fed by a trigger that sends NOTIFY with the key of each changed row. */
+  bool handleNotification(const PostgresqlDatabase &db, const Notification &notification)
+  {
+    T example;
+    std::string quoted;
+    for (size_t i=0; i<notification.payload.size(); i++)
+    {
+      if (notification.payload[i] == '\'') quoted += '\'';
+      quoted += notification.payload[i];
+    }
+    std::vector<EntryPtr> vec;
+    if (!db.getList<T>(vec, example.getPrimaryKeyField()->getName() + " = '" + quoted + "'")) 
+    {
+      return false;
+    }
+    if (vec.empty()) 
+    {
+      remove(notification.payload);
+      return true;
+    }
+    return add(vec[0]);
+  }
+};
+
+} //namespace
+
+#endif
@@ -0,0 +1,151 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#ifndef _DB_COPY_H_
+#define _DB_COPY_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+namespace database_interface {
+
+//! Receives the output of a binary COPY TO STDOUT, as streamed by the server
+/*! See PostgresqlDatabase::copyOut(...). The stream is in the PostgreSQL binary COPY
+  format; CopyRowSink splits it into rows.
+ */
+class CopySink
+{
+ public:
+  virtual ~CopySink() {}
+
+  //! Called before any data, with the names of the columns in the order they are sent
+  virtual bool begin(const std::vector<std::string> &/*columns*/) {return true;}
+
+  //! Called with each chunk of the stream as it is received. Returning false aborts the COPY.
+  virtual bool data(const char *data, size_t length) = 0;
+
+  //! Called after the last chunk, if the whole stream has been received
+  virtual bool end() {return true;}
+};
+
+//! Writes the stream, unchanged, to a file
+/*! The file can be loaded back with COPY ... FROM ... (FORMAT binary). */
+class CopyFileSink : public CopySink
+{
+ private:
+  std::string filename_;
+  FILE *file_;
+
+ public:
+  CopyFileSink(const std::string &filename) : filename_(filename), file_(NULL) {}
+  ~CopyFileSink();
+
+  virtual bool begin(const std::vector<std::string> &columns);
+  virtual bool data(const char *data, size_t length);
+  virtual bool end();
+};
+
+//! Splits the stream into rows
+/*! Each value is passed as a pointer and a length; NULL values have a NULL pointer. The 
+  pointers are only valid during the call to handleRow(...).
+ */
+class CopyRowSink : public CopySink
+{
+ private:
+  //! Data left over from the previous chunk that does not make up a whole row yet
+  std::string pending_;
+  bool header_done_;
+  bool trailer_done_;
+  std::vector<const char*> values_;
+  std::vector<size_t> lengths_;
+
+  //! Parses as many rows as possible; sets used to the number of bytes consumed
+  bool parse(const char *data, size_t length, size_t &used);
+
+ public:
+  CopyRowSink() : header_done_(false), trailer_done_(false) {}
+
+  virtual bool begin(const std::vector<std::string> &columns);
+  virtual bool data(const char *data, size_t length);
+  virtual bool end();
+
+  //! Called for each row
+  virtual bool handleRow(const std::vector<const char*> &values, 
+                         const std::vector<size_t> &lengths) = 0;
+};
+
+//! Stores the rows column by column, in contiguous buffers
+/*! Values are kept in the format they were sent in: the binary format of the column type
+  for fields that have a wire type (see DBFieldBase::getWireType()), text otherwise.
+ */
+class CopyColumnarBuffer : public CopyRowSink
+{
+ private:
+  struct Column
+  {
+    std::string name;
+    //! The values of all rows, one after the other
+    std::vector<char> data;
+    //! Where the value of each row starts in data
+    std::vector<size_t> offsets;
+    //! The length of the value of each row; -1 for NULL
+    std::vector<long long> lengths;
+  };
+  std::vector<Column> columns_;
+  size_t num_rows_;
+
+ public:
+  CopyColumnarBuffer() : num_rows_(0) {}
+
+  virtual bool begin(const std::vector<std::string> &columns);
+  virtual bool handleRow(const std::vector<const char*> &values, 
+                         const std::vector<size_t> &lengths);
+
+  size_t getNumRows() const {return num_rows_;}
+  size_t getNumColumns() const {return columns_.size();}
+  std::string getColumnName(size_t column) const {return columns_.at(column).name;}
+
+  //! Gets a value. Returns false if the value is NULL.
+  /*! The pointer remains valid until the buffer is cleared or receives more rows. */
+  bool getValue(size_t row, size_t column, const char* &value, size_t &length) const;
+
+  void clear();
+};
+
+} //namespace
+
+#endif
@@ -38,15 +38,18 @@
 #define _DB_FIELD_H_
 
 #include <stdio.h>
+#include <stdint.h>
 
 #include <vector>
 #include <map>
+#include <limits>
 #include <string>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
 
 #include <boost/format.hpp>
+#include <boost/shared_ptr.hpp>
 
 //for memcpy
 #include <cstring>
@@ -119,6 +122,9 @@ class DBFieldBase
 
   //! Sets the value of this field from a text string
   virtual bool fromString(const std::string &str) = 0;
+  //! Sets the value of this field from text of the given length, as found in a query result
+  /*! Goes through fromString by default; fields can avoid the intermediate string. */
+  virtual bool fromText(const char* str, size_t length) {return fromString(std::string(str, length));}
   //! Gets the value of this field as a text string
   virtual bool toString(std::string &str) const = 0;
 
@@ -129,6 +135,24 @@ class DBFieldBase
   */
   virtual bool toBinary(const char* &binary, size_t &length) const = 0;
 
+  //! Sets the value of this field from binary data kept alive by holder (e.g. a query result)
+  /*! Fields that can refer to the data instead of copying it keep holder; by default, the 
+    data is copied with fromBinary. */
+  virtual bool fromBinaryResult(const char* binary, size_t length, 
+                                const boost::shared_ptr<const void> &/*holder*/)
+  {
+    return fromBinary(binary, length);
+  }
+
+  //! The SQL type whose binary wire format fromWireBinary understands; empty if there is none
+  virtual std::string getWireType() const {return std::string();}
+  //! Sets the value of this field from the PostgreSQL binary wire format of getWireType()
+  /*! Used for binary bulk transfers, where it avoids going through text. */
+  virtual bool fromWireBinary(const char* /*binary*/, size_t /*length*/) {return false;}
+
+  //! Resets the value of this field to its default, as for a NULL in the database
+  virtual void setToDefault() {}
+
   DBClass* getOwner(){return owner_;}
   const DBClass* getOwner() const {return owner_;}
 
@@ -238,6 +262,27 @@ struct DBStreamable
   }
 };
 
+//! Vectors are cleared first, as their stream operator appends
+template<typename V>
+struct DBStreamable< std::vector<V> >
+{
+  static bool streamableFromString(std::vector<V> &data, const std::string &str)
+  {
+    data.clear();
+    std::istringstream iss(str);
+    return !(iss >> data).fail();
+  }
+
+  static bool streamableToString(const std::vector<V> &data, std::string &str)
+  {
+    std::ostringstream oss;
+    oss << std::setprecision(30) << data;
+    if (oss.fail()) return false;
+    str = oss.str();
+    return true;
+  }
+};
+
 template<>
 struct DBStreamable<double>
 {
@@ -265,6 +310,96 @@ struct DBStreamable<double>
   }
 };
 
+//! Reads a big-endian (network order) unsigned integer of the given number of bytes
+inline unsigned long long readNetworkOrder(const char *data, size_t bytes)
+{
+  unsigned long long value = 0;
+  for (size_t i=0; i<bytes; i++) value = (value << 8) | (unsigned char) data[i];
+  return value;
+}
+
+//! Decoding from the PostgreSQL binary wire format, for C++ types with a direct SQL equivalent
+/*! Types without a specialization have no wire type, and are transferred as text. */
+template<typename T>
+struct DBWireBinary
+{
+  static std::string sqlType() {return std::string();}
+  static bool fromWireBinary(T &/*data*/, const char* /*binary*/, size_t /*length*/) {return false;}
+};
+
+template<>
+struct DBWireBinary<int>
+{
+  static std::string sqlType() {return "int4";}
+  static bool fromWireBinary(int &data, const char* binary, size_t length)
+  {
+    if (length != 4) return false;
+    data = (int) (unsigned int) readNetworkOrder(binary, 4);
+    return true;
+  }
+};
+
+template<>
+struct DBWireBinary<float>
+{
+  static std::string sqlType() {return "float4";}
+  static bool fromWireBinary(float &data, const char* binary, size_t length)
+  {
+    if (length != 4) return false;
+    unsigned int bits = (unsigned int) readNetworkOrder(binary, 4);
+    memcpy(&data, &bits, 4);
+    return true;
+  }
+};
+
+//! Unlike the text format (see DBStreamable<double>), keeps the full precision
+template<>
+struct DBWireBinary<double>
+{
+  static std::string sqlType() {return "float8";}
+  static bool fromWireBinary(double &data, const char* binary, size_t length)
+  {
+    if (length != 8) return false;
+    unsigned long long bits = readNetworkOrder(binary, 8);
+    memcpy(&data, &bits, 8);
+    return true;
+  }
+};
+
+template<>
+struct DBWireBinary<bool>
+{
+  static std::string sqlType() {return "bool";}
+  static bool fromWireBinary(bool &data, const char* binary, size_t length)
+  {
+    if (length != 1) return false;
+    data = (binary[0] != 0);
+    return true;
+  }
+};
+
+template<>
+struct DBWireBinary<std::string>
+{
+  static std::string sqlType() {return "text";}
+  static bool fromWireBinary(std::string &data, const char* binary, size_t length)
+  {
+    data.assign(binary, length);
+    return true;
+  }
+};
+
+template<>
+struct DBWireBinary< std::vector<char> >
+{
+  static std::string sqlType() {return "bytea";}
+  static bool fromWireBinary(std::vector<char> &data, const char* binary, size_t length)
+  {
+    data.assign(binary, binary + length);
+    return true;
+  }
+};
+
 //! A DBFieldBase that also contains data and perform implicit conversion to and from string
 /*! Default conversion to and from string is through the stream operators >> and <<. Any data
   type that defines those operators can be used inside this class.  Works well for most
@@ -326,6 +461,8 @@ class DBFieldData : public DBFieldBase
 
   T& data() {return data_;}
 
+  virtual void setToDefault() {data_ = T();}
+
   virtual bool fromString(const std::string &str)
   {
     return DBStreamable<T>::streamableFromString(this->data_, str);
@@ -338,6 +475,12 @@ class DBFieldData : public DBFieldBase
 
   virtual bool fromBinary(const char* /*binary*/, size_t /*length*/) {return false;}
   virtual bool toBinary(const char* &/*binary*/, size_t &/*length*/) const {return false;}
+
+  virtual std::string getWireType() const {return DBWireBinary<T>::sqlType();}
+  virtual bool fromWireBinary(const char* binary, size_t length)
+  {
+    return DBWireBinary<T>::fromWireBinary(this->data_, binary, length);
+  }
 };
 
 //! The base class for a usable DBField.
@@ -435,6 +578,8 @@ class DBField<std::string> : public DBFieldData<std::string>
 
   virtual bool fromString(const std::string &str) {data_ = str; return true;}
   virtual bool toString(std::string &str) const {str = data_; return true;}
+  //! Keeps the capacity of the string, so that reading into a reused field does not allocate
+  virtual bool fromText(const char* str, size_t length) {data_.assign(str, length); return true;}
 };
 
 //! Specialized version for std::vector<std::string>
@@ -453,6 +598,7 @@ class DBField< std::vector<std::string> > : public DBFieldData< std::vector<std:
 
   virtual bool fromString(const std::string &str) 
   {
+    this->data_.clear();
     if (str.empty()) return true;
     if (str.at(0) != '{') return false;
 
@@ -476,6 +622,290 @@ class DBField< std::vector<std::string> > : public DBFieldData< std::vector<std:
   }
 };
 
+// ------- Field types for SQL types with no direct C++ equivalent -------
+// Timestamps, dates and UUIDs, as well as 64-bit integers and floats, have a text codec that
+// parses the server's text output without going through streams, and a binary wire codec 
+// (see DBWireBinary), used by copyOut(...) and by getList(...) with binary results enabled.
+
+//! A point in time, in microseconds since 1970-01-01 00:00:00 UTC. Maps to timestamptz.
+/*! The infinite timestamps are represented by the largest and smallest values. */
+struct DBTimestamp
+{
+  int64_t usec;
+  DBTimestamp() : usec(0) {}
+  explicit DBTimestamp(int64_t microseconds) : usec(microseconds) {}
+  bool operator==(const DBTimestamp &other) const {return usec == other.usec;}
+  bool operator!=(const DBTimestamp &other) const {return usec != other.usec;}
+  bool operator<(const DBTimestamp &other) const {return usec < other.usec;}
+};
+
+//! A day, in days since 1970-01-01. Maps to date.
+struct DBDate
+{
+  int32_t days;
+  DBDate() : days(0) {}
+  explicit DBDate(int32_t days_since_epoch) : days(days_since_epoch) {}
+  bool operator==(const DBDate &other) const {return days == other.days;}
+  bool operator!=(const DBDate &other) const {return days != other.days;}
+  bool operator<(const DBDate &other) const {return days < other.days;}
+};
+
+//! A 16-byte UUID, in network order. Maps to uuid.
+struct DBUuid
+{
+  unsigned char bytes[16];
+  DBUuid() {memset(bytes, 0, 16);}
+  bool operator==(const DBUuid &other) const {return memcmp(bytes, other.bytes, 16) == 0;}
+  bool operator!=(const DBUuid &other) const {return memcmp(bytes, other.bytes, 16) != 0;}
+  bool operator<(const DBUuid &other) const {return memcmp(bytes, other.bytes, 16) < 0;}
+};
+
+//! Parses a timestamp in the ISO format the server uses, e.g. "2013-05-02 14:03:27.25+02"
+/*! Without a time zone, the time is taken to be UTC. */
+bool parseTimestamp(const char *str, size_t length, DBTimestamp &timestamp);
+//! Formats a timestamp in UTC, e.g. "2013-05-02 12:03:27.250000+00"
+std::string formatTimestamp(const DBTimestamp &timestamp);
+
+//! Parses a date in the ISO format, e.g. "2013-05-02"
+bool parseDate(const char *str, size_t length, DBDate &date);
+std::string formatDate(const DBDate &date);
+
+//! Parses a UUID, with or without hyphens and braces
+bool parseUuid(const char *str, size_t length, DBUuid &uuid);
+//! Formats a UUID in the canonical form, e.g. "a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11"
+std::string formatUuid(const DBUuid &uuid);
+
+bool parseInt64(const char *str, size_t length, int64_t &value);
+//! Also understands the server's "NaN", "Infinity" and "-Infinity"
+bool parseFloat(const char *str, size_t length, float &value);
+
+std::ostream& operator << (std::ostream &str, const DBTimestamp &timestamp);
+std::ostream& operator << (std::ostream &str, const DBDate &date);
+std::ostream& operator << (std::ostream &str, const DBUuid &uuid);
+
+template<>
+struct DBStreamable<DBTimestamp>
+{
+  static bool streamableFromString(DBTimestamp &data, const std::string &str) 
+  {
+    return parseTimestamp(str.c_str(), str.size(), data);
+  }
+  static bool streamableToString(const DBTimestamp &data, std::string &str) 
+  {
+    str = formatTimestamp(data);
+    return true;
+  }
+};
+
+template<>
+struct DBStreamable<DBDate>
+{
+  static bool streamableFromString(DBDate &data, const std::string &str) 
+  {
+    return parseDate(str.c_str(), str.size(), data);
+  }
+  static bool streamableToString(const DBDate &data, std::string &str) 
+  {
+    str = formatDate(data);
+    return true;
+  }
+};
+
+template<>
+struct DBStreamable<DBUuid>
+{
+  static bool streamableFromString(DBUuid &data, const std::string &str) 
+  {
+    return parseUuid(str.c_str(), str.size(), data);
+  }
+  static bool streamableToString(const DBUuid &data, std::string &str) 
+  {
+    str = formatUuid(data);
+    return true;
+  }
+};
+
+//! Parsing of a type from text without streams; only specialized for some types
+/*! See DBFieldCodec. */
+template<typename T>
+struct DBTextCodec;
+
+template<>
+struct DBTextCodec<int64_t>
+{
+  static bool fromText(int64_t &data, const char *str, size_t length) {return parseInt64(str, length, data);}
+};
+
+template<>
+struct DBTextCodec<float>
+{
+  static bool fromText(float &data, const char *str, size_t length) {return parseFloat(str, length, data);}
+};
+
+template<>
+struct DBTextCodec<DBTimestamp>
+{
+  static bool fromText(DBTimestamp &data, const char *str, size_t length) {return parseTimestamp(str, length, data);}
+};
+
+template<>
+struct DBTextCodec<DBDate>
+{
+  static bool fromText(DBDate &data, const char *str, size_t length) {return parseDate(str, length, data);}
+};
+
+template<>
+struct DBTextCodec<DBUuid>
+{
+  static bool fromText(DBUuid &data, const char *str, size_t length) {return parseUuid(str, length, data);}
+};
+
+//! Offset between the PostgreSQL epoch (2000-01-01) and the Unix epoch, in days
+static const int32_t POSTGRES_EPOCH_DAYS = 10957;
+
+template<>
+struct DBWireBinary<int64_t>
+{
+  static std::string sqlType() {return "int8";}
+  static bool fromWireBinary(int64_t &data, const char* binary, size_t length)
+  {
+    if (length != 8) return false;
+    data = (int64_t) readNetworkOrder(binary, 8);
+    return true;
+  }
+};
+
+//! Sent as microseconds since 2000-01-01 UTC
+template<>
+struct DBWireBinary<DBTimestamp>
+{
+  static std::string sqlType() {return "timestamptz";}
+  static bool fromWireBinary(DBTimestamp &data, const char* binary, size_t length)
+  {
+    if (length != 8) return false;
+    int64_t value = (int64_t) readNetworkOrder(binary, 8);
+    //infinity and -infinity are sent as the extreme values, and kept as such
+    if (value == std::numeric_limits<int64_t>::max() || value == std::numeric_limits<int64_t>::min()) 
+    {
+      data.usec = value;
+    }
+    else data.usec = value + (int64_t) POSTGRES_EPOCH_DAYS * 86400 * 1000000;
+    return true;
+  }
+};
+
+//! Sent as days since 2000-01-01
+template<>
+struct DBWireBinary<DBDate>
+{
+  static std::string sqlType() {return "date";}
+  static bool fromWireBinary(DBDate &data, const char* binary, size_t length)
+  {
+    if (length != 4) return false;
+    int32_t value = (int32_t) (uint32_t) readNetworkOrder(binary, 4);
+    if (value == std::numeric_limits<int32_t>::max() || value == std::numeric_limits<int32_t>::min()) 
+    {
+      data.days = value;
+    }
+    else data.days = value + POSTGRES_EPOCH_DAYS;
+    return true;
+  }
+};
+
+template<>
+struct DBWireBinary<DBUuid>
+{
+  static std::string sqlType() {return "uuid";}
+  static bool fromWireBinary(DBUuid &data, const char* binary, size_t length)
+  {
+    if (length != 16) return false;
+    memcpy(data.bytes, binary, 16);
+    return true;
+  }
+};
+
+//! A field whose values are parsed by DBTextCodec<T> rather than by streams
+template <class T>
+class DBFieldCodec : public DBFieldData<T>
+{
+ protected:
+  DBFieldCodec(DBClass *owner, const DBFieldCodec<T> *other) : DBFieldData<T>(owner, other) {}
+
+ public:
+  DBFieldCodec(DBFieldBase::Type type, DBClass *owner, std::string name, std::string table_name, 
+               bool write_permission) : 
+    DBFieldData<T>(type, owner, name, table_name, write_permission) {}
+
+  virtual bool fromString(const std::string &str) 
+  {
+    return DBTextCodec<T>::fromText(this->data_, str.c_str(), str.size());
+  }
+  virtual bool fromText(const char* str, size_t length) 
+  {
+    return DBTextCodec<T>::fromText(this->data_, str, length);
+  }
+};
+
+template <>
+class DBField<int64_t> : public DBFieldCodec<int64_t>
+{
+ public:
+  DBField(Type type, DBClass *owner, std::string name, std::string table_name, bool write_permission) : 
+    DBFieldCodec<int64_t>(type, owner, name, table_name, write_permission) {}
+  DBField(DBClass *owner, const DBField<int64_t> *other) : DBFieldCodec<int64_t>(owner, other) 
+  {
+    this->copy(other);
+  }
+};
+
+template <>
+class DBField<float> : public DBFieldCodec<float>
+{
+ public:
+  DBField(Type type, DBClass *owner, std::string name, std::string table_name, bool write_permission) : 
+    DBFieldCodec<float>(type, owner, name, table_name, write_permission) {}
+  DBField(DBClass *owner, const DBField<float> *other) : DBFieldCodec<float>(owner, other) 
+  {
+    this->copy(other);
+  }
+};
+
+template <>
+class DBField<DBTimestamp> : public DBFieldCodec<DBTimestamp>
+{
+ public:
+  DBField(Type type, DBClass *owner, std::string name, std::string table_name, bool write_permission) : 
+    DBFieldCodec<DBTimestamp>(type, owner, name, table_name, write_permission) {}
+  DBField(DBClass *owner, const DBField<DBTimestamp> *other) : DBFieldCodec<DBTimestamp>(owner, other) 
+  {
+    this->copy(other);
+  }
+};
+
+template <>
+class DBField<DBDate> : public DBFieldCodec<DBDate>
+{
+ public:
+  DBField(Type type, DBClass *owner, std::string name, std::string table_name, bool write_permission) : 
+    DBFieldCodec<DBDate>(type, owner, name, table_name, write_permission) {}
+  DBField(DBClass *owner, const DBField<DBDate> *other) : DBFieldCodec<DBDate>(owner, other) 
+  {
+    this->copy(other);
+  }
+};
+
+template <>
+class DBField<DBUuid> : public DBFieldCodec<DBUuid>
+{
+ public:
+  DBField(Type type, DBClass *owner, std::string name, std::string table_name, bool write_permission) : 
+    DBFieldCodec<DBUuid>(type, owner, name, table_name, write_permission) {}
+  DBField(DBClass *owner, const DBField<DBUuid> *other) : DBFieldCodec<DBUuid>(owner, other) 
+  {
+    this->copy(other);
+  }
+};
+
 } //namespace database_interface
 
 #endif
@@ -40,7 +40,9 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/format.hpp>
 
+#include <cctype>
 #include <string>
+#include <vector>
 
 #include "database_interface/db_field.h"
 
@@ -52,6 +54,11 @@
  * specify filter clauses for a query in c++ syntax like this:
  *
  *  db.getList(seq, dbField("id") > 20 && dbField("x") < 30);
+ *
+ * Set membership is sent as a single array parameter, so the statement
+ * text is the same whatever the size of the set:
+ *
+ *  db.getList(seq, in(dbField("id"), ids));
  *  
  *  */
 
@@ -70,15 +77,154 @@ inline std::string toString<double>(const double &data)
   return (boost::format("%.5f") % data).str();
 }
 
+//! A single comparison of a column against a value, as in "column op value"
+/*! For set membership (op "in"), the set is in values_ instead. */
+struct FilterTerm
+{
+  std::string column_;
+  std::string op_;
+  std::string value_;
+  std::vector<std::string> values_;
+
+  FilterTerm(const std::string column, const std::string op, const std::string value)
+    : column_(column), op_(op), value_(value) {}
+  FilterTerm(const std::string column, const std::string op, const std::vector<std::string> &values)
+    : column_(column), op_(op), values_(values) {}
+};
+
+//! Replaces the parameter references $1, $2, ... in a clause with the given strings
+/*! References inside quoted literals and identifiers are left alone. */
+inline std::string substituteParameters(const std::string &clause, 
+                                        const std::vector<std::string> &replacements)
+{
+  std::string result;
+  size_t i = 0;
+  while (i < clause.size())
+  {
+    char c = clause[i];
+    if (c == '\'' || c == '"')
+    {
+      //copy the quoted part; a doubled quote does not end it
+      size_t end = i + 1;
+      while (end < clause.size())
+      {
+        if (clause[end] == c && end + 1 < clause.size() && clause[end+1] == c) end += 2;
+        else if (clause[end] == c) break;
+        else end++;
+      }
+      result.append(clause, i, end - i + 1);
+      i = end + 1;
+    }
+    else if (c == '$' && i + 1 < clause.size() && isdigit((unsigned char) clause[i+1]))
+    {
+      size_t end = i + 1;
+      size_t number = 0;
+      while (end < clause.size() && isdigit((unsigned char) clause[end])) 
+      {
+        number = 10*number + (clause[end] - '0');
+        end++;
+      }
+      if (number >= 1 && number <= replacements.size()) result += replacements[number-1];
+      else result.append(clause, i, end - i);
+      i = end;
+    }
+    else
+    {
+      result += c;
+      i++;
+    }
+  }
+  return result;
+}
+
+//! Formats values as a PostgreSQL array literal, e.g. {"1","2"}
+template<typename T>
+std::string toArrayLiteral(const std::vector<T> &values)
+{
+  std::string literal("{");
+  for (size_t i=0; i<values.size(); i++)
+  {
+    if (i) literal += ",";
+    literal += "\"";
+    std::string value(toString(values[i]));
+    for (size_t c=0; c<value.size(); c++)
+    {
+      if (value[c] == '"' || value[c] == '\\') literal += '\\';
+      literal += value[c];
+    }
+    literal += "\"";
+  }
+  literal += "}";
+  return literal;
+}
+
 struct FilterClause
 {
   std::string clause_;
 
-  FilterClause() {}
+  //! All the column / value comparisons that appear in this clause
+  std::vector<FilterTerm> terms_;
+
+  //! True if the clause is exactly the conjunction (AND) of its terms_
+  /*! This is what allows a clause to be evaluated outside of the database, for example
+    against an in-memory index. Clauses given as raw SQL, comparing two columns or using
+    OR are not structured. */
+  bool structured_;
+
+  //! The values of the parameters $1, $2, ... that clause_ refers to, in text format
+  /*! Sending values as parameters keeps the SQL text short and the same for any value, so 
+    the server can reuse its plan. */
+  std::vector<std::string> params_;
+
+  FilterClause() : structured_(true) {}
   FilterClause(const std::string clause)
-    : clause_(clause) {}
+    : clause_(clause), structured_(clause.empty()) {}
+
+  //! Returns the clause with the values of the parameters written in as literals
+  /*! For statements that do not take parameters, such as COPY. */
+  std::string inlineParameters() const
+  {
+    if (params_.empty()) return clause_;
+    std::vector<std::string> literals;
+    for (size_t i=0; i<params_.size(); i++)
+    {
+      std::string literal("'");
+      for (size_t c=0; c<params_[i].size(); c++)
+      {
+        if (params_[i][c] == '\'') literal += '\'';
+        literal += params_[i][c];
+      }
+      literals.push_back(literal + "'");
+    }
+    return substituteParameters(clause_, literals);
+  }
 };
 
+//! Builds the clause for "column op 'value'", which is also recorded as a term
+inline FilterClause columnValueClause(const std::string &column, const std::string &op, 
+                                      const std::string &value)
+{
+  FilterClause clause(column + " " + op + " '" + value + "'");
+  clause.terms_.push_back(FilterTerm(column, op, value));
+  clause.structured_ = true;
+  return clause;
+}
+
+//! Builds the clause for "'value' op column", recorded as a term with the column first
+inline FilterClause valueColumnClause(const std::string &value, const std::string &op, 
+                                      const std::string &column)
+{
+  std::string flipped(op);
+  if (op == "<") flipped = ">";
+  else if (op == "<=") flipped = ">=";
+  else if (op == ">") flipped = "<";
+  else if (op == ">=") flipped = "<=";
+  FilterClause clause("'" + value + "' " + op + " " + column);
+  clause.terms_.push_back(FilterTerm(column, flipped, value));
+  clause.structured_ = true;
+  return clause;
+}
+
 struct dbField
 {
   std::string name_;
@@ -98,13 +244,13 @@ struct dbField
 template<typename T>
 FilterClause operator<(const DBField<T> &lhs, const T &rhs)
 {
-  return FilterClause(lhs.getName() + " < '" + toString(rhs) + "'");
+  return columnValueClause(lhs.getName(), "<", toString(rhs));
 }
     
 template<typename T>
 FilterClause operator<(const T &lhs, const DBField<T> &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' < " + rhs.getName());
+  return valueColumnClause(toString(lhs), "<", rhs.getName());
 }
 
 template<typename T>
@@ -116,13 +262,13 @@ FilterClause operator<(const DBField<T> &lhs, const DBField<T> &rhs)
 template<typename T>
 FilterClause operator<(const dbField &lhs, const T &rhs)
 {
-  return FilterClause(lhs.name_ + " < '" + toString(rhs) + "'");
+  return columnValueClause(lhs.name_, "<", toString(rhs));
 }
 
 template<typename T>
 FilterClause operator<(const T &lhs, const dbField &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' < " + rhs.name_);
+  return valueColumnClause(toString(lhs), "<", rhs.name_);
 }
 
 template<typename T>
@@ -135,13 +281,13 @@ FilterClause operator<(const dbField &lhs, const dbField &rhs)
 template<typename T>
 FilterClause operator<=(const DBField<T> &lhs, const T &rhs)
 {
-  return FilterClause(lhs.getName() + " <= '" + toString(rhs) + "'");
+  return columnValueClause(lhs.getName(), "<=", toString(rhs));
 }
     
 template<typename T>
 FilterClause operator<=(const T &lhs, const DBField<T> &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' <= " + rhs.getName());
+  return valueColumnClause(toString(lhs), "<=", rhs.getName());
 }
 
 template<typename T>
@@ -153,13 +299,13 @@ FilterClause operator<=(const DBField<T> &lhs, const DBField<T> &rhs)
 template<typename T>
 FilterClause operator<=(const dbField &lhs, const T &rhs)
 {
-  return FilterClause(lhs.name_ + " <= '" + toString(rhs) + "'");
+  return columnValueClause(lhs.name_, "<=", toString(rhs));
 }
 
 template<typename T>
 FilterClause operator<=(const T &lhs, const dbField &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' <= " + rhs.name_);
+  return valueColumnClause(toString(lhs), "<=", rhs.name_);
 }
 
 template<typename T>
@@ -172,13 +318,13 @@ FilterClause operator<=(const dbField &lhs, const dbField &rhs)
 template<typename T>
 FilterClause operator>(const DBField<T> &lhs, const T &rhs)
 {
-  return FilterClause(lhs.getName() + " > '" + toString(rhs) + "'");
+  return columnValueClause(lhs.getName(), ">", toString(rhs));
 }
     
 template<typename T>
 FilterClause operator>(const T &lhs, const DBField<T> &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' > " + rhs.getName());
+  return valueColumnClause(toString(lhs), ">", rhs.getName());
 }
 
 template<typename T>
@@ -190,13 +336,13 @@ FilterClause operator>(const DBField<T> &lhs, const DBField<T> &rhs)
 template<typename T>
 FilterClause operator>(const dbField &lhs, const T &rhs)
 {
-  return FilterClause(lhs.name_ + " > '" + toString(rhs) + "'");
+  return columnValueClause(lhs.name_, ">", toString(rhs));
 }
 
 template<typename T>
 FilterClause operator>(const T &lhs, const dbField &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' > " + rhs.name_);
+  return valueColumnClause(toString(lhs), ">", rhs.name_);
 }
 
 template<typename T>
@@ -209,13 +355,13 @@ FilterClause operator>(const dbField &lhs, const dbField &rhs)
 template<typename T>
 FilterClause operator>=(const DBField<T> &lhs, const T &rhs)
 {
-  return FilterClause(lhs.getName() + " >= '" + toString(rhs) + "'");
+  return columnValueClause(lhs.getName(), ">=", toString(rhs));
 }
     
 template<typename T>
 FilterClause operator>=(const T &lhs, const DBField<T> &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' >= " + rhs.getName());
+  return valueColumnClause(toString(lhs), ">=", rhs.getName());
 }
 
 template<typename T>
@@ -227,13 +373,13 @@ FilterClause operator>=(const DBField<T> &lhs, const DBField<T> &rhs)
 template<typename T>
 FilterClause operator>=(const dbField &lhs, const T &rhs)
 {
-  return FilterClause(lhs.name_ + " >= '" + toString(rhs) + "'");
+  return columnValueClause(lhs.name_, ">=", toString(rhs));
 }
 
 template<typename T>
 FilterClause operator>=(const T &lhs, const dbField &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' >= " + rhs.name_);
+  return valueColumnClause(toString(lhs), ">=", rhs.name_);
 }
 
 template<typename T>
@@ -246,13 +392,13 @@ FilterClause operator>=(const dbField &lhs, const dbField &rhs)
 template<typename T>
 FilterClause operator==(const DBField<T> &lhs, const T &rhs)
 {
-  return FilterClause(lhs.getName() + " == '" + toString(rhs) + "'");
+  return columnValueClause(lhs.getName(), "==", toString(rhs));
 }
     
 template<typename T>
 FilterClause operator==(const T &lhs, const DBField<T> &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' == " + rhs.getName());
+  return valueColumnClause(toString(lhs), "==", rhs.getName());
 }
 
 template<typename T>
@@ -264,13 +410,13 @@ FilterClause operator==(const DBField<T> &lhs, const DBField<T> &rhs)
 template<typename T>
 FilterClause operator==(const dbField &lhs, const T &rhs)
 {
-  return FilterClause(lhs.name_ + " == '" + toString(rhs) + "'");
+  return columnValueClause(lhs.name_, "==", toString(rhs));
 }
 
 template<typename T>
 FilterClause operator==(const T &lhs, const dbField &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' == " + rhs.name_);
+  return valueColumnClause(toString(lhs), "==", rhs.name_);
 }
 
 template<typename T>
@@ -283,13 +429,13 @@ FilterClause operator==(const dbField &lhs, const dbField &rhs)
 template<typename T>
 FilterClause operator!=(const DBField<T> &lhs, const T &rhs)
 {
-  return FilterClause(lhs.getName() + " != '" + toString(rhs) + "'");
+  return columnValueClause(lhs.getName(), "!=", toString(rhs));
 }
-
+    
 template<typename T>
 FilterClause operator!=(const T &lhs, const DBField<T> &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' != " + rhs.getName());
+  return valueColumnClause(toString(lhs), "!=", rhs.getName());
 }
 
 template<typename T>
@@ -301,13 +447,13 @@ FilterClause operator!=(const DBField<T> &lhs, const DBField<T> &rhs)
 template<typename T>
 FilterClause operator!=(const dbField &lhs, const T &rhs)
 {
-  return FilterClause(lhs.name_ + " != '" + toString(rhs) + "'");
+  return columnValueClause(lhs.name_, "!=", toString(rhs));
 }
 
 template<typename T>
 FilterClause operator!=(const T &lhs, const dbField &rhs)
 {
-  return FilterClause("'" + toString(lhs) + "' != " + rhs.name_);
+  return valueColumnClause(toString(lhs), "!=", rhs.name_);
 }
 
 template<typename T>
@@ -316,15 +462,94 @@ FilterClause operator!=(const dbField &lhs, const dbField &rhs)
   return FilterClause(lhs.name_ + " != " + rhs.name_);
 }
 
+// Array membership: the array column contains the value
+template<typename T, typename V>
+FilterClause contains(const DBField< std::vector<T> > &field, const V &value)
+{
+  FilterClause clause("'" + toString(value) + "' = ANY(" + field.getName() + ")");
+  clause.terms_.push_back(FilterTerm(field.getName(), "contains", toString(value)));
+  clause.structured_ = true;
+  return clause;
+}
+
+template<typename V>
+FilterClause contains(const dbField &field, const V &value)
+{
+  FilterClause clause("'" + toString(value) + "' = ANY(" + field.name_ + ")");
+  clause.terms_.push_back(FilterTerm(field.name_, "contains", toString(value)));
+  clause.structured_ = true;
+  return clause;
+}
+
+// Set membership: the value of the column is one of the given values
+template<typename V>
+FilterClause in(const dbField &field, const std::vector<V> &values)
+{
+  FilterClause clause(field.name_ + " = ANY($1)");
+  clause.params_.push_back(toArrayLiteral(values));
+  std::vector<std::string> strings;
+  for (size_t i=0; i<values.size(); i++) strings.push_back(toString(values[i]));
+  clause.terms_.push_back(FilterTerm(field.name_, "in", strings));
+  clause.structured_ = true;
+  return clause;
+}
+
+template<typename T, typename V>
+FilterClause in(const DBField<T> &field, const std::vector<V> &values)
+{
+  return in(dbField(field.getName()), values);
+}
+
+template<typename V>
+FilterClause notIn(const dbField &field, const std::vector<V> &values)
+{
+  FilterClause clause(field.name_ + " <> ALL($1)");
+  clause.params_.push_back(toArrayLiteral(values));
+  return clause;
+}
+
+template<typename T, typename V>
+FilterClause notIn(const DBField<T> &field, const std::vector<V> &values)
+{
+  return notIn(dbField(field.getName()), values);
+}
+
+//! Builds the text of lhs op rhs, renumbering the parameters of rhs to follow those of lhs
+inline FilterClause combineClauses(const FilterClause &lhs, const std::string &op, const FilterClause &rhs)
+{
+  std::string rhs_clause(rhs.clause_);
+  if (!lhs.params_.empty() && !rhs.params_.empty())
+  {
+    std::vector<std::string> renumbered;
+    for (size_t i=0; i<rhs.params_.size(); i++)
+    {
+      renumbered.push_back("$" + toString(lhs.params_.size() + i + 1));
+    }
+    rhs_clause = substituteParameters(rhs_clause, renumbered);
+  }
+  FilterClause clause(" ( " + lhs.clause_ + " " + op + " " + rhs_clause + " )");
+  clause.params_ = lhs.params_;
+  clause.params_.insert(clause.params_.end(), rhs.params_.begin(), rhs.params_.end());
+  return clause;
+}
+
 // Combination clauses (and, or, ...)
 inline FilterClause operator&&(const FilterClause &lhs, const FilterClause &rhs)
 {
-  return FilterClause(" ( " + lhs.clause_ + " AND " + rhs.clause_ + " )");
+  FilterClause clause(combineClauses(lhs, "AND", rhs));
+  clause.terms_ = lhs.terms_;
+  clause.terms_.insert(clause.terms_.end(), rhs.terms_.begin(), rhs.terms_.end());
+  clause.structured_ = lhs.structured_ && rhs.structured_;
+  return clause;
 }
 
 inline FilterClause operator||(const FilterClause &lhs, const FilterClause &rhs)
 {
-  return FilterClause(" ( " + lhs.clause_ + " OR " + rhs.clause_ + " )");
+  FilterClause clause(combineClauses(lhs, "OR", rhs));
+  clause.terms_ = lhs.terms_;
+  clause.terms_.insert(clause.terms_.end(), rhs.terms_.begin(), rhs.terms_.end());
+  clause.structured_ = false;
+  return clause;
 }
 
 } //namespace
@@ -0,0 +1,125 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+
+#ifndef _DB_FUNCTION_H_
+#define _DB_FUNCTION_H_
+
+#include <string>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include "database_interface/db_field.h"
+#include "database_interface/db_filters.h"
+
+namespace database_interface
+{
+
+//! A call to a function stored on the server, with its arguments
+/*! The arguments are sent as parameters, so the statement text only depends on the function
+  and the number of arguments, and the statement is prepared once per connection like any
+  other. Arguments are converted with the same toString(...) used by the filters, except
+  for doubles, which are written with all their digits:
+
+    double gpa;
+    db.callFunction(FunctionCall("recompute_gpa").arg(student_id), gpa);
+
+  When the function is overloaded, an argument can be given an explicit SQL type:
+
+    FunctionCall("find_students").arg(ids, "int[]").arg(3.0)
+*/
+class FunctionCall
+{
+ private:
+  std::string name_;
+  std::vector<std::string> args_;
+  std::vector<std::string> types_;
+
+  template <typename T>
+  static std::string argString(const T &value) {return toString(value);}
+
+  //! Unlike toString(...), keeps enough digits for the value to be read back exactly
+  static std::string argString(double value) {return (boost::format("%.17g") % value).str();}
+
+ public:
+  explicit FunctionCall(const std::string &name) : name_(name) {}
+
+  template <typename T>
+  FunctionCall& arg(const T &value, const std::string &sql_type = "")
+  {
+    args_.push_back(argString(value));
+    types_.push_back(sql_type);
+    return *this;
+  }
+
+  //! Arrays are sent as a single array literal
+  template <typename T>
+  FunctionCall& arg(const std::vector<T> &values, const std::string &sql_type = "")
+  {
+    std::vector<std::string> strings;
+    for (size_t i=0; i<values.size(); i++) strings.push_back(argString(values[i]));
+    args_.push_back(toArrayLiteral(strings));
+    types_.push_back(sql_type);
+    return *this;
+  }
+
+  const std::string& getName() const {return name_;}
+
+  //! The call as it appears in SQL, e.g. find_students($1::int[], $2)
+  std::string getSql() const
+  {
+    std::string sql = name_ + "(";
+    for (size_t i=0; i<args_.size(); i++)
+    {
+      if (i) sql += ", ";
+      sql += "$" + toString(i+1);
+      if (!types_[i].empty()) sql += "::" + types_[i];
+    }
+    return sql + ")";
+  }
+
+  //! The arguments, as the parameters of an otherwise empty filter clause
+  FilterClause getParameters() const
+  {
+    FilterClause clause;
+    clause.params_ = args_;
+    return clause;
+  }
+};
+
+} //namespace
+
+#endif
@@ -0,0 +1,105 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#ifndef _DB_PROJECTION_H_
+#define _DB_PROJECTION_H_
+
+#include <string>
+#include <vector>
+
+#include "database_interface/db_field.h"
+#include "database_interface/db_filters.h"
+
+namespace database_interface
+{
+
+//! The list of columns that a single getList call should retrieve
+/*! This is an alternative to building an example instance and calling setReadFromDatabase
+  on its fields. The projection only affects the call it is passed to; the default read
+  flags of the class are left untouched. The primary key is always retrieved, whether it
+  is listed or not.
+
+  Columns can be given either by name or as pointers to the DBField members of the class:
+
+    db.getList(students, Projection(&Student::student_gpa_).add(&Student::student_last_name_));
+    db.getList(students, Projection(dbField("student_gpa")), dbField("student_gpa") > 3.0);
+*/
+class Projection
+{
+ private:
+  std::vector<std::string> names_;
+
+ public:
+  Projection() {}
+
+  Projection(const dbField &field) {add(field);}
+
+  template <class C, class F>
+  Projection(DBField<F> C::*member) {add(member);}
+
+  Projection& add(const dbField &field)
+  {
+    names_.push_back(field.name_);
+    return *this;
+  }
+
+  //! Adds the column that a DBField member of class C is stored in
+  /*! The column name is only known once the member is constructed, so this instantiates
+    a C to look it up. */
+  template <class C, class F>
+  Projection& add(DBField<F> C::*member)
+  {
+    C example;
+    names_.push_back((example.*member).getName());
+    return *this;
+  }
+
+  const std::vector<std::string>& getNames() const {return names_;}
+
+  //! A string that identifies this list of columns, used as a cache key
+  std::string getKey() const
+  {
+    std::string key;
+    for (size_t i=0; i<names_.size(); i++)
+    {
+      key += names_[i] + ",";
+    }
+    return key;
+  }
+};
+
+} //namespace
+
+#endif
@@ -0,0 +1,216 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#ifndef _DB_QUERY_STATS_H_
+#define _DB_QUERY_STATS_H_
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <ros/ros.h>
+
+#include "database_interface/db_field.h"
+
+namespace database_interface {
+
+//! Returns the statement with its literals replaced by '?' and its whitespace collapsed
+/*! Statements that only differ in the values they use have the same fingerprint. Lists of
+  values, such as the contents of IN (...), are reduced to a single '?'. */
+std::string fingerprintQuery(const std::string &query);
+
+//! Warns when the same statement, up to its literals, is sent too many times in a short time
+/*! This is the typical signature of a loop that calls loadFromDatabase or getList once per
+  item (the "N+1 queries" problem). The warning names the batched call to use instead.
+  Disabled by default, as fingerprinting every statement has a cost; meant for debugging.
+ */
+class RepeatedQueryDetector
+{
+ private:
+  struct Entry
+  {
+    ros::WallTime window_start;
+    unsigned int count;
+    bool warned;
+  };
+  std::map<std::string, Entry> entries_;
+
+  //! Number of repetitions within the window that triggers a warning; 0 means disabled
+  unsigned int threshold_;
+  double window_;
+  bool print_stack_;
+  //! Included in warnings, to identify the code that issued the statements
+  std::string tag_;
+
+ public:
+  RepeatedQueryDetector() : threshold_(0), window_(1.0), print_stack_(false) {}
+
+  //! Warns when a statement runs more than threshold times within window seconds
+  void configure(unsigned int threshold, double window, bool print_stack);
+  bool isEnabled() const {return threshold_ > 0;}
+
+  //! Sets the tag, and starts counting afresh
+  void setTag(const std::string &tag);
+  const std::string& getTag() const {return tag_;}
+
+  //! Records a statement. Returns true if it triggered a warning.
+  bool record(const std::string &query);
+
+  //! Forgets the statements seen so far
+  void reset() {entries_.clear();}
+};
+
+//! A column compared by a filter, and the comparison
+struct FilterColumnUsage
+{
+  //! The table the column belongs to
+  std::string table;
+  std::string column;
+  //! The comparison: "=", "!=", "<", "<=", ">", ">=", "in" or "contains"
+  std::string op;
+  //! A value the column was compared to, for trying out the filter later
+  std::string sample;
+};
+
+//! How often a filter of a given shape was used to query one class, and how long it took
+/*! Filters have the same shape if they compare the same columns in the same way, whatever
+  the values. */
+struct FilterUsage
+{
+  //! The primary key table of the class queried
+  std::string table;
+  //! False if the filter has parts other than comparisons joined by AND (see FilterClause)
+  bool structured;
+  //! The comparisons, sorted by table, column and comparison
+  std::vector<FilterColumnUsage> columns;
+  unsigned long count;
+  double total_time;
+  double max_time;
+  unsigned long rows;
+
+  FilterUsage() : structured(true), count(0), total_time(0.0), max_time(0.0), rows(0) {}
+
+  //! Identifies the shape of the filter, e.g. "grades: grades.student_id = AND grades.grade >"
+  std::string getSignature() const;
+};
+
+//! Collects FilterUsage for each filter shape issued; disabled by default
+/*! The statistics can be saved to a file and examined with the filter_index_advisor tool,
+  which compares them with the indexes in the database. */
+class FilterUsageStats
+{
+ private:
+  std::map<std::string, FilterUsage> entries_;
+  bool enabled_;
+
+ public:
+  FilterUsageStats() : enabled_(false) {}
+
+  void setEnabled(bool enabled) {enabled_ = enabled;}
+  bool isEnabled() const {return enabled_;}
+
+  //! Adds one use of a filter with the given shape, which took seconds and returned rows
+  void record(const FilterUsage &shape, double seconds, unsigned long rows);
+
+  //! Returns the statistics of all shapes recorded, most time consuming first
+  void getEntries(std::vector<FilterUsage> &entries) const;
+
+  void clear() {entries_.clear();}
+
+  //! Writes the statistics to a text file
+  bool save(const std::string &filename) const;
+
+  //! Reads statistics from a file written by save(), adding them to the ones already here
+  bool load(const std::string &filename);
+};
+
+//! The time spent converting the values of one column, after receiving them or to send them
+struct FieldCodecUsage
+{
+  std::string table;
+  std::string column;
+  //! The C++ type of the field, e.g. "database_interface::DBField<double>"
+  std::string type;
+
+  unsigned long decodes;
+  double decode_time;
+  unsigned long long decode_bytes;
+
+  unsigned long encodes;
+  double encode_time;
+  unsigned long long encode_bytes;
+
+  FieldCodecUsage() : decodes(0), decode_time(0.0), decode_bytes(0), 
+                      encodes(0), encode_time(0.0), encode_bytes(0) {}
+
+  double getTotalTime() const {return decode_time + encode_time;}
+};
+
+//! Collects FieldCodecUsage for each column decoded by getList or encoded by inserts and saves
+/*! Disabled by default, as timing each value has a cost of its own. The columns that come
+  first in the report are the ones worth giving a wire type and reading with binary results 
+  (see PostgresqlDatabase::setBinaryResults), or leaving out of projections. */
+class FieldCodecStats
+{
+ private:
+  //! Keyed on table, column and type
+  std::map<std::string, FieldCodecUsage> entries_;
+  bool enabled_;
+
+  FieldCodecUsage& getEntry(const DBFieldBase *field);
+
+ public:
+  FieldCodecStats() : enabled_(false) {}
+
+  void setEnabled(bool enabled) {enabled_ = enabled;}
+  bool isEnabled() const {return enabled_;}
+
+  //! Adds the conversion of one value of the field, of the given size in bytes
+  void recordDecode(const DBFieldBase *field, double seconds, size_t bytes);
+  void recordEncode(const DBFieldBase *field, double seconds, size_t bytes);
+
+  //! Returns the statistics of all columns recorded, most time consuming first
+  void getEntries(std::vector<FieldCodecUsage> &entries) const;
+
+  //! Writes the statistics as a table, most time consuming column first
+  void printReport(std::ostream &str) const;
+
+  void clear() {entries_.clear();}
+};
+
+} //namespace
+
+#endif
@@ -0,0 +1,232 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#ifndef _DB_SNAPSHOT_H_
+#define _DB_SNAPSHOT_H_
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+
+//for ROS error messages
+#include <ros/ros.h>
+
+#include "database_interface/db_class.h"
+
+namespace database_interface {
+
+//! Writes a collection of instances to a snapshot file that can be memory-mapped back
+/*! The file holds one column per field. Each column has a fixed-width table of offsets,
+  one per row, into an arena holding the values themselves, so that any value can be
+  found without reading the ones before it. TEXT fields are stored in the same string form
+  they have in the database and BINARY fields as their raw bytes.
+
+  The file also stores a watermark: an arbitrary string describing how recent the data is,
+  which can be used after loading the snapshot to fetch only what has changed since.
+
+  Format (all integers are little-endian, all offsets are from the start of the file):
+  - header: magic "DBSNAP\0\0", uint32 version, uint32 number of columns, uint64 number 
+    of rows, uint64 watermark offset and length
+  - for each column: uint64 name offset and length, uint32 type, uint32 reserved,
+    uint64 offset of its offset table, uint64 arena offset and length
+  - names, watermark, offset tables (number of rows + 1 entries each, relative to the 
+    arena) and arenas
+ */
+class SnapshotWriter
+{
+ protected:
+  struct Column
+  {
+    std::string name;
+    DBFieldBase::Type type;
+    std::vector<boost::uint64_t> offsets;
+    std::string arena;
+  };
+  std::vector<Column> columns_;
+  std::string watermark_;
+
+ public:
+  static const boost::uint32_t VERSION = 1;
+
+  //! Adds a column. All columns must be added before any rows.
+  void addColumn(const std::string &name, DBFieldBase::Type type);
+
+  //! Adds a value to a column; values must be added row by row, in column order
+  void addValue(size_t column, const char *data, size_t length);
+
+  void setWatermark(const std::string &watermark) {watermark_ = watermark;}
+
+  //! Writes everything added so far to a file
+  bool write(const std::string &filename) const;
+};
+
+//! A snapshot file written by SnapshotWriter, mapped read-only in memory
+/*! Values are read straight from the mapped file; nothing is copied until the values are
+  parsed into instances. */
+class SnapshotFile
+{
+ protected:
+  const char *data_;
+  size_t size_;
+  boost::uint32_t num_columns_;
+  boost::uint64_t num_rows_;
+
+  //! Returns the position of the descriptor of a column
+  const char* getColumnDescriptor(size_t column) const;
+
+ public:
+  SnapshotFile() : data_(NULL), size_(0), num_columns_(0), num_rows_(0) {}
+  ~SnapshotFile() {close();}
+
+  //! Maps the file and checks that it is a valid snapshot of a supported version
+  bool open(const std::string &filename);
+  void close();
+  bool isOpen() const {return data_ != NULL;}
+
+  size_t getNumRows() const {return num_rows_;}
+  size_t getNumColumns() const {return num_columns_;}
+  std::string getColumnName(size_t column) const;
+  DBFieldBase::Type getColumnType(size_t column) const;
+  std::string getWatermark() const;
+
+  //! Points to a value inside the mapped file
+  void getValue(size_t row, size_t column, const char* &data, size_t &length) const;
+
+ private:
+  //! Not copyable, since it owns the mapping
+  SnapshotFile(const SnapshotFile&);
+  SnapshotFile& operator = (const SnapshotFile&);
+};
+
+//! Writes the primary key and all other fields of the instances to a snapshot file
+template <class T>
+bool writeSnapshot(const std::string &filename, const std::vector< boost::shared_ptr<T> > &vec,
+                   const std::string &watermark = std::string())
+{
+  T example;
+  SnapshotWriter writer;
+  writer.addColumn(example.getPrimaryKeyField()->getName(), example.getPrimaryKeyField()->getType());
+  for (size_t i=0; i<example.getNumFields(); i++)
+  {
+    writer.addColumn(example.getField(i)->getName(), example.getField(i)->getType());
+  }
+  writer.setWatermark(watermark);
+
+  std::string str;
+  for (size_t r=0; r<vec.size(); r++)
+  {
+    for (size_t c=0; c<=example.getNumFields(); c++)
+    {
+      const DBFieldBase *field = c ? vec[r]->getField(c-1) : vec[r]->getPrimaryKeyField();
+      if (field->getType() == DBFieldBase::BINARY)
+      {
+        const char *binary = NULL; 
+        size_t length = 0;
+        if (!field->toBinary(binary, length))
+        {
+          ROS_ERROR("Write snapshot: failed to convert field %s to binary", field->getName().c_str());
+          return false;
+        }
+        writer.addValue(c, binary, length);
+      }
+      else
+      {
+        if (!field->toString(str))
+        {
+          ROS_ERROR("Write snapshot: failed to convert field %s to string", field->getName().c_str());
+          return false;
+        }
+        writer.addValue(c, str.data(), str.size());
+      }
+    }
+  }
+  return writer.write(filename);
+}
+
+//! Creates instances from the rows of a snapshot file
+/*! Columns are matched to fields by name; columns that are not fields of T are ignored,
+  and fields that have no column keep their default values. */
+template <class T>
+bool readSnapshot(const SnapshotFile &file, std::vector< boost::shared_ptr<T> > &vec)
+{
+  T example;
+  //the index of the field each column goes into; -1 for the primary key, -2 for none
+  std::vector<int> field_ids(file.getNumColumns(), -2);
+  for (size_t c=0; c<file.getNumColumns(); c++)
+  {
+    std::string name = file.getColumnName(c);
+    if (name == example.getPrimaryKeyField()->getName()) field_ids[c] = -1;
+    for (size_t i=0; i<example.getNumFields(); i++)
+    {
+      if (example.getField(i)->getName() == name) field_ids[c] = i;
+    }
+  }
+
+  vec.clear();
+  vec.reserve(file.getNumRows());
+  std::string str;
+  for (size_t r=0; r<file.getNumRows(); r++)
+  {
+    boost::shared_ptr<T> entry(new T);
+    for (size_t c=0; c<file.getNumColumns(); c++)
+    {
+      if (field_ids[c] == -2) continue;
+      DBFieldBase *field = field_ids[c] < 0 ? entry->getPrimaryKeyField() : entry->getField(field_ids[c]);
+      const char *data;
+      size_t length;
+      file.getValue(r, c, data, length);
+      bool success;
+      if (field->getType() != file.getColumnType(c)) success = false;
+      else if (field->getType() == DBFieldBase::BINARY) success = field->fromBinary(data, length);
+      else 
+      {
+        str.assign(data, length);
+        success = field->fromString(str);
+      }
+      if (!success)
+      {
+        ROS_ERROR("Read snapshot: failed to parse row %d of column %s", (int)r, field->getName().c_str());
+        return false;
+      }
+    }
+    vec.push_back(entry);
+  }
+  return true;
+}
+
+} //namespace
+
+#endif
@@ -0,0 +1,106 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#ifndef _DB_TRACE_H_
+#define _DB_TRACE_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <boost/thread/mutex.hpp>
+
+#include <ros/ros.h>
+
+namespace database_interface {
+
+//! A timed database operation, as reported to a TraceSink
+/*! Top-level spans are the public operations of PostgresqlDatabase (getList, 
+  saveToDatabase, ...). Their children are "sql_build", "network_wait" (one per statement
+  sent to the server) and "decode".
+ */
+struct TraceSpan
+{
+  //! Unique within the database instance that created the span
+  unsigned long id;
+  //! The id of the enclosing span, 0 for a top-level span
+  unsigned long parent_id;
+  std::string operation;
+  //! The table of the primary key of the DBClass involved, if any
+  std::string table;
+  ros::WallTime start;
+  ros::WallTime end;
+  //! Number of rows returned or affected, -1 if unknown
+  long long rows;
+  //! Number of bytes received, -1 if unknown
+  long long bytes;
+  //! The server process id of the connection used, 0 if none
+  int connection_id;
+  unsigned long thread_id;
+  //! Empty if the operation succeeded
+  std::string error;
+};
+
+//! Receives the spans of finished operations
+/*! Spans are reported when they end, so children are reported before their parent. The
+  same sink can be shared by several database instances, in different threads. */
+class TraceSink
+{
+ public:
+  virtual ~TraceSink() {}
+  virtual void record(const TraceSpan &span) = 0;
+};
+
+//! Writes spans to a file in the Chrome trace event format
+/*! The file can be opened in chrome://tracing or in Perfetto. It is complete once the
+  writer has been destroyed. */
+class ChromeTraceWriter : public TraceSink
+{
+ private:
+  FILE *file_;
+  bool first_event_;
+  boost::mutex mutex_;
+
+ public:
+  ChromeTraceWriter(const std::string &filename);
+  ~ChromeTraceWriter();
+
+  bool isOpen() const {return file_ != NULL;}
+
+  virtual void record(const TraceSpan &span);
+};
+
+} //namespace
+
+#endif
@@ -0,0 +1,327 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#ifndef _LOGICAL_REPLICATION_H_
+#define _LOGICAL_REPLICATION_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/bind/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "database_interface/postgresql_database.h"
+#include "database_interface/db_collection.h"
+
+namespace database_interface {
+
+//! A table, as described by the server in the replication stream
+struct ReplicationRelation
+{
+  unsigned int id;
+  std::string schema;
+  std::string name;
+  //! The names of the columns, in the order their values are sent in
+  std::vector<std::string> columns;
+};
+
+//! The value of one column in a replicated row
+struct ReplicationValue
+{
+  /*! UNCHANGED is sent for large (TOASTed) values that an UPDATE did not modify; the old 
+    value must be kept. */
+  enum Kind {NULL_VALUE, UNCHANGED, TEXT};
+  Kind kind;
+  //! The value in the database's text format
+  std::string text;
+};
+
+//! A change to a row of a table, decoded from the replication stream
+struct ReplicationChange
+{
+  enum Type {INSERT, UPDATE, DELETE, TRUNCATE};
+  Type type;
+  const ReplicationRelation *relation;
+  //! For UPDATE and DELETE, the key (or, with REPLICA IDENTITY FULL, all) columns of the old row
+  /*! May be empty for an UPDATE that does not change the key. */
+  std::vector<ReplicationValue> old_values;
+  //! For INSERT and UPDATE, all columns of the new row
+  std::vector<ReplicationValue> new_values;
+};
+
+//! Receives row changes from the server through logical replication
+/*! Uses the pgoutput plugin that comes with the server, over a replication connection. The
+  tables to be replicated must be in a publication (CREATE PUBLICATION ... FOR TABLE ...),
+  and the user needs the REPLICATION attribute.
+
+  Changes are delivered, in commit order, to the callbacks subscribed to their table. The
+  server keeps the changes in the replication slot until we confirm them; a change is 
+  confirmed once the callbacks for its whole transaction have run. If the client stops, it
+  can resume from the slot, and will receive again any transaction it had not confirmed.
+
+  Example:
+
+    LogicalReplicationClient client(config);
+    client.createSlot("my_slot");
+    client.subscribe("student", callback);
+    client.start("my_slot", "my_publication");
+    while (ros::ok()) client.spinOnce(0.1);
+ */
+class LogicalReplicationClient
+{
+ public:
+  typedef boost::function<bool (const ReplicationChange&)> ChangeCallback;
+
+ protected:
+  PGconn *connection_;
+  bool streaming_;
+
+  //! Tables we have been told about, by relation id
+  std::map<unsigned int, ReplicationRelation> relations_;
+
+  //! Callbacks, by table name
+  std::multimap<std::string, ChangeCallback> callbacks_;
+
+  //! The end of the last transaction we have fully processed
+  unsigned long long confirmed_lsn_;
+
+  //! The last position the server told us about
+  unsigned long long received_lsn_;
+
+  //! Whether we are between the Begin and the Commit of a transaction
+  /*! Transactions are sent in commit order, so one can start below the end of the previous
+    one; received_lsn_ alone does not tell whether we are inside one. */
+  bool in_transaction_;
+
+  //! When we last sent our position to the server
+  ros::WallTime last_status_time_;
+
+  //! Decodes one pgoutput message
+  bool handleMessage(const char *data, size_t length);
+
+  //! Handles one message from the replication stream, which can contain a pgoutput message
+  bool handleCopyData(const char *data, size_t length);
+
+  //! Calls the callbacks subscribed to the changed table; false if one of them fails
+  bool dispatch(const ReplicationChange &change);
+
+  //! Tells the server how far we have got
+  bool sendStatus(bool reply_requested);
+
+ public:
+  //! Opens a replication connection to the database described by the config
+  LogicalReplicationClient(const PostgresqlDatabaseConfig &config);
+
+  ~LogicalReplicationClient();
+
+  bool isConnected() const;
+
+  //! Creates a logical replication slot using pgoutput. Succeeds if the slot already exists.
+  bool createSlot(const std::string &slot_name);
+
+  //! Calls the callback for every change to the table, given as "name" or "schema.name"
+  /*! A callback returns false if it could not handle the change. The stream then stops: 
+    spinOnce returns false and the transaction is not confirmed, so a new client started 
+    from the same slot receives it again. */
+  void subscribe(const std::string &table, const ChangeCallback &callback);
+
+  //! Starts streaming changes from the slot
+  /*! The server starts after the last position confirmed on the slot, or after start_lsn
+    if that is further on. The position can be obtained with getConfirmedLsn(). */
+  bool start(const std::string &slot_name, const std::string &publication, 
+             const std::string &start_lsn = "0/0");
+
+  //! Processes the changes that arrive within the timeout (in seconds)
+  /*! Returns false if the connection fails or a change could not be handled; the client 
+    then stops streaming. */
+  bool spinOnce(double timeout);
+
+  //! The position up to which all changes have been processed, in the "XXX/YYY" format
+  std::string getConfirmedLsn() const;
+
+ private:
+  LogicalReplicationClient(const LogicalReplicationClient&);
+  LogicalReplicationClient& operator = (const LogicalReplicationClient&);
+};
+
+//! Keeps a DBCollection of T up to date with the changes to the primary key table of T
+/*! Only the text fields stored in the primary key table are replicated. Changed rows are
+  decoded into new instances of T that replace the old ones in the collection; fields in 
+  other tables and binary fields (which getList does not load either) are carried over 
+  from the instance being replaced. Optionally, a callback is called with each change 
+  after it has been applied.
+
+  A change that cannot be applied stops the stream (see LogicalReplicationClient::subscribe),
+  so the collection never silently drifts away from the table.
+
+  The collection should be loaded after replication has started (or from a point older
+  than the slot), so that no change is missed.
+ */
+template <class T>
+class DBCollectionReplicator
+{
+ public:
+  typedef boost::shared_ptr<T> EntryPtr;
+  //! Called with the type of change and the new instance (the old one for DELETE, none for TRUNCATE)
+  typedef boost::function<void (ReplicationChange::Type, const EntryPtr&)> Callback;
+
+ protected:
+  DBCollection<T> &collection_;
+  Callback callback_;
+
+  //! Whether the value of a field comes with the rows of the primary key table
+  static bool isReplicated(const DBClass &entry, const DBFieldBase *field)
+  {
+    return field->getType() == DBFieldBase::TEXT && 
+      field->getTableName() == entry.getPrimaryKeyField()->getTableName();
+  }
+
+  //! Copies the value of one field into another of the same type
+  static bool copyValue(const DBFieldBase *from, DBFieldBase *to)
+  {
+    if (to->getType() == DBFieldBase::BINARY)
+    {
+      const char *binary = NULL;
+      size_t length = 0;
+      return from->toBinary(binary, length) && to->fromBinary(binary, length);
+    }
+    std::string value;
+    return from->toString(value) && to->fromString(value);
+  }
+
+  //! Sets the fields of the entry from the columns of a row; the other fields are taken from old
+  bool decode(const ReplicationChange &change, const std::vector<ReplicationValue> &values,
+              const EntryPtr &old, T &entry) const
+  {
+    for (size_t f=0; old && f<entry.getNumFields(); f++)
+    {
+      DBFieldBase *field = entry.getField(f);
+      if (isReplicated(entry, field)) continue;
+      if (!copyValue(old->getField(f), field))
+      {
+        ROS_ERROR("Replication: failed to keep the value of field %s", field->getName().c_str());
+        return false;
+      }
+    }
+    for (size_t c=0; c<values.size() && c<change.relation->columns.size(); c++)
+    {
+      DBFieldBase *field = entry.getField(change.relation->columns[c]);
+      if (!field || !isReplicated(entry, field)) continue;
+      std::string value;
+      if (values[c].kind == ReplicationValue::TEXT) value = values[c].text;
+      else if (values[c].kind == ReplicationValue::UNCHANGED && old)
+      {
+        if (!old->getField(field->getName())->toString(value)) return false;
+      }
+      else continue;
+      if (!field->fromString(value))
+      {
+        ROS_ERROR("Replication: failed to parse \"%s\" for field %s", value.c_str(), field->getName().c_str());
+        return false;
+      }
+    }
+    return true;
+  }
+
+  //! Finds the primary key value in a row
+  bool getKey(const ReplicationChange &change, const std::vector<ReplicationValue> &values, 
+              std::string &key) const
+  {
+    T entry;
+    DBFieldBase *pk_field = entry.getPrimaryKeyField();
+    for (size_t c=0; c<values.size() && c<change.relation->columns.size(); c++)
+    {
+      if (change.relation->columns[c] != pk_field->getName()) continue;
+      if (values[c].kind != ReplicationValue::TEXT) return false;
+      //convert through the field so the key has the same form as in the collection
+      return pk_field->fromString(values[c].text) && pk_field->toString(key);
+    }
+    return false;
+  }
+
+  bool handleChange(const ReplicationChange &change)
+  {
+    if (change.type == ReplicationChange::TRUNCATE)
+    {
+      collection_.clear();
+      if (callback_) callback_(change.type, EntryPtr());
+      return true;
+    }
+
+    std::string old_key, new_key;
+    if (!change.old_values.empty() && !getKey(change, change.old_values, old_key))
+    {
+      ROS_ERROR("Replication: old row of table %s has no primary key", change.relation->name.c_str());
+      return false;
+    }
+    if (!change.new_values.empty() && !getKey(change, change.new_values, new_key))
+    {
+      ROS_ERROR("Replication: new row of table %s has no primary key", change.relation->name.c_str());
+      return false;
+    }
+    if (old_key.empty()) old_key = new_key;
+    EntryPtr old = collection_.find(old_key);
+
+    if (change.type == ReplicationChange::DELETE)
+    {
+      collection_.remove(old_key);
+      if (callback_ && old) callback_(change.type, old);
+      return true;
+    }
+
+    EntryPtr entry(new T);
+    if (!decode(change, change.new_values, old, *entry)) return false;
+    if (old_key != new_key) collection_.remove(old_key);
+    collection_.add(entry);
+    if (callback_) callback_(change.type, entry);
+    return true;
+  }
+
+ public:
+  DBCollectionReplicator(LogicalReplicationClient &client, DBCollection<T> &collection,
+                         const Callback &callback = Callback()) : 
+    collection_(collection), callback_(callback)
+  {
+    T example;
+    client.subscribe(example.getPrimaryKeyField()->getTableName(), 
+                     boost::bind(&DBCollectionReplicator<T>::handleChange, this, 
+                                 boost::placeholders::_1));
+  }
+};
+
+} //namespace
+
+#endif
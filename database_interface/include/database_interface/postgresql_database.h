@@ -38,19 +38,34 @@
 #define _POSTGRESQL_DATABASE_H_
 
 #include <vector>
+#include <deque>
+#include <map>
 #include <string>
+#include <typeinfo>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
 //for ROS error messages
 #include <ros/ros.h>
 #include <yaml-cpp/yaml.h>
 
 #include "database_interface/db_class.h"
+#include "database_interface/db_binary_buffer.h"
 #include "database_interface/db_filters.h"
+#include "database_interface/db_projection.h"
+#include "database_interface/db_function.h"
+#include "database_interface/db_copy.h"
+#include "database_interface/db_trace.h"
+#include "database_interface/db_capture.h"
+#include "database_interface/db_query_stats.h"
 
 //A bit of an involved way to forward declare PGconn, which is a typedef
 struct pg_conn;
 typedef struct pg_conn PGconn;
+struct pg_result;
+typedef struct pg_result PGresult;
+struct pg_cancel;
+typedef struct pg_cancel PGcancel;
 
 namespace database_interface {
 
@@ -61,6 +76,76 @@ struct Notification {
   std::string payload;
 };
   
+//! The address of a read-only replica; all other connection parameters are those of the primary
+struct PostgresqlReplicaConfig {
+  std::string host;
+  std::string port;
+};
+
+//! Describes how to find the instances of a class that changed since a previous read
+/*! Changes are found either through the xmin system column of the rows (the transaction 
+  that last wrote them), which needs no support from the schema, or through a column that 
+  increases with every change, such as an updated_at timestamp or a version counter. 
+
+  Deletions leave no row behind, so they are found either through a tombstone table, into
+  which a trigger inserts the primary key of each deleted row (in a column with the same name
+  as the primary key, and for CHANGE_COLUMN tracking with the same change column), or by
+  comparing the full list of primary keys.
+
+  The watermark and the changed rows must come from the same server, and watermarks must 
+  not go backwards from one refresh to the next, so DBCollection sends all the queries of a
+  load or refresh to the primary (see PrimaryReadScope), even if there are replicas.
+
+  CHANGE_COLUMN tracking misses rows whose transaction commits after the watermark was taken
+  with a change column value below it (e.g. a timestamp set at the start of a long 
+  transaction, or a sequence value drawn before a later one committed). XMIN tracking does 
+  not have this problem.
+ */
+struct DeltaSyncConfig
+{
+  enum ChangeTracking {XMIN, CHANGE_COLUMN};
+  enum DeleteTracking {IGNORE_DELETES, TOMBSTONE_TABLE, KEY_DIFF};
+
+  ChangeTracking change_tracking;
+  //! For CHANGE_COLUMN tracking, the column in the primary key table
+  std::string change_column;
+
+  DeleteTracking delete_tracking;
+  //! For TOMBSTONE_TABLE delete tracking, the name of the tombstone table
+  std::string tombstone_table;
+
+  DeltaSyncConfig() : change_tracking(XMIN), delete_tracking(IGNORE_DELETES) {}
+};
+
+//! Describes when a materialized view is to be refreshed by refreshMaterializedViews()
+/*! A DBClass is read from a materialized view simply by giving the view as the table name 
+  of its fields; getList then reads the precomputed rows, which are as stale as the last 
+  refresh. A view is refreshed when any of its triggers has fired since its last refresh:
+  a period has elapsed, enough writes have been made through this PostgresqlDatabase to the
+  tables the view is computed from, or a notification has arrived on a channel (sent, for 
+  instance, by a trigger on those tables). 
+
+  A concurrent refresh does not block reads of the view while it runs, but needs a unique
+  index on the view, and the view to have been populated before.
+ */
+struct MaterializedViewConfig
+{
+  std::string view;
+  bool concurrently;
+
+  //! Refresh when this many seconds have passed since the last refresh, 0 for never
+  double refresh_period;
+
+  //! Refresh after this many writes to any of the source tables, 0 for never
+  unsigned int write_threshold;
+  std::vector<std::string> source_tables;
+
+  //! Refresh when a notification arrives on this channel, empty for none
+  std::string channel;
+
+  MaterializedViewConfig() : concurrently(true), refresh_period(0), write_threshold(0) {}
+};
+
 class PostgresqlDatabaseConfig
 {
 private:
@@ -69,21 +154,33 @@ private:
   std::string host_;
   std::string port_;
   std::string dbname_;
+  int statement_timeout_;
+  std::vector<PostgresqlReplicaConfig> replicas_;
+  bool read_your_writes_;
 
 public:
-  PostgresqlDatabaseConfig() {  }
+  PostgresqlDatabaseConfig() : statement_timeout_(0), read_your_writes_(false) {  }
 
   std::string getPassword() const { return password_; }
   std::string getUser() const { return user_; }
   std::string getHost() const { return host_; }
   std::string getPort() const { return port_; }
   std::string getDBname() const { return dbname_; }
+  //! Default timeout for each statement in milliseconds, 0 for none
+  int getStatementTimeout() const { return statement_timeout_; }
+  //! Replicas that read-only queries are sent to, if any
+  const std::vector<PostgresqlReplicaConfig>& getReplicas() const { return replicas_; }
+  //! Whether reads should only go to replicas that have caught up with our own writes
+  bool getReadYourWrites() const { return read_your_writes_; }
 
   friend void operator>>(const YAML::Node &node, PostgresqlDatabaseConfig &options);
 };
 
 /*!
  *\brief Loads YAML doc into configuration params. Throws YAML::ParserException if keys missing.
+ *
+ * The statement_timeout key (milliseconds) is optional. So is the replicas key, a list of
+ * host / port pairs, and the read_your_writes flag.
  */
 void operator>>(const YAML::Node& node, PostgresqlDatabaseConfig &options);
 
@@ -93,15 +190,214 @@ class PostgresqlDatabase
   void pgMDBconstruct(std::string host, std::string port, std::string user,
                       std::string password, std::string dbname );
 
+  //! Opens a connection with the given parameters; the result must be checked with PQstatus
+  static PGconn* connect(std::string host, std::string port, std::string user,
+                         std::string password, std::string dbname);
+
   //! The PostgreSQL database connection we are using
+  /*! If there are replicas, this is the connection to the primary. All writes, and all
+    statements inside a transaction, go through it. */
   PGconn* connection_;
 
+  //! Connections to read-only replicas of the primary
+  std::vector<PGconn*> replica_connections_;
+
+  //! What we keep track of for each open connection (primary and replicas)
+  struct ConnectionState
+  {
+    //! Used to cancel the query in progress; created when the connection is made
+    PGcancel *cancel_handle;
+    //! The statement_timeout currently set on the connection, or -1 if unknown
+    int statement_timeout;
+    //! For replicas, the WAL position they were last known to have replayed
+    unsigned long long replay_lsn;
+    //! Number of statements sent on this connection
+    unsigned long round_trips;
+    //! Names of the statements prepared on this connection, by statement text
+    std::map<std::string, std::string> prepared_statements;
+    ConnectionState() : cancel_handle(NULL), statement_timeout(-1), replay_lsn(0), round_trips(0) {}
+  };
+  //! Keyed on connection. Entries are only added or removed at construction / destruction
+  mutable std::map<PGconn*, ConnectionState> connection_states_;
+
+  //! The replica the next read is sent to, if it is suitable
+  mutable size_t next_replica_;
+
+  //! The number of PrimaryReadScopes alive; while there are any, reads go to the primary
+  mutable int primary_reads_;
+
+  //! If set, reads only go to replicas that have replayed our writes (see write_lsn_)
+  bool read_your_writes_;
+
+  //! WAL position of the primary after our last write, 0 if unknown
+  unsigned long long write_lsn_;
+
   //! Helper class that acts like an auto ptr for a PGresult, with a little more cleanup
   class PGresultAutoPtr;
 
   // beginTransaction sets this flag. endTransaction clears it.
   bool in_transaction_;
 
+  //! The number of ReadOnlyScopes alive; statements sent while there are any are captured as reads
+  mutable int read_only_statements_;
+
+  //! Marks the statements sent during its lifetime as reads in the capture, if active
+  /*! Set up by the operations that use getReadConnection(), so that query_replay --read-only
+    knows which statements it can send without changing the target database. */
+  class ReadOnlyScope
+  {
+  private:
+    const PostgresqlDatabase *database_;
+    bool active_;
+  public:
+    ReadOnlyScope(const PostgresqlDatabase *database, bool active = true) : 
+      database_(database), active_(active) 
+    {
+      if (active_) database_->read_only_statements_++;
+    }
+    ~ReadOnlyScope() {if (active_) database_->read_only_statements_--;}
+  };
+
+  //! Timeout applied by the server to each statement, in milliseconds. 0 means no timeout
+  int statement_timeout_;
+
+  //! If not zero, statements still running at this time are cancelled
+  ros::WallTime deadline_;
+
+  //! Protects running_cancel_handle_, which cancel() uses from other threads
+  mutable boost::mutex cancel_mutex_;
+
+  //! The cancel handle of the connection a statement is being executed on, if any
+  mutable PGcancel* running_cancel_handle_;
+
+  //! Where spans are reported; if not set, tracing is disabled
+  boost::shared_ptr<TraceSink> trace_sink_;
+
+  //! Where statements are recorded; if not set, capture is disabled
+  boost::shared_ptr<CaptureWriter> capture_;
+
+  //! The innermost span in progress, NULL if none
+  mutable TraceSpan *current_span_;
+
+  mutable unsigned long next_span_id_;
+
+  //! Measures the enclosing scope as a span, if tracing is enabled
+  /*! When tracing is disabled, this costs one test of the trace sink. A span started while
+    another is in progress becomes its child; a child's error is also reported on its parent.
+   */
+  class TraceScope
+  {
+  private:
+    const PostgresqlDatabase *database_;
+    TraceSpan *span_;
+    TraceSpan *parent_;
+    void begin(const char *operation, const DBClass *object);
+    void finish();
+  public:
+    TraceScope(const PostgresqlDatabase *database, const char *operation, const DBClass *object = NULL) :
+      database_(database), span_(NULL), parent_(NULL)
+    {
+      if (database->trace_sink_) begin(operation, object);
+    }
+    ~TraceScope() {if (span_) finish();}
+    void setRows(long long rows) {if (span_) span_->rows = rows;}
+    void setBytes(long long bytes) {if (span_) span_->bytes = bytes;}
+    void setError(const char *error) {if (span_) span_->error = error;}
+    //! Records the connection used
+    void setConnection(PGconn *conn);
+    //! Records the rows, size and error of a result
+    void setResult(const PGresult *result);
+  };
+
+  //! Sequence values reserved by allocatePrimaryKey but not handed out yet, by sequence
+  std::map<std::string, std::deque<std::string> > reserved_keys_;
+
+  //! How many values allocatePrimaryKey reserves from a sequence at a time
+  size_t key_block_size_;
+
+  //! Whether getList asks for results in binary format; off by default
+  bool binary_results_;
+
+  //! Watches for statements repeated in a loop; disabled by default
+  mutable RepeatedQueryDetector repeat_detector_;
+
+  //! Counts a statement sent on a connection, and checks it for repetition
+  void countRoundTrip(PGconn *conn, const std::string &query) const;
+
+  //! After a versioned save, sets the new version, or reports a conflict if there is none
+  bool updateVersion(DBFieldBase *version_field, const PGresult *result, bool *conflict) const;
+
+  //! Statistics of the filters used to query; disabled by default
+  mutable FilterUsageStats filter_stats_;
+
+  //! Time spent converting the values of each column; disabled by default
+  mutable FieldCodecStats field_stats_;
+
+  //! A materialized view managed by refreshMaterializedViews(), and what happened since its refresh
+  struct MaterializedViewState
+  {
+    MaterializedViewConfig config;
+    ros::WallTime last_refresh;
+    unsigned int writes;
+    bool notified;
+  };
+  std::vector<MaterializedViewState> materialized_views_;
+
+  //! Notifications received while looking for those of materialized views, for checkNotify
+  std::deque<Notification> pending_notifications_;
+
+  //! Counts a write to the given tables against the materialized views computed from them
+  void countTableWrites(const std::vector<std::string> &tables);
+
+  //! Marks the materialized views that are refreshed on the channel; returns true if any is
+  bool notifyMaterializedViews(const std::string &channel);
+
+  //! Records a filtered query of the class whose primary key table is given
+  /*! column_tables gives the table of each column of the class. */
+  void recordFilterUsage(const std::string &table, 
+                         const std::map<std::string, std::string> &column_tables,
+                         const FilterClause &clause, const ros::WallTime &start, int rows) const;
+
+  //! Fills in the table that each column of the class belongs to
+  static void getColumnTables(const DBClass *example, std::map<std::string, std::string> &column_tables);
+
+  //! Returns the connection a read-only query should be sent to
+  PGconn* getReadConnection() const;
+
+  //! Returns true if the replica has replayed the primary's WAL up to write_lsn_
+  bool replicaCaughtUp(PGconn *replica) const;
+
+  //! Records the WAL position of the primary after a write, if we need to wait for replicas
+  void recordWritePosition();
+
+  //! Sends a statement and waits for its result, enforcing the statement timeout and deadline
+  PGresult* execQuery(PGconn *conn, const std::string &query, int num_params = 0,
+                      const char* const *param_values = NULL, const int *param_lengths = NULL,
+                      const int *param_formats = NULL, int result_format = 0) const;
+
+  //! Runs a statement whose only parameters are those of the filter clause
+  PGresult* execQuery(PGconn *conn, const std::string &query, const FilterClause &clause,
+                      int result_format = 0) const;
+
+  //! Waits for the result of the statement that was just sent
+  PGresult* waitForResult(PGconn *conn) const;
+
+  //! The most statements that are prepared on one connection
+  static const size_t MAX_PREPARED_STATEMENTS = 256;
+
+  //! Returns the name the statement is prepared under on the connection, preparing it if needed
+  std::string getPreparedStatement(PGconn *conn, const std::string &query, int num_params,
+                                   PGresult* &error) const;
+
+  //! Sets statement_timeout on the connection, if it is not already at the right value
+  bool applyStatementTimeout(PGconn *conn) const;
+
+  //! Waits for input on the connection, cancelling the running statement if the deadline passes
+  bool waitForInput(PGconn *conn, bool &cancelled) const;
+
+  //! Closes the connection and opens it again, for when it is stuck in a state we can not leave
+  bool resetConnection(PGconn *conn) const;
+
   //! Gets the text value of a given variable
   bool getVariable(std::string name, std::string &value) const;
   
@@ -114,28 +410,91 @@ class PostgresqlDatabase
   //! Issues the "commit" command to the database
   bool commit();
 
-  //! Retreives the list of objects of a certain type from the database
+  //! Describes how the query for a getList call is built and how its result is decoded
+  /*! Fields are identified by their index in the DBClass (-1 for the primary key) rather than
+    by address, so that the same plan can be used to decode any number of new instances. 
+    Column t of the result is decoded into field field_ids[t].
+  */
+  struct ListQueryPlan
+  {
+    //! The SELECT query, up to but not including the WHERE clause
+    std::string select_query;
+    //! The index in the DBClass of the field that each result column is decoded into
+    std::vector<int> field_ids;
+    //! The primary key table, and the table of each column of the class, for filter statistics
+    std::string table;
+    std::map<std::string, std::string> column_tables;
+    //! Whether the result is in binary format, as set up by selectColumn(...)
+    bool binary;
+    //! Whether the query must run on the primary even if there are replicas, as it may write
+    bool primary;
+    ListQueryPlan() : binary(false), primary(false) {}
+  };
+
+  //! Plans for getList calls with a projection, keyed on class and projected columns
+  mutable std::map<std::string, ListQueryPlan> list_plans_;
+
+  //! Retreives the list of objects of a certain type, as described by an already built plan
+  /*! If recycle is set, the instances already in vec are reused; see getListRecycled. */
   template <class T>
-    bool getList(std::vector< boost::shared_ptr<T> > &vec, const T& example, std::string where_clause) const;
+    bool getList(std::vector< boost::shared_ptr<T> > &vec, const ListQueryPlan &plan, 
+                 const FilterClause &clause, bool recycle = false) const;
+
+  //! Builds the getList plan for the given class and set of columns
+  /*! If binary_copy is set, the plan is for a binary COPY instead (see copyOut(...)). If
+    binary_results is set, the result is asked for in binary format (see setBinaryResults). */
+  bool buildListPlan(const DBClass *example, const std::vector<std::string> *columns,
+                     ListQueryPlan &plan, bool binary_copy = false, bool binary_results = false) const;
+
+  //! Returns the cached plan for a projection, building it first if needed
+  const ListQueryPlan* getProjectionPlan(const std::string &class_name, const DBClass *example,
+                                         const Projection &projection) const;
 
   //! Helper function for getList, separates SQL from (templated) instantiation
-  bool getListRawResult(const DBClass *example, std::vector<const DBFieldBase*> &fields, 
-			std::vector<int> &column_ids, std::string where_clause,
+  bool getListRawResult(const ListQueryPlan &plan, const FilterClause &clause,
 			boost::shared_ptr<PGresultAutoPtr> &result, int &num_tuples) const;
 
   //! Helper function for getList, separates SQL from (templated) instantiation
   bool populateListEntry(DBClass *entry, boost::shared_ptr<PGresultAutoPtr> result, int row_num,
-			 const std::vector<const DBFieldBase*> &fields,
-			 const std::vector<int> &column_ids) const;
+			 const ListQueryPlan &plan) const;
+
+  //! Builds the plan for reading instances of the class from the rows a function returns
+  bool buildFunctionPlan(const DBClass *example, const FunctionCall &call, ListQueryPlan &plan) const;
+
+  //! Calls a function, and parses the single value it returns into result (if not NULL)
+  bool callScalarFunction(const FunctionCall &call, DBFieldBase *result, bool *is_null);
+
+  //! Streams the result of the query described by a binary COPY plan into the sink
+  bool copyOut(const DBClass *example, const ListQueryPlan &plan, const FilterClause &clause,
+               CopySink &sink) const;
+
+  //! Sets the fields of an entry from a row of a binary COPY made with the given plan
+  bool populateCopyEntry(DBClass *entry, const std::vector<const char*> &values,
+                         const std::vector<size_t> &lengths, const ListQueryPlan &plan) const;
+
+  //! Decodes the rows of a binary COPY into new instances of T
+  template <class T>
+  class CopyListSink : public CopyRowSink
+  {
+  private:
+    const PostgresqlDatabase &database_;
+    const ListQueryPlan &plan_;
+    std::vector< boost::shared_ptr<T> > &vec_;
+  public:
+    CopyListSink(const PostgresqlDatabase &database, const ListQueryPlan &plan, 
+                 std::vector< boost::shared_ptr<T> > &vec) : 
+      database_(database), plan_(plan), vec_(vec) {}
+    virtual bool handleRow(const std::vector<const char*> &values, 
+                           const std::vector<size_t> &lengths)
+    {
+      boost::shared_ptr<T> entry(new T);
+      if (database_.populateCopyEntry(entry.get(), values, lengths, plan_)) vec_.push_back(entry);
+      return true;
+    }
+  };
 
-  //! Returns the 'currval' for the database sequence identified by name
-  bool getSequence(std::string name, std::string &value);
 
-  //! Helper function for inserting an instance into the database
-  bool insertIntoTable(std::string table_name, const std::vector<const DBFieldBase*> &fields);
 
-  //! Helper function that deletes a row from a table based on the value of the specified field 
-  bool deleteFromTable(std::string table_name, const DBFieldBase *key_field);
 
  public:
   //! Attempts to connect to the specified database
@@ -152,6 +511,104 @@ class PostgresqlDatabase
   //! Returns true if the interface is connected to the database and ready to go
   bool isConnected() const;
 
+  //! Sets the timeout the server applies to each statement, in milliseconds (0 for none)
+  void setStatementTimeout(int milliseconds) {statement_timeout_ = milliseconds;}
+  int getStatementTimeout() const {return statement_timeout_;}
+
+  //! Statements still running when the deadline passes are cancelled; new ones fail right away
+  /*! The deadline applies to all calls made until it is cleared, so it can bound an
+    operation that issues several statements. */
+  void setDeadline(const ros::WallTime &deadline) {deadline_ = deadline;}
+  void clearDeadline() {deadline_ = ros::WallTime();}
+
+  //! Sends all reads to the primary for as long as it exists
+  /*! For reads whose results must be consistent with each other, such as the watermark and
+    the changed rows of a DBCollection refresh, which replicas that have replayed different
+    amounts of the primary's WAL would not give. Scopes can be nested. */
+  class PrimaryReadScope
+  {
+  private:
+    const PostgresqlDatabase &database_;
+    PrimaryReadScope(const PrimaryReadScope&);
+    PrimaryReadScope& operator = (const PrimaryReadScope&);
+  public:
+    PrimaryReadScope(const PostgresqlDatabase &database) : database_(database) {database_.primary_reads_++;}
+    ~PrimaryReadScope() {database_.primary_reads_--;}
+  };
+
+  //! Adds a read-only replica, which getList, countList and loadFromDatabase can be sent to
+  bool addReplica(std::string host, std::string port, std::string user,
+                  std::string password, std::string dbname);
+
+  //! If enabled, reads are only sent to replicas that have caught up with our own writes
+  /*! Otherwise, a read that immediately follows a write might not see it. Enabling this
+    costs one extra query on the primary after each write. */
+  void setReadYourWrites(bool enable) {read_your_writes_ = enable;}
+
+  //! Returns a token describing how far our writes have gone, for use by another session
+  std::string getConsistencyToken() const;
+
+  //! Makes reads wait for the writes described by a token from getConsistencyToken()
+  /*! Reads are sent only to replicas that have caught up with that position, or to the
+    primary if none has. Also enables read-your-writes for this instance. */
+  bool setConsistencyToken(const std::string &token);
+
+  //! Reports a span for every operation to the sink; pass an empty pointer to disable tracing
+  void setTraceSink(const boost::shared_ptr<TraceSink> &sink) {trace_sink_ = sink;}
+
+  //! Records every statement sent, with its parameters and timing; pass an empty pointer to stop
+  /*! The capture can be replayed against another database with the query_replay tool. */
+  void setCapture(const boost::shared_ptr<CaptureWriter> &capture) {capture_ = capture;}
+
+  //! Returns the number of statements this instance has sent, on all its connections
+  unsigned long getRoundTrips() const;
+
+  //! Returns the number of statements sent on each connection: the primary, then the replicas
+  void getRoundTrips(std::vector<unsigned long> &counts) const;
+
+  void resetRoundTrips();
+
+  //! Returns the number of statements the calling thread has sent, through any instance
+  static unsigned long getThreadRoundTrips();
+
+  //! Warns when a statement runs more than threshold times within window seconds
+  /*! Statements are compared with their literals stripped, so a loop issuing one query
+    per item is caught. The warning says which batched call to use instead, and can
+    include a stack trace. A threshold of 0 disables the check. */
+  void setRepeatDetection(unsigned int threshold, double window = 1.0, bool print_stack = false)
+  {
+    repeat_detector_.configure(threshold, window, print_stack);
+  }
+
+  //! Sets a tag that identifies the calling code in repetition warnings (see QueryTagScope)
+  /*! Counting starts afresh, so repetitions are counted within the tagged scope. */
+  void setQueryTag(const std::string &tag) {repeat_detector_.setTag(tag);}
+  std::string getQueryTag() const {return repeat_detector_.getTag();}
+
+  //! Starts or stops collecting statistics on the filters passed to getList and the like
+  /*! For each table, the columns compared and how, with the number of uses and the time
+    taken. See FilterUsageStats. */
+  void setFilterStats(bool enabled) {filter_stats_.setEnabled(enabled);}
+  const FilterUsageStats& getFilterStats() const {return filter_stats_;}
+  void resetFilterStats() {filter_stats_.clear();}
+
+  //! Starts or stops timing the conversion of each value read by getList or written
+  /*! Gives the time and bytes spent on each column, by field type. See FieldCodecStats. */
+  void setFieldCodecStats(bool enabled) {field_stats_.setEnabled(enabled);}
+  const FieldCodecStats& getFieldCodecStats() const {return field_stats_;}
+  void resetFieldCodecStats() {field_stats_.clear();}
+
+  //! Has getList ask for results in binary format, sparing the server and us the text conversion
+  /*! Fields with a wire type (see DBFieldBase::getWireType()) are decoded from their binary
+    representation, all others from text, which the server is asked to send through a cast. 
+    NULL values reset the field to its default. Affects plans built afterwards. */
+  void setBinaryResults(bool enable) {binary_results_ = enable;}
+  bool getBinaryResults() const {return binary_results_;}
+
+  //! Asks the server to cancel the statement currently being executed, if any
+  /*! Can be called from any thread. The call that issued the statement returns false. */
+  bool cancel() const;
+
   //------- general queries that should work regardless of the datatypes actually being used ------
 
   //------- retrieval without examples ------- 
@@ -159,55 +616,235 @@ class PostgresqlDatabase
   bool getList(std::vector< boost::shared_ptr<T> > &vec) const
   {
     T example;
-    return getList<T>(vec, example, "");
+    return getList<T>(vec, example, FilterClause());
   }
   template <class T>
   bool getList(std::vector< boost::shared_ptr<T> > &vec, const FilterClause clause) const
   {
     T example;
-    return getList<T>(vec, example, clause.clause_);
+    return getList<T>(vec, example, clause);
   }
   template <class T>
   bool getList(std::vector< boost::shared_ptr<T> > &vec, std::string where_clause) const
   {
     T example;
-    return getList<T>(vec, example, where_clause);
+    return getList<T>(vec, example, FilterClause(where_clause));
   }
 
   //------- retrieval with examples ------- 
   template <class T>
   bool getList(std::vector< boost::shared_ptr<T> > &vec, const T &example) const
   {
-    return getList<T>(vec, example, "");
+    return getList<T>(vec, example, FilterClause());
+  }
+  template <class T>
+  bool getList(std::vector< boost::shared_ptr<T> > &vec, const T &example, const FilterClause &clause) const;
+
+  //------- retrieval with projections ------- 
+  //! Retrieves only the primary key and the columns listed in the projection
+  /*! The projection applies to this call only. The query and decode plan for each
+    (class, projection) pair is built once and cached. */
+  template <class T>
+  bool getList(std::vector< boost::shared_ptr<T> > &vec, const Projection &projection, 
+               const FilterClause clause=FilterClause()) const
+  {
+    T example;
+    TraceScope trace(this, "getList", &example);
+    const ListQueryPlan *plan = getProjectionPlan(typeid(T).name(), &example, projection);
+    if (!plan) return false;
+    bool success = getList<T>(vec, *plan, clause);
+    trace.setRows(vec.size());
+    return success;
+  }
+
+  //------- retrieval into existing instances ------- 
+  //! Like getList, but overwrites the instances already in vec instead of allocating new ones
+  /*! Meant for loops that retrieve the same list over and over. The instances in vec are 
+    filled with the results in order, and vec only grows or shrinks at the end. Instances
+    that are also referenced from outside vec are not touched; they are replaced by new ones.
+    Fields that are not read from the database keep whatever value they had. 
+
+    Reused string fields keep their capacity, so once the list has settled, decoding it 
+    allocates nothing. */
+  template <class T>
+  bool getListRecycled(std::vector< boost::shared_ptr<T> > &vec, 
+                       const FilterClause clause=FilterClause()) const
+  {
+    TraceScope trace(this, "getList");
+    //the plan is kept, so that no example instance has to be built on each call
+    std::string key = std::string(typeid(T).name()) + (binary_results_ ? "/binary" : "");
+    std::map<std::string, ListQueryPlan>::const_iterator it = list_plans_.find(key);
+    const ListQueryPlan *plan;
+    if (it != list_plans_.end()) plan = &(it->second);
+    else 
+    {
+      T example;
+      ListQueryPlan new_plan;
+      if (!buildListPlan(&example, NULL, new_plan, false, binary_results_)) return false;
+      plan = &(list_plans_[key] = new_plan);
+    }
+    bool success = getList<T>(vec, *plan, clause, true);
+    trace.setRows(vec.size());
+    return success;
   }
+
+  //------- bulk export ------- 
+  //! Streams the instances of a class that satisfy the where clause into a sink
+  /*! Uses COPY TO STDOUT in binary format, which is much faster than getList for large 
+    results. The primary key and the fields marked with getReadFromDatabase() in the
+    example, including binary ones, are sent, in that order. Fields with a wire type (see 
+    DBFieldBase::getWireType()) are sent in binary, all others as text. */
+  bool copyOut(const DBClass *example, CopySink &sink, const FilterClause &clause) const;
+
   template <class T>
-  bool getList(std::vector< boost::shared_ptr<T> > &vec, const T &example, const FilterClause clause) const
+  bool copyOut(CopySink &sink, const FilterClause clause=FilterClause()) const
   {
-    return getList<T>(vec, example, clause.clause_);
+    T example;
+    return copyOut(&example, sink, clause);
+  }
+
+  //! Like getList, but retrieves the instances through a binary COPY
+  /*! NULL values leave the corresponding field with its default value. */
+  template <class T>
+  bool copyList(std::vector< boost::shared_ptr<T> > &vec, const FilterClause clause=FilterClause()) const
+  {
+    T example;
+    TraceScope trace(this, "copyList", &example);
+    ListQueryPlan plan;
+    if (!buildListPlan(&example, NULL, plan, true)) return false;
+    vec.clear();
+    CopyListSink<T> sink(*this, plan, vec);
+    bool success = copyOut(&example, plan, clause, sink);
+    trace.setRows(vec.size());
+    return success;
   }
 
   //! Counts the number of instances of a certain type in the database
-  bool countList(const DBClass *example, int &count, std::string where_clause) const;
+  bool countList(const DBClass *example, int &count, const FilterClause &clause) const;
 
   //! templated implementation of count list that works on filter clauses.
   template <typename T>
   bool countList(int &count, const FilterClause clause=FilterClause()) const
   {
     T example;
-    return countList(&example, count, clause.clause_);
+    return countList(&example, count, clause);
   }
 
+  //------- incremental synchronization, see DeltaSyncConfig ------- 
+  //! Gets the current watermark, from which later changes can be found
+  /*! Should be called before reading the instances the watermark will describe. */
+  bool getChangeWatermark(const DBClass *example, const DeltaSyncConfig &config, 
+                          std::string &watermark) const;
+
+  //! Builds a where clause that selects the instances changed between two watermarks
+  bool getChangedClause(const DBClass *example, const DeltaSyncConfig &config, const std::string &since,
+                        const std::string &until, std::string &where_clause) const;
+
+  //! Gets the primary keys in the tombstone table that were added since a watermark
+  bool getDeletedKeys(const DBClass *example, const DeltaSyncConfig &config, const std::string &since,
+                      std::vector<std::string> &keys) const;
+
+  //! Gets the primary keys of all instances of a class that satisfy the where clause
+  bool getKeyList(const DBClass *example, std::vector<std::string> &keys, const FilterClause &clause) const;
+
   //! Writes the value of one particular field of a DBClass to the database
-  bool saveToDatabase(const DBFieldBase* field);
+  /*! If the class has a version field, the write only happens if the version in the database
+    is the same as in the instance; it is then incremented in both. Otherwise, false is
+    returned and conflict (if given) is set; it is not logged as an error in that case. */
+  bool saveToDatabase(const DBFieldBase* field, bool *conflict = NULL);
+
+  //! Writes all the fields of an instance marked with writeToDatabase, in a single statement
+  /*! Versions are checked and updated as by saveToDatabase(field). */
+  bool saveToDatabase(DBClass* instance, bool *conflict = NULL);
 
   //! Reads the value of one particular fields of a DBClass from the database
   bool loadFromDatabase(DBFieldBase* field) const;
 
+  //! Writes the value of a binary field straight to a file, without loading it all in memory
+  bool loadToFile(const DBFieldBase* field, const std::string &filename, 
+                  size_t chunk_size = 16 * 1024 * 1024) const;
+
   //! Inserts a new instance of a DBClass into the database
+  /*! Fields that are read but not written are set to the values the server gave them, unless
+    those are NULL. Returns true whenever the row was inserted. */
   bool insertIntoDatabase(DBClass* instance);
 
+  //------- client-side key allocation ------- 
+  //! Reserves values of a sequence, all in one round trip
+  /*! The values are not necessarily consecutive, as other sessions may be using the 
+    sequence at the same time. Values that end up not being used are simply lost, as with 
+    any sequence. */
+  bool reserveSequenceValues(const std::string &sequence, size_t count, std::vector<std::string> &values);
+
+  //! Sets the primary key of an instance to the next value of its sequence
+  /*! The primary key must have a sequence (see DBFieldBase::setSequenceName()). Values are
+    reserved in blocks (see setKeyBlockSize()), so most calls do not go to the database. The
+    primary key is then marked to be written, so the instance is inserted with it; this 
+    means the key is known before the insertion, e.g. to set up instances that refer to it.
+  */
+  bool allocatePrimaryKey(DBClass *instance);
+
+  //! Sets how many sequence values allocatePrimaryKey reserves at a time
+  void setKeyBlockSize(size_t size) {key_block_size_ = size > 0 ? size : 1;}
+
   //! Deletes an instance of a DBClass from the database
   bool deleteFromDatabase(DBClass* instance);
+
+  //------- materialized views, see MaterializedViewConfig ------- 
+  //! Recomputes the contents of a materialized view
+  bool refreshMaterializedView(const std::string &view, bool concurrently = true);
+
+  //! Has refreshMaterializedViews() keep a view up to date; listens to its channel, if any
+  bool manageMaterializedView(const MaterializedViewConfig &config);
+
+  //! Refreshes the managed views whose triggers have fired since their last refresh
+  /*! Meant to be called regularly, e.g. from a timer; refreshes are not done in the 
+    background. Nothing is refreshed inside a transaction. Returns false if a refresh failed;
+    the view is then tried again on the next call. */
+  bool refreshMaterializedViews();
+
+  //------- server-side functions, see FunctionCall ------- 
+  // Calls always go to the primary, as functions may write. A function that does several
+  // reads and writes takes a single round trip, where doing them from here takes one each.
+
+  //! Calls a function for its side effects, ignoring what it returns
+  bool callFunction(const FunctionCall &call);
+
+  //! Calls a function that returns a single value
+  /*! The value is parsed as a DBField<R> would parse it. If the function returns NULL, result
+    is left untouched and is_null (if given) is set; without is_null, NULL is an error. */
+  template <class R>
+  bool callFunction(const FunctionCall &call, R &result, bool *is_null = NULL)
+  {
+    DBField<R> field(DBFieldBase::TEXT, NULL, call.getName(), "", false);
+    bool null_result = false;
+    if (!callScalarFunction(call, &field, &null_result)) return false;
+    if (is_null) *is_null = null_result;
+    else if (null_result)
+    {
+      ROS_ERROR("Database call function: %s returned NULL", call.getName().c_str());
+      return false;
+    }
+    if (!null_result) result = field.data();
+    return true;
+  }
+
+  //! Calls a function that returns rows, and makes a new instance of T out of each of them
+  /*! The function must return columns named like the primary key and the fields of T that 
+    are marked with getReadFromDatabase(), as a function returning SETOF the table of T does.
+    Other columns are ignored. */
+  template <class T>
+  bool callFunction(const FunctionCall &call, std::vector< boost::shared_ptr<T> > &vec)
+  {
+    T example;
+    TraceScope trace(this, "callFunction", &example);
+    ListQueryPlan plan;
+    if (!buildFunctionPlan(&example, call, plan)) return false;
+    bool success = getList<T>(vec, plan, call.getParameters());
+    if (success) recordWritePosition();
+    trace.setRows(vec.size());
+    return success;
+  }
   
     //! Enables listening to a specified channel
   bool listenToChannel(std::string channel);
@@ -245,40 +882,82 @@ class PostgresqlDatabase
 */
 template <class T>
 bool PostgresqlDatabase::getList(std::vector< boost::shared_ptr<T> > &vec, 
-				 const T &example, std::string where_clause) const
+				 const T &example, const FilterClause &clause) const
+{
+  TraceScope trace(this, "getList", &example);
+  //work out which fields are to be retrieved, based on the example
+  ListQueryPlan plan;
+  if (!buildListPlan(&example, NULL, plan, false, binary_results_))
+  {
+    return false;
+  }
+  bool success = getList<T>(vec, plan, clause);
+  trace.setRows(vec.size());
+  return success;
+}
+
+template <class T>
+bool PostgresqlDatabase::getList(std::vector< boost::shared_ptr<T> > &vec, 
+				 const ListQueryPlan &plan, const FilterClause &clause, bool recycle) const
 {
-  //we will store here the fields to be retrieved retrieve from the database
-  std::vector<const DBFieldBase*> fields;
-  //we will store here their index in the result returned from the database
-  std::vector<int> column_ids;
   boost::shared_ptr<PGresultAutoPtr> result;
 
   int num_tuples;
   //do all the heavy lifting of querying the database and getting the raw result
-  if (!getListRawResult(&example, fields, column_ids, where_clause, result, num_tuples))
+  if (!getListRawResult(plan, clause, result, num_tuples))
   {
     return false;
   }
 
-  vec.clear();
+  if (!recycle) vec.clear();
   if (!num_tuples)
   {
+    vec.clear();
     return true;
   }
 
   //parse the raw result and populate the list 
+  TraceScope trace(this, "decode");
+  vec.reserve(num_tuples);
+  size_t filled = 0;
   for (int i=0; i<num_tuples; i++)
   {
-    boost::shared_ptr<T> entry(new T);
-    if (populateListEntry(entry.get(), result, i, fields, column_ids))
+    if (filled == vec.size()) vec.push_back(boost::shared_ptr<T>(new T));
+    else if (vec[filled].use_count() != 1) vec[filled].reset(new T);
+    //an entry that fails to parse is overwritten by the next one, or dropped
+    if (populateListEntry(vec[filled].get(), result, i, plan))
     {
-      vec.push_back(entry);
+      filled++;
     }
   }
+  vec.resize(filled);
+  trace.setRows(vec.size());
   return true;
 }
 
 
+//! Tags the statements issued during its lifetime, for repetition warnings
+/*! Example:
+
+    {
+      QueryTagScope scope(database, "grasp planning loop");
+      for (...) database.loadFromDatabase(...);
+    }
+ */
+class QueryTagScope
+{
+ private:
+  PostgresqlDatabase &database_;
+  std::string previous_tag_;
+ public:
+  QueryTagScope(PostgresqlDatabase &database, const std::string &tag) : 
+    database_(database), previous_tag_(database.getQueryTag())
+  {
+    database_.setQueryTag(tag);
+  }
+  ~QueryTagScope() {database_.setQueryTag(previous_tag_);}
+};
+
 }//namespace
 
 #endif
@@ -0,0 +1,233 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#ifndef _SHARDED_DATABASE_H_
+#define _SHARDED_DATABASE_H_
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <boost/shared_ptr.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "database_interface/postgresql_database.h"
+
+namespace database_interface {
+
+//! Spreads the instances of DBClasses over several databases, based on their primary key
+/*! Each instance lives in exactly one shard, chosen by a hash of the text value of its 
+  primary key. All shards are expected to have the same schema. Fields that live in other 
+  tables than the primary key are stored in the same shard as their primary key.
+
+  Operations on a single instance (insert, delete, save and load of a field) go to the
+  shard that owns it. Retrieving lists and counting is done on all shards in parallel, 
+  and the results are put together.
+
+  Since the shard is chosen by primary key, instances can only be inserted if their 
+  primary key is set explicitly; keys from a sequence would be generated independently
+  by each shard and would collide.
+ */
+class ShardedDatabase
+{
+ protected:
+  //! The databases holding the shards, in order
+  std::vector< boost::shared_ptr<PostgresqlDatabase> > shards_;
+
+  //! Returns the index of the shard that owns the instance with the given primary key
+  bool getShardIndex(const DBFieldBase *pk_field, size_t &index) const;
+
+  //! Retrieves the list from a single shard; run in its own thread by getList
+  template <class T>
+  void getShardList(size_t shard, std::vector< boost::shared_ptr<T> > *vec, 
+                    const Projection *projection, const FilterClause &clause, char *success) const
+  {
+    if (projection) *success = shards_[shard]->getList<T>(*vec, *projection, clause);
+    else *success = shards_[shard]->getList<T>(*vec, clause);
+  }
+
+  //! Retrieves lists from all shards in parallel. The lists are ordered by shard.
+  template <class T>
+  bool getShardLists(std::vector< std::vector< boost::shared_ptr<T> > > &lists,
+                     const Projection *projection, const FilterClause &clause) const;
+
+  //! Counts in a single shard; run in its own thread by countList
+  void countShardList(size_t shard, const DBClass *example, int *count, 
+                      const FilterClause &clause, char *success) const;
+
+ public:
+  ShardedDatabase() {}
+
+  //! Connects to each of the shards, in order
+  ShardedDatabase(const std::vector<PostgresqlDatabaseConfig> &configs);
+
+  //! Adds a shard. All shards must be added before any data is stored.
+  void addShard(boost::shared_ptr<PostgresqlDatabase> shard) {shards_.push_back(shard);}
+
+  size_t getNumShards() const {return shards_.size();}
+
+  PostgresqlDatabase& getShard(size_t i) {return *shards_.at(i);}
+
+  //! Returns true if all shards are connected
+  bool isConnected() const;
+
+  //! Inserts a new instance in the shard that owns its primary key
+  bool insertIntoDatabase(DBClass* instance);
+
+  //! Deletes an instance from the shard that owns it
+  bool deleteFromDatabase(DBClass* instance);
+
+  //! Writes the value of one field to the shard that owns the instance it belongs to
+  bool saveToDatabase(const DBFieldBase* field, bool *conflict = NULL);
+
+  //! Writes the fields of an instance to the shard that owns it
+  bool saveToDatabase(DBClass* instance, bool *conflict = NULL);
+
+  //! Reads the value of one field from the shard that owns the instance it belongs to
+  bool loadFromDatabase(DBFieldBase* field) const;
+
+  //! Retrieves the instances from all shards. Their order is not defined.
+  template <class T>
+  bool getList(std::vector< boost::shared_ptr<T> > &vec, const FilterClause clause=FilterClause()) const
+  {
+    return getMergedList<T>(vec, NULL, clause);
+  }
+
+  //! Retrieves the projected columns of the instances from all shards
+  template <class T>
+  bool getList(std::vector< boost::shared_ptr<T> > &vec, const Projection &projection,
+               const FilterClause clause=FilterClause()) const
+  {
+    return getMergedList<T>(vec, &projection, clause);
+  }
+
+  //! Retrieves the instances from all shards, ordered by the value of one of their fields
+  /*! Sorting is done here, with the operator< of F, rather than with ORDER BY on the shards:
+    the server's collation and NULL ordering would not agree with it. */
+  template <class T, class F>
+  bool getList(std::vector< boost::shared_ptr<T> > &vec, const FilterClause clause, 
+               DBField<F> T::*order_by, bool ascending=true) const;
+
+  //! Counts the instances in all shards
+  template <class T>
+  bool countList(int &count, const FilterClause clause=FilterClause()) const
+  {
+    T example;
+    return countList(&example, count, clause);
+  }
+
+  //! Counts the instances in all shards
+  bool countList(const DBClass *example, int &count, const FilterClause &clause) const;
+
+ private:
+  //! Retrieves lists from all shards and concatenates them
+  template <class T>
+  bool getMergedList(std::vector< boost::shared_ptr<T> > &vec, const Projection *projection,
+                     const FilterClause &clause) const
+  {
+    std::vector< std::vector< boost::shared_ptr<T> > > lists;
+    if (!getShardLists(lists, projection, clause)) return false;
+    vec.clear();
+    for (size_t i=0; i<lists.size(); i++)
+    {
+      vec.insert(vec.end(), lists[i].begin(), lists[i].end());
+    }
+    return true;
+  }
+};
+
+template <class T>
+bool ShardedDatabase::getShardLists(std::vector< std::vector< boost::shared_ptr<T> > > &lists,
+                                    const Projection *projection, const FilterClause &clause) const
+{
+  lists.clear();
+  lists.resize(shards_.size());
+  std::vector<char> success(shards_.size(), 0);
+  if (shards_.size() == 1)
+  {
+    getShardList<T>(0, &lists[0], projection, clause, &success[0]);
+  }
+  else
+  {
+    //each shard has its own connection, so they can all be queried at the same time
+    boost::thread_group threads;
+    for (size_t i=0; i<shards_.size(); i++)
+    {
+      threads.create_thread(boost::bind(&ShardedDatabase::getShardList<T>, this, i, &lists[i],
+                                        projection, boost::cref(clause), &success[i]));
+    }
+    threads.join_all();
+  }
+  for (size_t i=0; i<shards_.size(); i++)
+  {
+    if (!success[i])
+    {
+      ROS_ERROR("Sharded database get list: query failed on shard %d", (int)i);
+      return false;
+    }
+  }
+  return true;
+}
+
+//! Orders instances by the value of one of their fields
+template <class T, class F>
+class FieldLess
+{
+ private:
+  DBField<F> T::*field_;
+  bool ascending_;
+ public:
+  FieldLess(DBField<F> T::*field, bool ascending) : field_(field), ascending_(ascending) {}
+  bool operator()(const boost::shared_ptr<T> &a, const boost::shared_ptr<T> &b) const
+  {
+    const F &da = ((*a).*field_).data();
+    const F &db = ((*b).*field_).data();
+    return ascending_ ? da < db : db < da;
+  }
+};
+
+template <class T, class F>
+bool ShardedDatabase::getList(std::vector< boost::shared_ptr<T> > &vec, const FilterClause clause, 
+                              DBField<F> T::*order_by, bool ascending) const
+{
+  if (!getMergedList<T>(vec, NULL, clause)) return false;
+  std::stable_sort(vec.begin(), vec.end(), FieldLess<T, F>(order_by, ascending));
+  return true;
+}
+
+} //namespace
+
+#endif
@@ -0,0 +1,103 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#include "database_interface/db_binary_buffer.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ros/ros.h>
+
+namespace database_interface {
+
+void BinaryBuffer::assign(const char *data, size_t size)
+{
+  boost::shared_ptr< std::vector<char> > copy(new std::vector<char>(data, data + size));
+  holder_ = copy;
+  data_ = copy->empty() ? NULL : &((*copy)[0]);
+  size_ = size;
+}
+
+//! Unmaps a file mapped by BinaryBuffer::mapFile when the last buffer referring to it is gone
+class MappedFileDeleter
+{
+ private:
+  size_t size_;
+ public:
+  MappedFileDeleter(size_t size) : size_(size) {}
+  void operator()(const void *address) const {munmap(const_cast<void*>(address), size_);}
+};
+
+/*! The pages are only read from disk as they are used, and can be dropped again by the
+  kernel, so even files larger than the available memory can be written to the database. */
+bool BinaryBuffer::mapFile(const std::string &filename)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    ROS_ERROR("Binary buffer: could not open %s", filename.c_str());
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0)
+  {
+    ROS_ERROR("Binary buffer: could not get the size of %s", filename.c_str());
+    close(fd);
+    return false;
+  }
+  if (info.st_size == 0)
+  {
+    close(fd);
+    clear();
+    return true;
+  }
+  void *address = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  //the mapping stays valid after the file is closed
+  close(fd);
+  if (address == MAP_FAILED)
+  {
+    ROS_ERROR("Binary buffer: could not map %s", filename.c_str());
+    return false;
+  }
+  madvise(address, info.st_size, MADV_SEQUENTIAL);
+  holder_.reset(static_cast<const void*>(address), MappedFileDeleter(info.st_size));
+  data_ = static_cast<const char*>(address);
+  size_ = info.st_size;
+  return true;
+}
+
+} //namespace
@@ -0,0 +1,228 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#include "database_interface/db_capture.h"
+
+#include <string.h>
+
+namespace database_interface {
+
+/* File format: the header, then a sequence of records, each starting with a one-byte tag.
+
+   'Q' text length, text          the text of the next statement shape (numbered from 0)
+   'S' shape, connection id, start delta, duration, flags (1 for ok, 2 for read only), 
+       result format, number of parameters, then for each parameter its kind and, unless it
+       is NULL, length and bytes
+
+   All numbers are unsigned LEB128 varints, except the start delta (microseconds since the 
+   start of the previous statement), which is zigzag encoded as statements finishing in 
+   other threads can be recorded out of order. */
+static const char CAPTURE_HEADER[] = "DBCAPTURE\002";
+static const size_t CAPTURE_HEADER_SIZE = 10;
+
+CaptureWriter::CaptureWriter(const std::string &filename) : last_start_usec_(0)
+{
+  file_ = fopen(filename.c_str(), "wb");
+  if (!file_)
+  {
+    ROS_ERROR("Capture writer: could not open %s for writing", filename.c_str());
+    return;
+  }
+  fwrite(CAPTURE_HEADER, 1, CAPTURE_HEADER_SIZE, file_);
+  start_ = ros::WallTime::now();
+}
+
+CaptureWriter::~CaptureWriter()
+{
+  if (file_) fclose(file_);
+}
+
+void CaptureWriter::writeVarint(unsigned long long value)
+{
+  unsigned char buffer[10];
+  size_t length = 0;
+  do
+  {
+    buffer[length] = value & 0x7f;
+    value >>= 7;
+    if (value) buffer[length] |= 0x80;
+    length++;
+  } while (value);
+  fwrite(buffer, 1, length, file_);
+}
+
+void CaptureWriter::writeBytes(const char *data, size_t length)
+{
+  writeVarint(length);
+  if (length) fwrite(data, 1, length, file_);
+}
+
+void CaptureWriter::record(const std::string &query, int num_params, const char* const *param_values,
+                           const int *param_lengths, const int *param_formats, int result_format, 
+                           int connection_id, const ros::WallTime &start, const ros::WallTime &end, 
+                           bool ok, bool read_only)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  if (!file_) return;
+  std::map<std::string, unsigned long>::iterator it = shapes_.find(query);
+  if (it == shapes_.end())
+  {
+    it = shapes_.insert(std::make_pair(query, (unsigned long) shapes_.size())).first;
+    fputc('Q', file_);
+    writeBytes(query.data(), query.size());
+  }
+  long long start_usec = (start - start_).toNSec() / 1000;
+  long long delta = start_usec - last_start_usec_;
+  last_start_usec_ = start_usec;
+
+  fputc('S', file_);
+  writeVarint(it->second);
+  writeVarint(connection_id < 0 ? 0 : connection_id);
+  writeVarint(delta < 0 ? ((unsigned long long) (-delta) << 1) - 1 : (unsigned long long) delta << 1);
+  long long duration = (end - start).toNSec() / 1000;
+  writeVarint(duration < 0 ? 0 : duration);
+  fputc((ok ? 1 : 0) | (read_only ? 2 : 0), file_);
+  fputc(result_format, file_);
+  writeVarint(num_params);
+  for (int i=0; i<num_params; i++)
+  {
+    if (!param_values || !param_values[i])
+    {
+      fputc(CapturedParameter::NULL_VALUE, file_);
+    }
+    else if (param_formats && param_formats[i] == 1)
+    {
+      fputc(CapturedParameter::BINARY, file_);
+      writeBytes(param_values[i], param_lengths[i]);
+    }
+    else
+    {
+      fputc(CapturedParameter::TEXT, file_);
+      writeBytes(param_values[i], strlen(param_values[i]));
+    }
+  }
+}
+
+CaptureReader::CaptureReader(const std::string &filename) : last_start_usec_(0)
+{
+  file_ = fopen(filename.c_str(), "rb");
+  if (!file_)
+  {
+    ROS_ERROR("Capture reader: could not open %s", filename.c_str());
+    return;
+  }
+  char header[CAPTURE_HEADER_SIZE];
+  if (fread(header, 1, CAPTURE_HEADER_SIZE, file_) != CAPTURE_HEADER_SIZE || 
+      memcmp(header, CAPTURE_HEADER, CAPTURE_HEADER_SIZE))
+  {
+    ROS_ERROR("Capture reader: %s is not a capture file", filename.c_str());
+    fclose(file_);
+    file_ = NULL;
+  }
+}
+
+CaptureReader::~CaptureReader()
+{
+  if (file_) fclose(file_);
+}
+
+bool CaptureReader::readVarint(unsigned long long &value)
+{
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    int c = fgetc(file_);
+    if (c == EOF) return false;
+    value |= (unsigned long long) (c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+bool CaptureReader::readBytes(size_t length, std::string &data)
+{
+  data.resize(length);
+  return !length || fread(&data[0], 1, length, file_) == length;
+}
+
+bool CaptureReader::next(CapturedStatement &statement)
+{
+  if (!file_) return false;
+  int tag;
+  while ((tag = fgetc(file_)) == 'Q')
+  {
+    unsigned long long length;
+    std::string query;
+    if (!readVarint(length) || !readBytes(length, query)) break;
+    shapes_.push_back(query);
+  }
+  if (tag == EOF) return false;
+
+  unsigned long long shape, connection_id, delta, duration, num_params;
+  int flags, result_format;
+  if (tag != 'S' || !readVarint(shape) || shape >= shapes_.size() || !readVarint(connection_id) ||
+      !readVarint(delta) || !readVarint(duration) || (flags = fgetc(file_)) == EOF || 
+      (result_format = fgetc(file_)) == EOF || !readVarint(num_params))
+  {
+    ROS_ERROR("Capture reader: corrupt statement record");
+    return false;
+  }
+  statement.query = shapes_[shape];
+  statement.connection_id = connection_id;
+  last_start_usec_ += (delta & 1) ? -(long long) ((delta + 1) >> 1) : (long long) (delta >> 1);
+  statement.start_usec = last_start_usec_;
+  statement.duration_usec = duration;
+  statement.ok = (flags & 1) != 0;
+  statement.read_only = (flags & 2) != 0;
+  statement.result_format = result_format;
+  statement.params.resize(num_params);
+  for (size_t i=0; i<num_params; i++)
+  {
+    int kind = fgetc(file_);
+    unsigned long long length;
+    statement.params[i].value.clear();
+    statement.params[i].kind = (CapturedParameter::Kind) kind;
+    if (kind == CapturedParameter::NULL_VALUE) continue;
+    if ((kind != CapturedParameter::TEXT && kind != CapturedParameter::BINARY) ||
+        !readVarint(length) || !readBytes(length, statement.params[i].value))
+    {
+      ROS_ERROR("Capture reader: corrupt parameter record");
+      return false;
+    }
+  }
+  return true;
+}
+
+} //namespace
@@ -0,0 +1,224 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#include "database_interface/db_copy.h"
+
+#include <cstring>
+
+#include <ros/ros.h>
+
+#include "database_interface/db_field.h"
+
+namespace database_interface {
+
+//! Every binary COPY stream starts with this signature
+static const char COPY_SIGNATURE[] = "PGCOPY\n\377\r\n";
+static const size_t COPY_SIGNATURE_LENGTH = 11;
+
+CopyFileSink::~CopyFileSink()
+{
+  if (file_) fclose(file_);
+}
+
+bool CopyFileSink::begin(const std::vector<std::string> &/*columns*/)
+{
+  if (file_) fclose(file_);
+  file_ = fopen(filename_.c_str(), "wb");
+  if (!file_)
+  {
+    ROS_ERROR("Copy file sink: could not open %s for writing", filename_.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool CopyFileSink::data(const char *data, size_t length)
+{
+  if (!file_ || fwrite(data, 1, length, file_) != length)
+  {
+    ROS_ERROR("Copy file sink: write to %s failed", filename_.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool CopyFileSink::end()
+{
+  if (!file_) return false;
+  bool success = (fclose(file_) == 0);
+  file_ = NULL;
+  if (!success) ROS_ERROR("Copy file sink: could not close %s", filename_.c_str());
+  return success;
+}
+
+bool CopyRowSink::begin(const std::vector<std::string> &/*columns*/)
+{
+  pending_.clear();
+  header_done_ = false;
+  trailer_done_ = false;
+  return true;
+}
+
+/*! The server normally sends one row per chunk, so rows are parsed straight from the chunk 
+  and only an incomplete row at its end is copied. */
+bool CopyRowSink::data(const char *data, size_t length)
+{
+  size_t used;
+  if (pending_.empty())
+  {
+    if (!parse(data, length, used)) return false;
+    pending_.assign(data + used, length - used);
+    return true;
+  }
+  pending_.append(data, length);
+  if (!parse(pending_.data(), pending_.size(), used)) return false;
+  pending_.erase(0, used);
+  return true;
+}
+
+bool CopyRowSink::end()
+{
+  if (!trailer_done_ || !pending_.empty())
+  {
+    ROS_ERROR("Copy row sink: stream ended in the middle of a row");
+    return false;
+  }
+  return true;
+}
+
+bool CopyRowSink::parse(const char *data, size_t length, size_t &used)
+{
+  used = 0;
+  if (!header_done_)
+  {
+    //signature, flags and header extension length
+    if (length < COPY_SIGNATURE_LENGTH + 8) return true;
+    if (memcmp(data, COPY_SIGNATURE, COPY_SIGNATURE_LENGTH))
+    {
+      ROS_ERROR("Copy row sink: stream does not start with the binary COPY signature");
+      return false;
+    }
+    size_t extension = readNetworkOrder(data + COPY_SIGNATURE_LENGTH + 4, 4);
+    if (length < COPY_SIGNATURE_LENGTH + 8 + extension) return true;
+    used = COPY_SIGNATURE_LENGTH + 8 + extension;
+    header_done_ = true;
+  }
+
+  while (!trailer_done_ && length - used >= 2)
+  {
+    size_t pos = used;
+    int num_fields = (short) readNetworkOrder(data + pos, 2);
+    pos += 2;
+    if (num_fields == -1)
+    {
+      trailer_done_ = true;
+      used = pos;
+      break;
+    }
+    values_.resize(num_fields);
+    lengths_.resize(num_fields);
+    bool complete = true;
+    for (int f=0; f<num_fields; f++)
+    {
+      if (length - pos < 4) { complete = false; break; }
+      int field_length = (int) (unsigned int) readNetworkOrder(data + pos, 4);
+      pos += 4;
+      if (field_length < 0)
+      {
+        values_[f] = NULL;
+        lengths_[f] = 0;
+        continue;
+      }
+      if (length - pos < (size_t) field_length) { complete = false; break; }
+      values_[f] = data + pos;
+      lengths_[f] = field_length;
+      pos += field_length;
+    }
+    if (!complete) break;
+    used = pos;
+    if (!handleRow(values_, lengths_)) return false;
+  }
+  return true;
+}
+
+bool CopyColumnarBuffer::begin(const std::vector<std::string> &columns)
+{
+  clear();
+  columns_.resize(columns.size());
+  for (size_t c=0; c<columns.size(); c++) columns_[c].name = columns[c];
+  return CopyRowSink::begin(columns);
+}
+
+bool CopyColumnarBuffer::handleRow(const std::vector<const char*> &values, 
+                                   const std::vector<size_t> &lengths)
+{
+  if (values.size() != columns_.size())
+  {
+    ROS_ERROR("Copy columnar buffer: expected %d columns, got %d", 
+              (int) columns_.size(), (int) values.size());
+    return false;
+  }
+  for (size_t c=0; c<values.size(); c++)
+  {
+    Column &column = columns_[c];
+    column.offsets.push_back(column.data.size());
+    if (!values[c])
+    {
+      column.lengths.push_back(-1);
+      continue;
+    }
+    column.lengths.push_back(lengths[c]);
+    column.data.insert(column.data.end(), values[c], values[c] + lengths[c]);
+  }
+  num_rows_++;
+  return true;
+}
+
+bool CopyColumnarBuffer::getValue(size_t row, size_t column, const char* &value, size_t &length) const
+{
+  const Column &col = columns_.at(column);
+  if (col.lengths.at(row) < 0) return false;
+  length = col.lengths[row];
+  value = length ? &col.data[col.offsets[row]] : "";
+  return true;
+}
+
+void CopyColumnarBuffer::clear()
+{
+  columns_.clear();
+  num_rows_ = 0;
+}
+
+} //namespace
@@ -0,0 +1,349 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#include "database_interface/db_field.h"
+
+#include <stdlib.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+
+namespace database_interface {
+
+static const int64_t USEC_PER_DAY = (int64_t) 86400 * 1000000;
+
+//! Number of days since 1970-01-01 of a date in the proleptic Gregorian calendar
+/*! Year 0 is 1 BC, as in ISO 8601. */
+static int64_t daysFromCivil(int64_t year, unsigned month, unsigned day)
+{
+  year -= month <= 2;
+  const int64_t era = (year >= 0 ? year : year - 399) / 400;
+  const unsigned year_of_era = (unsigned) (year - era * 400);
+  const unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  const unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+  return era * 146097 + (int64_t) day_of_era - 719468;
+}
+
+//! Inverse of daysFromCivil
+static void civilFromDays(int64_t days, int64_t &year, unsigned &month, unsigned &day)
+{
+  days += 719468;
+  const int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  const unsigned day_of_era = (unsigned) (days - era * 146097);
+  const unsigned year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  const unsigned day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  const unsigned mp = (5 * day_of_year + 2) / 153;
+  day = day_of_year - (153 * mp + 2) / 5 + 1;
+  month = mp < 10 ? mp + 3 : mp - 9;
+  year = (int64_t) year_of_era + era * 400 + (month <= 2);
+}
+
+//! Reads between min_digits and max_digits decimal digits, advancing pos
+static bool readDigits(const char *str, size_t length, size_t &pos, size_t min_digits, size_t max_digits, 
+                       int64_t &value)
+{
+  size_t start = pos;
+  value = 0;
+  while (pos < length && pos - start < max_digits && str[pos] >= '0' && str[pos] <= '9')
+  {
+    value = value * 10 + (str[pos] - '0');
+    pos++;
+  }
+  return pos - start >= min_digits;
+}
+
+static bool matches(const char *str, size_t length, const char *literal)
+{
+  return length == strlen(literal) && strncasecmp(str, literal, length) == 0;
+}
+
+//! Parses "YYYY-MM-DD" at pos, returning the astronomical year (before any BC suffix)
+static bool readDate(const char *str, size_t length, size_t &pos, int64_t &year, int64_t &month, int64_t &day)
+{
+  if (!readDigits(str, length, pos, 1, 9, year)) return false;
+  if (pos >= length || str[pos] != '-') return false;
+  pos++;
+  if (!readDigits(str, length, pos, 1, 2, month) || month < 1 || month > 12) return false;
+  if (pos >= length || str[pos] != '-') return false;
+  pos++;
+  if (!readDigits(str, length, pos, 1, 2, day) || day < 1 || day > 31) return false;
+  return true;
+}
+
+//! Reads an optional " BC" suffix at pos and converts year to an astronomical year
+static bool readEra(const char *str, size_t length, size_t &pos, int64_t &year)
+{
+  if (pos == length) return year >= 1;
+  if (!matches(str + pos, length - pos, " BC") || year < 1) return false;
+  pos = length;
+  year = 1 - year;
+  return true;
+}
+
+bool parseTimestamp(const char *str, size_t length, DBTimestamp &timestamp)
+{
+  if (matches(str, length, "infinity")) 
+  {
+    timestamp.usec = std::numeric_limits<int64_t>::max();
+    return true;
+  }
+  if (matches(str, length, "-infinity")) 
+  {
+    timestamp.usec = std::numeric_limits<int64_t>::min();
+    return true;
+  }
+
+  size_t pos = 0;
+  int64_t year, month, day;
+  if (!readDate(str, length, pos, year, month, day)) return false;
+
+  int64_t hour = 0, minute = 0, second = 0, usec = 0, offset = 0;
+  if (pos < length && (str[pos] == ' ' || str[pos] == 'T') && pos + 1 < length && 
+      str[pos + 1] >= '0' && str[pos + 1] <= '9')
+  {
+    pos++;
+    if (!readDigits(str, length, pos, 2, 2, hour) || hour > 24) return false;
+    if (pos >= length || str[pos] != ':') return false;
+    pos++;
+    if (!readDigits(str, length, pos, 2, 2, minute) || minute > 59) return false;
+    if (pos < length && str[pos] == ':')
+    {
+      pos++;
+      if (!readDigits(str, length, pos, 2, 2, second) || second > 60) return false;
+      if (pos < length && str[pos] == '.')
+      {
+        pos++;
+        size_t start = pos;
+        if (!readDigits(str, length, pos, 1, 6, usec)) return false;
+        for (size_t i = pos - start; i < 6; i++) usec *= 10;
+        //the server never sends more than microseconds; further digits are truncated
+        while (pos < length && str[pos] >= '0' && str[pos] <= '9') pos++;
+      }
+    }
+    //time zone, as an offset from UTC
+    if (pos < length && (str[pos] == 'Z' || str[pos] == 'z')) 
+    {
+      pos++;
+    }
+    else if (pos < length && (str[pos] == '+' || str[pos] == '-'))
+    {
+      int64_t sign = str[pos] == '-' ? -1 : 1;
+      int64_t zone_hour, zone_minute = 0, zone_second = 0;
+      pos++;
+      if (!readDigits(str, length, pos, 2, 2, zone_hour)) return false;
+      if (pos < length && str[pos] == ':')
+      {
+        pos++;
+        if (!readDigits(str, length, pos, 2, 2, zone_minute)) return false;
+        if (pos < length && str[pos] == ':')
+        {
+          pos++;
+          if (!readDigits(str, length, pos, 2, 2, zone_second)) return false;
+        }
+      }
+      offset = sign * (zone_hour * 3600 + zone_minute * 60 + zone_second);
+    }
+  }
+  if (!readEra(str, length, pos, year)) return false;
+
+  int64_t days = daysFromCivil(year, (unsigned) month, (unsigned) day);
+  int64_t seconds = hour * 3600 + minute * 60 + second - offset;
+  timestamp.usec = days * USEC_PER_DAY + seconds * 1000000 + usec;
+  return true;
+}
+
+std::string formatTimestamp(const DBTimestamp &timestamp)
+{
+  if (timestamp.usec == std::numeric_limits<int64_t>::max()) return "infinity";
+  if (timestamp.usec == std::numeric_limits<int64_t>::min()) return "-infinity";
+
+  int64_t days = timestamp.usec / USEC_PER_DAY;
+  int64_t usec = timestamp.usec % USEC_PER_DAY;
+  if (usec < 0)
+  {
+    usec += USEC_PER_DAY;
+    days--;
+  }
+  int64_t year;
+  unsigned month, day;
+  civilFromDays(days, year, month, day);
+  int64_t seconds = usec / 1000000;
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%04lld-%02u-%02u %02d:%02d:%02d.%06d+00%s", 
+           (long long) (year >= 1 ? year : 1 - year), month, day, 
+           (int) (seconds / 3600), (int) (seconds / 60 % 60), (int) (seconds % 60), (int) (usec % 1000000), 
+           year >= 1 ? "" : " BC");
+  return buffer;
+}
+
+bool parseDate(const char *str, size_t length, DBDate &date)
+{
+  if (matches(str, length, "infinity")) 
+  {
+    date.days = std::numeric_limits<int32_t>::max();
+    return true;
+  }
+  if (matches(str, length, "-infinity")) 
+  {
+    date.days = std::numeric_limits<int32_t>::min();
+    return true;
+  }
+  size_t pos = 0;
+  int64_t year, month, day;
+  if (!readDate(str, length, pos, year, month, day)) return false;
+  if (!readEra(str, length, pos, year)) return false;
+  date.days = (int32_t) daysFromCivil(year, (unsigned) month, (unsigned) day);
+  return true;
+}
+
+std::string formatDate(const DBDate &date)
+{
+  if (date.days == std::numeric_limits<int32_t>::max()) return "infinity";
+  if (date.days == std::numeric_limits<int32_t>::min()) return "-infinity";
+  int64_t year;
+  unsigned month, day;
+  civilFromDays(date.days, year, month, day);
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%04lld-%02u-%02u%s", (long long) (year >= 1 ? year : 1 - year), 
+           month, day, year >= 1 ? "" : " BC");
+  return buffer;
+}
+
+static int hexValue(char c)
+{
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool parseUuid(const char *str, size_t length, DBUuid &uuid)
+{
+  size_t pos = 0;
+  bool braces = length > 0 && str[0] == '{';
+  if (braces)
+  {
+    if (str[length - 1] != '}') return false;
+    pos = 1;
+    length--;
+  }
+  for (size_t i = 0; i < 16; i++)
+  {
+    //hyphens are accepted after any group of four digits, as the server does
+    if (i > 0 && i % 2 == 0 && pos < length && str[pos] == '-') pos++;
+    if (pos + 2 > length) return false;
+    int high = hexValue(str[pos]), low = hexValue(str[pos + 1]);
+    if (high < 0 || low < 0) return false;
+    uuid.bytes[i] = (unsigned char) (high * 16 + low);
+    pos += 2;
+  }
+  return pos == length;
+}
+
+std::string formatUuid(const DBUuid &uuid)
+{
+  static const char digits[] = "0123456789abcdef";
+  std::string str;
+  str.reserve(36);
+  for (size_t i = 0; i < 16; i++)
+  {
+    if (i == 4 || i == 6 || i == 8 || i == 10) str += '-';
+    str += digits[uuid.bytes[i] >> 4];
+    str += digits[uuid.bytes[i] & 0xf];
+  }
+  return str;
+}
+
+bool parseInt64(const char *str, size_t length, int64_t &value)
+{
+  //values from the server are null-terminated, but those from a std::string need not be checked
+  char buffer[32];
+  if (length == 0 || length >= sizeof(buffer)) return false;
+  memcpy(buffer, str, length);
+  buffer[length] = '\0';
+  char *end;
+  errno = 0;
+  long long result = strtoll(buffer, &end, 10);
+  if (errno != 0 || end != buffer + length) return false;
+  value = (int64_t) result;
+  return true;
+}
+
+bool parseFloat(const char *str, size_t length, float &value)
+{
+  if (matches(str, length, "NaN")) 
+  {
+    value = std::numeric_limits<float>::quiet_NaN();
+    return true;
+  }
+  if (matches(str, length, "Infinity") || matches(str, length, "inf")) 
+  {
+    value = std::numeric_limits<float>::infinity();
+    return true;
+  }
+  if (matches(str, length, "-Infinity") || matches(str, length, "-inf")) 
+  {
+    value = -std::numeric_limits<float>::infinity();
+    return true;
+  }
+  char buffer[64];
+  if (length == 0 || length >= sizeof(buffer)) return false;
+  memcpy(buffer, str, length);
+  buffer[length] = '\0';
+  char *end;
+  errno = 0;
+  float result = strtof(buffer, &end);
+  //underflow to zero or a denormal is accepted, as the server would send it
+  if ((errno != 0 && fabsf(result) > 1.0f) || end != buffer + length) return false;
+  value = result;
+  return true;
+}
+
+std::ostream& operator << (std::ostream &str, const DBTimestamp &timestamp)
+{
+  return str << formatTimestamp(timestamp);
+}
+
+std::ostream& operator << (std::ostream &str, const DBDate &date)
+{
+  return str << formatDate(date);
+}
+
+std::ostream& operator << (std::ostream &str, const DBUuid &uuid)
+{
+  return str << formatUuid(uuid);
+}
+
+} //namespace database_interface
@@ -0,0 +1,88 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#ifndef _DB_PROBES_H_
+#define _DB_PROBES_H_
+
+/* Static probes (USDT) in PostgresqlDatabase, for bpftrace, perf or SystemTap, e.g.
+
+     bpftrace -e 'usdt:./libpostgresql_database.so:database_interface:query__done 
+                  { @rows[arg0] = sum(arg2); }'
+
+   A probe is a single nop until a tracer attaches to it. The arguments of some probes take 
+   work to compute, so those probes have a semaphore, which the tracer sets while attached; 
+   check it with DB_PROBE_ENABLED before computing the arguments. Every probe in the file 
+   must have its semaphore defined with DB_PROBE_SEMAPHORE, outside of any namespace.
+
+   Probes:
+     query__start(fingerprint, query, num_params)   a statement is about to be sent
+     query__done(fingerprint, status, rows)         its result is back (status is an 
+                                                    ExecStatusType)
+     connection__acquire(pid, replica)              a connection is taken for a statement
+     result__receive(pid, status)                   the result has been read from it
+     connection__release(pid)                       the connection is free again
+     row__decode__start(row)                        getList starts decoding a row
+     row__decode__done(row, ok)
+     notification__receive(channel, pid, payload)
+
+   Without sys/sdt.h, probes compile to nothing. */
+
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define DB_PROBE_SEMAPHORE(name) \
+  __extension__ unsigned short database_interface_##name##_semaphore \
+  __attribute__ ((unused)) __attribute__ ((section (".probes")))
+#define DB_PROBE_ENABLED(name) __builtin_expect(database_interface_##name##_semaphore, 0)
+
+#define DB_PROBE1(name, a) STAP_PROBE1(database_interface, name, a)
+#define DB_PROBE2(name, a, b) STAP_PROBE2(database_interface, name, a, b)
+#define DB_PROBE3(name, a, b, c) STAP_PROBE3(database_interface, name, a, b, c)
+
+#else
+
+#define DB_PROBE_SEMAPHORE(name) extern int database_interface_no_probes
+#define DB_PROBE_ENABLED(name) 0
+
+//the arguments are not evaluated, but count as used
+#define DB_PROBE1(name, a) do { if (0) {(void) (a);} } while (0)
+#define DB_PROBE2(name, a, b) do { if (0) {(void) (a); (void) (b);} } while (0)
+#define DB_PROBE3(name, a, b, c) do { if (0) {(void) (a); (void) (b); (void) (c);} } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,471 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#include "database_interface/db_query_stats.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <typeinfo>
+#include <cxxabi.h>
+#include <execinfo.h>
+
+namespace database_interface {
+
+static bool isIdentifierChar(char c)
+{
+  return isalnum((unsigned char) c) || c == '_' || c == '$';
+}
+
+std::string fingerprintQuery(const std::string &query)
+{
+  std::string result;
+  result.reserve(query.size());
+  size_t i = 0;
+  while (i < query.size())
+  {
+    char c = query[i];
+    if (c == '\'')
+    {
+      //string literal; a quote inside it is doubled
+      i++;
+      while (i < query.size())
+      {
+        if (query[i] == '\'' && i + 1 < query.size() && query[i+1] == '\'') i += 2;
+        else if (query[i] == '\'') break;
+        else i++;
+      }
+      i++;
+      result += '?';
+    }
+    else if (c == '"')
+    {
+      //quoted identifier, kept as is
+      size_t end = query.find('"', i + 1);
+      if (end == std::string::npos) end = query.size() - 1;
+      result.append(query, i, end - i + 1);
+      i = end + 1;
+    }
+    else if (isdigit((unsigned char) c) && (result.empty() || !isIdentifierChar(result[result.size()-1])))
+    {
+      while (i < query.size() && (isalnum((unsigned char) query[i]) || query[i] == '.')) i++;
+      result += '?';
+    }
+    else if (isspace((unsigned char) c))
+    {
+      while (i < query.size() && isspace((unsigned char) query[i])) i++;
+      if (!result.empty()) result += ' ';
+    }
+    else
+    {
+      result += c;
+      i++;
+    }
+  }
+  if (!result.empty() && result[result.size()-1] == ' ') result.erase(result.size()-1);
+
+  //reduce lists of values to a single one, so that lists of any length look the same
+  const char *lists[] = {"?, ?", "?,?"};
+  for (int l=0; l<2; l++)
+  {
+    size_t pos;
+    while ( (pos = result.find(lists[l])) != std::string::npos ) result.replace(pos, strlen(lists[l]), "?");
+  }
+  return result;
+}
+
+//! Suggests the batched alternative to repeating a statement of the given fingerprint
+static const char* batchingAdvice(const std::string &fingerprint)
+{
+  std::string start(fingerprint, 0, 13);
+  for (size_t i=0; i<start.size(); i++) start[i] = toupper((unsigned char) start[i]);
+  if (start.compare(0, 13, "SELECT COUNT(") == 0)
+  {
+    return "count once with a combined FilterClause, or count a list retrieved once";
+  }
+  if (start.compare(0, 6, "SELECT") == 0)
+  {
+    return "retrieve all the instances with a single getList, combining the per-item clauses "
+      "into one FilterClause (or load them once into a DBCollection); instead of calling "
+      "loadFromDatabase per instance, use getList with a Projection of the needed fields";
+  }
+  if (start.compare(0, 6, "INSERT") == 0)
+  {
+    return "for bulk loads, use COPY FROM instead of one insertIntoDatabase per instance";
+  }
+  if (start.compare(0, 6, "UPDATE") == 0)
+  {
+    return "saveToDatabase writes one field of one instance; change many rows with a single UPDATE";
+  }
+  if (start.compare(0, 6, "DELETE") == 0)
+  {
+    return "deleteFromDatabase removes one instance; remove many rows with a single DELETE";
+  }
+  return "combine the repeated statements into one";
+}
+
+void RepeatedQueryDetector::configure(unsigned int threshold, double window, bool print_stack)
+{
+  threshold_ = threshold;
+  window_ = window;
+  print_stack_ = print_stack;
+  entries_.clear();
+}
+
+void RepeatedQueryDetector::setTag(const std::string &tag)
+{
+  tag_ = tag;
+  entries_.clear();
+}
+
+/*! Each fingerprint is counted in windows of window_ seconds, starting at its first use. We
+  warn once per window, when the count goes over the threshold. */
+bool RepeatedQueryDetector::record(const std::string &query)
+{
+  if (!threshold_) return false;
+  std::string fingerprint = fingerprintQuery(query);
+  ros::WallTime now = ros::WallTime::now();
+  std::map<std::string, Entry>::iterator it = entries_.find(fingerprint);
+  if (it == entries_.end() || (now - it->second.window_start).toSec() > window_)
+  {
+    Entry entry;
+    entry.window_start = now;
+    entry.count = 1;
+    entry.warned = false;
+    entries_[fingerprint] = entry;
+    return false;
+  }
+  Entry &entry = it->second;
+  entry.count++;
+  if (entry.warned || entry.count <= threshold_) return false;
+  entry.warned = true;
+
+  ROS_WARN("Database: statement sent %u times within %.2f seconds%s%s: %s\n"
+           "  To save round trips, %s.", entry.count, window_, 
+           tag_.empty() ? "" : " in ", tag_.c_str(), fingerprint.c_str(), batchingAdvice(fingerprint));
+  if (print_stack_)
+  {
+    void *frames[32];
+    int num_frames = backtrace(frames, 32);
+    char **symbols = backtrace_symbols(frames, num_frames);
+    if (symbols)
+    {
+      for (int f=1; f<num_frames; f++) ROS_WARN("  at %s", symbols[f]);
+      free(symbols);
+    }
+  }
+  return true;
+}
+
+std::string FilterUsage::getSignature() const
+{
+  std::string signature(table + ":");
+  if (!structured) signature += " (unstructured)";
+  for (size_t i=0; i<columns.size(); i++)
+  {
+    if (i) signature += " AND";
+    signature += " " + columns[i].table + "." + columns[i].column + " " + columns[i].op;
+  }
+  return signature;
+}
+
+static bool compareColumns(const FilterColumnUsage &lhs, const FilterColumnUsage &rhs)
+{
+  if (lhs.table != rhs.table) return lhs.table < rhs.table;
+  if (lhs.column != rhs.column) return lhs.column < rhs.column;
+  return lhs.op < rhs.op;
+}
+
+void FilterUsageStats::record(const FilterUsage &shape, double seconds, unsigned long rows)
+{
+  if (!enabled_) return;
+  FilterUsage sorted(shape);
+  std::sort(sorted.columns.begin(), sorted.columns.end(), compareColumns);
+  FilterUsage &entry = entries_.insert(std::make_pair(sorted.getSignature(), sorted)).first->second;
+  entry.count++;
+  entry.total_time += seconds;
+  entry.max_time = std::max(entry.max_time, seconds);
+  entry.rows += rows;
+}
+
+static bool compareTotalTime(const FilterUsage &lhs, const FilterUsage &rhs)
+{
+  return lhs.total_time > rhs.total_time;
+}
+
+void FilterUsageStats::getEntries(std::vector<FilterUsage> &entries) const
+{
+  entries.clear();
+  std::map<std::string, FilterUsage>::const_iterator it;
+  for (it=entries_.begin(); it!=entries_.end(); it++) entries.push_back(it->second);
+  std::sort(entries.begin(), entries.end(), compareTotalTime);
+}
+
+//! Makes a sample value safe to write as one tab separated field
+static std::string escapeField(const std::string &str)
+{
+  std::string result;
+  for (size_t i=0; i<str.size(); i++)
+  {
+    if (str[i] == '\\') result += "\\\\";
+    else if (str[i] == '\t') result += "\\t";
+    else if (str[i] == '\n') result += "\\n";
+    else result += str[i];
+  }
+  return result;
+}
+
+static std::string unescapeField(const std::string &str)
+{
+  std::string result;
+  for (size_t i=0; i<str.size(); i++)
+  {
+    if (str[i] != '\\' || i + 1 == str.size()) 
+    {
+      result += str[i];
+      continue;
+    }
+    i++;
+    if (str[i] == 't') result += '\t';
+    else if (str[i] == 'n') result += '\n';
+    else result += str[i];
+  }
+  return result;
+}
+
+static void splitFields(const std::string &line, std::vector<std::string> &fields)
+{
+  fields.clear();
+  size_t start = 0;
+  while (true)
+  {
+    size_t end = line.find('\t', start);
+    fields.push_back(line.substr(start, end == std::string::npos ? std::string::npos : end - start));
+    if (end == std::string::npos) break;
+    start = end + 1;
+  }
+}
+
+/*! Each shape is a "filter" line (table, structured flag, count, total and maximum time,
+  rows), followed by one "column" line for each of its comparisons (table, column, 
+  comparison, sample value). Fields are separated by tabs. */
+bool FilterUsageStats::save(const std::string &filename) const
+{
+  std::ofstream file(filename.c_str());
+  if (!file)
+  {
+    ROS_ERROR("Filter usage: could not open %s for writing", filename.c_str());
+    return false;
+  }
+  std::map<std::string, FilterUsage>::const_iterator it;
+  for (it=entries_.begin(); it!=entries_.end(); it++)
+  {
+    const FilterUsage &entry = it->second;
+    file << "filter\t" << entry.table << "\t" << (entry.structured ? 1 : 0) << "\t" << entry.count 
+         << "\t" << entry.total_time << "\t" << entry.max_time << "\t" << entry.rows << "\n";
+    for (size_t i=0; i<entry.columns.size(); i++)
+    {
+      const FilterColumnUsage &column = entry.columns[i];
+      file << "column\t" << column.table << "\t" << column.column << "\t" << column.op 
+           << "\t" << escapeField(column.sample) << "\n";
+    }
+  }
+  if (!file)
+  {
+    ROS_ERROR("Filter usage: failed to write %s", filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool FilterUsageStats::load(const std::string &filename)
+{
+  std::ifstream file(filename.c_str());
+  if (!file)
+  {
+    ROS_ERROR("Filter usage: could not open %s", filename.c_str());
+    return false;
+  }
+  std::vector<FilterUsage> loaded;
+  std::string line;
+  std::vector<std::string> fields;
+  int line_num = 0;
+  while (std::getline(file, line))
+  {
+    line_num++;
+    if (line.empty()) continue;
+    splitFields(line, fields);
+    if (fields[0] == "filter" && fields.size() == 7)
+    {
+      FilterUsage entry;
+      entry.table = fields[1];
+      entry.structured = (fields[2] == "1");
+      std::istringstream values(fields[3] + " " + fields[4] + " " + fields[5] + " " + fields[6]);
+      if (values >> entry.count >> entry.total_time >> entry.max_time >> entry.rows)
+      {
+        loaded.push_back(entry);
+        continue;
+      }
+    }
+    else if (fields[0] == "column" && fields.size() == 5 && !loaded.empty())
+    {
+      FilterColumnUsage column;
+      column.table = fields[1];
+      column.column = fields[2];
+      column.op = fields[3];
+      column.sample = unescapeField(fields[4]);
+      loaded.back().columns.push_back(column);
+      continue;
+    }
+    ROS_ERROR("Filter usage: %s line %d is not valid", filename.c_str(), line_num);
+    return false;
+  }
+
+  for (size_t i=0; i<loaded.size(); i++)
+  {
+    std::string signature = loaded[i].getSignature();
+    std::map<std::string, FilterUsage>::iterator it = entries_.find(signature);
+    if (it == entries_.end())
+    {
+      entries_[signature] = loaded[i];
+      continue;
+    }
+    it->second.count += loaded[i].count;
+    it->second.total_time += loaded[i].total_time;
+    it->second.max_time = std::max(it->second.max_time, loaded[i].max_time);
+    it->second.rows += loaded[i].rows;
+  }
+  return true;
+}
+
+//! The name of a type as it is written in C++, or as the compiler knows it if that fails
+static std::string demangle(const char *name)
+{
+  int status;
+  char *demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+  if (status != 0 || !demangled) return name;
+  std::string result(demangled);
+  free(demangled);
+  //spell out strings the way they are written
+  const char *spellings[] = {"std::__cxx11::basic_string<char, std::char_traits<char>, std::allocator<char> >",
+                             "std::basic_string<char, std::char_traits<char>, std::allocator<char> >"};
+  for (size_t s=0; s<2; s++)
+  {
+    size_t pos;
+    while ((pos = result.find(spellings[s])) != std::string::npos) 
+    {
+      result.replace(pos, strlen(spellings[s]), "std::string");
+    }
+  }
+  return result;
+}
+
+FieldCodecUsage& FieldCodecStats::getEntry(const DBFieldBase *field)
+{
+  const char *type = typeid(*field).name();
+  std::string key(field->getTableName() + "." + field->getName() + "\t" + type);
+  std::map<std::string, FieldCodecUsage>::iterator it = entries_.find(key);
+  if (it != entries_.end()) return it->second;
+  FieldCodecUsage &entry = entries_[key];
+  entry.table = field->getTableName();
+  entry.column = field->getName();
+  entry.type = demangle(type);
+  return entry;
+}
+
+void FieldCodecStats::recordDecode(const DBFieldBase *field, double seconds, size_t bytes)
+{
+  if (!enabled_) return;
+  FieldCodecUsage &entry = getEntry(field);
+  entry.decodes++;
+  entry.decode_time += seconds;
+  entry.decode_bytes += bytes;
+}
+
+void FieldCodecStats::recordEncode(const DBFieldBase *field, double seconds, size_t bytes)
+{
+  if (!enabled_) return;
+  FieldCodecUsage &entry = getEntry(field);
+  entry.encodes++;
+  entry.encode_time += seconds;
+  entry.encode_bytes += bytes;
+}
+
+static bool compareCodecTime(const FieldCodecUsage &lhs, const FieldCodecUsage &rhs)
+{
+  return lhs.getTotalTime() > rhs.getTotalTime();
+}
+
+void FieldCodecStats::getEntries(std::vector<FieldCodecUsage> &entries) const
+{
+  entries.clear();
+  std::map<std::string, FieldCodecUsage>::const_iterator it;
+  for (it=entries_.begin(); it!=entries_.end(); it++) entries.push_back(it->second);
+  std::sort(entries.begin(), entries.end(), compareCodecTime);
+}
+
+/*! For each column: its share of the total time, then for decoding and encoding in turn the
+  number of values, the total time, the time per value and the average size of a value. */
+void FieldCodecStats::printReport(std::ostream &str) const
+{
+  std::vector<FieldCodecUsage> entries;
+  getEntries(entries);
+  double total = 0.0;
+  for (size_t i=0; i<entries.size(); i++) total += entries[i].getTotalTime();
+
+  char line[256];
+  snprintf(line, sizeof(line), "%6s  %10s %9s %9s %9s  %10s %9s %9s %9s  %s\n", "share", 
+           "decodes", "ms", "us/value", "bytes", "encodes", "ms", "us/value", "bytes", "column (type)");
+  str << line;
+  for (size_t i=0; i<entries.size(); i++)
+  {
+    const FieldCodecUsage &entry = entries[i];
+    snprintf(line, sizeof(line), "%5.1f%%  %10lu %9.2f %9.3f %9.0f  %10lu %9.2f %9.3f %9.0f  ", 
+             total > 0 ? 100.0 * entry.getTotalTime() / total : 0.0,
+             entry.decodes, 1000.0 * entry.decode_time, 
+             entry.decodes ? 1.0e6 * entry.decode_time / entry.decodes : 0.0,
+             entry.decodes ? (double) entry.decode_bytes / entry.decodes : 0.0,
+             entry.encodes, 1000.0 * entry.encode_time, 
+             entry.encodes ? 1.0e6 * entry.encode_time / entry.encodes : 0.0,
+             entry.encodes ? (double) entry.encode_bytes / entry.encodes : 0.0);
+    str << line << entry.table << "." << entry.column << " (" << entry.type << ")\n";
+  }
+}
+
+} //namespace
@@ -0,0 +1,285 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#include "database_interface/db_snapshot.h"
+
+#include <fstream>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace database_interface {
+
+static const char SNAPSHOT_MAGIC[8] = {'D','B','S','N','A','P','\0','\0'};
+static const size_t HEADER_SIZE = 40;
+static const size_t COLUMN_DESCRIPTOR_SIZE = 48;
+
+static void putUint32(std::string &buffer, boost::uint32_t value)
+{
+  for (int i=0; i<4; i++) buffer += (char) ((value >> (8*i)) & 0xff);
+}
+
+static void putUint64(std::string &buffer, boost::uint64_t value)
+{
+  for (int i=0; i<8; i++) buffer += (char) ((value >> (8*i)) & 0xff);
+}
+
+static boost::uint32_t getUint32(const char *data)
+{
+  boost::uint32_t value = 0;
+  for (int i=3; i>=0; i--) value = (value << 8) | (unsigned char) data[i];
+  return value;
+}
+
+static boost::uint64_t getUint64(const char *data)
+{
+  boost::uint64_t value = 0;
+  for (int i=7; i>=0; i--) value = (value << 8) | (unsigned char) data[i];
+  return value;
+}
+
+void SnapshotWriter::addColumn(const std::string &name, DBFieldBase::Type type)
+{
+  Column column;
+  column.name = name;
+  column.type = type;
+  column.offsets.push_back(0);
+  columns_.push_back(column);
+}
+
+void SnapshotWriter::addValue(size_t column, const char *data, size_t length)
+{
+  Column &col = columns_.at(column);
+  col.arena.append(data, length);
+  col.offsets.push_back(col.arena.size());
+}
+
+bool SnapshotWriter::write(const std::string &filename) const
+{
+  boost::uint64_t num_rows = columns_.empty() ? 0 : columns_[0].offsets.size() - 1;
+  for (size_t c=0; c<columns_.size(); c++)
+  {
+    if (columns_[c].offsets.size() - 1 != num_rows)
+    {
+      ROS_ERROR("Write snapshot: column %s has %d rows instead of %d", columns_[c].name.c_str(),
+                (int) columns_[c].offsets.size() - 1, (int) num_rows);
+      return false;
+    }
+  }
+
+  //lay out the variable-size parts after the header and the column descriptors
+  boost::uint64_t position = HEADER_SIZE + COLUMN_DESCRIPTOR_SIZE * columns_.size();
+  std::vector<boost::uint64_t> name_offsets, table_offsets, arena_offsets;
+  for (size_t c=0; c<columns_.size(); c++)
+  {
+    name_offsets.push_back(position);
+    position += columns_[c].name.size();
+  }
+  boost::uint64_t watermark_offset = position;
+  position += watermark_.size();
+  for (size_t c=0; c<columns_.size(); c++)
+  {
+    //keep the offset tables aligned, so they can be read in place
+    position = (position + 7) & ~((boost::uint64_t) 7);
+    table_offsets.push_back(position);
+    position += 8 * (num_rows + 1);
+    arena_offsets.push_back(position);
+    position += columns_[c].arena.size();
+  }
+
+  std::string header;
+  header.append(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  putUint32(header, VERSION);
+  putUint32(header, columns_.size());
+  putUint64(header, num_rows);
+  putUint64(header, watermark_offset);
+  putUint64(header, watermark_.size());
+  for (size_t c=0; c<columns_.size(); c++)
+  {
+    putUint64(header, name_offsets[c]);
+    putUint64(header, columns_[c].name.size());
+    putUint32(header, columns_[c].type);
+    putUint32(header, 0);
+    putUint64(header, table_offsets[c]);
+    putUint64(header, arena_offsets[c]);
+    putUint64(header, columns_[c].arena.size());
+  }
+  for (size_t c=0; c<columns_.size(); c++) header += columns_[c].name;
+  header += watermark_;
+
+  std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+  {
+    ROS_ERROR("Write snapshot: could not open file %s", filename.c_str());
+    return false;
+  }
+  file.write(header.data(), header.size());
+  position = header.size();
+  std::string table;
+  for (size_t c=0; c<columns_.size(); c++)
+  {
+    while (position < table_offsets[c])
+    {
+      file.put('\0');
+      position++;
+    }
+    table.clear();
+    for (size_t r=0; r<columns_[c].offsets.size(); r++) putUint64(table, columns_[c].offsets[r]);
+    file.write(table.data(), table.size());
+    file.write(columns_[c].arena.data(), columns_[c].arena.size());
+    position += table.size() + columns_[c].arena.size();
+  }
+  file.close();
+  if (file.fail())
+  {
+    ROS_ERROR("Write snapshot: failed to write file %s", filename.c_str());
+    return false;
+  }
+  return true;
+}
+
+/*! Everything the file points to is checked to be inside the file here, so that values 
+  can be read later without any more checks. */
+bool SnapshotFile::open(const std::string &filename)
+{
+  close();
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    ROS_ERROR("Open snapshot: could not open file %s", filename.c_str());
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) < 0 || file_stat.st_size < (off_t) HEADER_SIZE)
+  {
+    ROS_ERROR("Open snapshot: file %s is too short", filename.c_str());
+    ::close(fd);
+    return false;
+  }
+  void *mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    ROS_ERROR("Open snapshot: could not map file %s", filename.c_str());
+    return false;
+  }
+  data_ = (const char*) mapped;
+  size_ = file_stat.st_size;
+
+  if (memcmp(data_, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+  {
+    ROS_ERROR("Open snapshot: file %s is not a snapshot", filename.c_str());
+    close();
+    return false;
+  }
+  if (getUint32(data_ + 8) != SnapshotWriter::VERSION)
+  {
+    ROS_ERROR("Open snapshot: file %s has unsupported version %u", filename.c_str(), getUint32(data_ + 8));
+    close();
+    return false;
+  }
+  num_columns_ = getUint32(data_ + 12);
+  num_rows_ = getUint64(data_ + 16);
+
+  bool valid = HEADER_SIZE + COLUMN_DESCRIPTOR_SIZE * (boost::uint64_t) num_columns_ <= size_ &&
+    getUint64(data_ + 24) <= size_ && getUint64(data_ + 32) <= size_ - getUint64(data_ + 24);
+  for (size_t c=0; valid && c<num_columns_; c++)
+  {
+    const char *descriptor = getColumnDescriptor(c);
+    boost::uint64_t table = getUint64(descriptor + 24);
+    boost::uint64_t arena = getUint64(descriptor + 32);
+    boost::uint64_t arena_length = getUint64(descriptor + 40);
+    valid = getUint64(descriptor) <= size_ && getUint64(descriptor + 8) <= size_ - getUint64(descriptor) &&
+      num_rows_ < size_ / 8 && table <= size_ && 8 * (num_rows_ + 1) <= size_ - table &&
+      arena <= size_ && arena_length <= size_ - arena;
+    //offsets must be increasing and stay inside the arena
+    for (size_t r=0; valid && r<num_rows_; r++)
+    {
+      valid = getUint64(data_ + table + 8*r) <= getUint64(data_ + table + 8*(r+1)) &&
+        getUint64(data_ + table + 8*(r+1)) <= arena_length;
+    }
+  }
+  if (!valid)
+  {
+    ROS_ERROR("Open snapshot: file %s is corrupted", filename.c_str());
+    close();
+    return false;
+  }
+  return true;
+}
+
+void SnapshotFile::close()
+{
+  if (data_) munmap((void*) data_, size_);
+  data_ = NULL;
+  size_ = 0;
+  num_columns_ = 0;
+  num_rows_ = 0;
+}
+
+const char* SnapshotFile::getColumnDescriptor(size_t column) const
+{
+  return data_ + HEADER_SIZE + COLUMN_DESCRIPTOR_SIZE * column;
+}
+
+std::string SnapshotFile::getColumnName(size_t column) const
+{
+  const char *descriptor = getColumnDescriptor(column);
+  return std::string(data_ + getUint64(descriptor), getUint64(descriptor + 8));
+}
+
+DBFieldBase::Type SnapshotFile::getColumnType(size_t column) const
+{
+  return (DBFieldBase::Type) getUint32(getColumnDescriptor(column) + 16);
+}
+
+std::string SnapshotFile::getWatermark() const
+{
+  return std::string(data_ + getUint64(data_ + 24), getUint64(data_ + 32));
+}
+
+void SnapshotFile::getValue(size_t row, size_t column, const char* &data, size_t &length) const
+{
+  const char *descriptor = getColumnDescriptor(column);
+  const char *table = data_ + getUint64(descriptor + 24);
+  boost::uint64_t begin = getUint64(table + 8*row);
+  boost::uint64_t end = getUint64(table + 8*(row+1));
+  data = data_ + getUint64(descriptor + 32) + begin;
+  length = end - begin;
+}
+
+} //namespace
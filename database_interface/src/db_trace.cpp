@@ -0,0 +1,100 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#include "database_interface/db_trace.h"
+
+#include <unistd.h>
+
+namespace database_interface {
+
+//! Writes a string as a JSON string literal
+static void writeJsonString(FILE *file, const std::string &str)
+{
+  fputc('"', file);
+  for (size_t i=0; i<str.size(); i++)
+  {
+    unsigned char c = str[i];
+    if (c == '"' || c == '\\') fprintf(file, "\\%c", c);
+    else if (c == '\n') fputs("\\n", file);
+    else if (c < 0x20) fprintf(file, "\\u%04x", c);
+    else fputc(c, file);
+  }
+  fputc('"', file);
+}
+
+ChromeTraceWriter::ChromeTraceWriter(const std::string &filename) : first_event_(true)
+{
+  file_ = fopen(filename.c_str(), "w");
+  if (!file_)
+  {
+    ROS_ERROR("Chrome trace writer: could not open %s for writing", filename.c_str());
+    return;
+  }
+  fputs("{\"traceEvents\":[\n", file_);
+}
+
+ChromeTraceWriter::~ChromeTraceWriter()
+{
+  if (!file_) return;
+  fputs("\n]}\n", file_);
+  fclose(file_);
+}
+
+/*! Each span is a complete ("X") event, timed in microseconds. Spans of the same thread 
+  nest by time, which is how the viewer shows children under their parent. */
+void ChromeTraceWriter::record(const TraceSpan &span)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  if (!file_) return;
+  if (!first_event_) fputs(",\n", file_);
+  first_event_ = false;
+  fputs("{\"name\":", file_);
+  writeJsonString(file_, span.operation);
+  fprintf(file_, ",\"cat\":\"database\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%lu",
+          span.start.toNSec() / 1000.0, (span.end - span.start).toNSec() / 1000.0, 
+          (int) getpid(), span.thread_id);
+  fprintf(file_, ",\"args\":{\"id\":%lu,\"parent_id\":%lu,\"table\":", span.id, span.parent_id);
+  writeJsonString(file_, span.table);
+  fprintf(file_, ",\"rows\":%lld,\"bytes\":%lld,\"connection\":%d", 
+          span.rows, span.bytes, span.connection_id);
+  if (!span.error.empty())
+  {
+    fputs(",\"error\":", file_);
+    writeJsonString(file_, span.error);
+  }
+  fputs("}}", file_);
+}
+
+} //namespace
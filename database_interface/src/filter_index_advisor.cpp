@@ -0,0 +1,383 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+//! Compares the filters an application uses with the indexes in the database
+/*! Usage: filter_index_advisor <stats file> [connection string]
+
+  The statistics file is written by FilterUsageStats::save (see 
+  PostgresqlDatabase::setFilterStats). The connection string is in the usual libpq format,
+  e.g. "host=staging port=5432 dbname=students user=willow"; if it is left out, the 
+  PGHOST, PGDATABASE, ... environment variables are used.
+
+  For each filter shape, most time consuming first, the columns compared with "=" or in()
+  and the first column compared with a range are checked against the btree indexes of their
+  table (from pg_indexes). If no index starts with one of them, an index is suggested, 
+  unless pg_stat_user_tables shows that the table is too small for it to matter. If the
+  hypopg extension is installed, the suggested index is created as a hypothetical index,
+  and the planner's cost for the filter is shown with and without it.
+*/
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <libpq-fe.h>
+
+#include "database_interface/db_query_stats.h"
+
+using namespace database_interface;
+
+//! Tables with fewer rows than this are read sequentially anyway
+static const double MIN_TABLE_ROWS = 1000;
+
+struct IndexInfo
+{
+  std::string name;
+  std::string method;
+  std::vector<std::string> columns;
+};
+
+struct TableInfo
+{
+  std::vector<IndexInfo> indexes;
+  double live_rows;
+  double seq_scans;
+  double index_scans;
+  bool has_stats;
+  TableInfo() : live_rows(0), seq_scans(0), index_scans(0), has_stats(false) {}
+};
+
+//! Drops the schema from a table name, as pg_indexes and pg_stat_user_tables list them apart
+static std::string baseName(const std::string &table)
+{
+  size_t dot = table.rfind('.');
+  return dot == std::string::npos ? table : table.substr(dot + 1);
+}
+
+static std::string trim(const std::string &str)
+{
+  size_t start = str.find_first_not_of(" ");
+  if (start == std::string::npos) return std::string();
+  size_t end = str.find_last_not_of(" ");
+  std::string result = str.substr(start, end - start + 1);
+  if (result.size() > 1 && result[0] == '"' && result[result.size()-1] == '"') 
+  {
+    result = result.substr(1, result.size() - 2);
+  }
+  return result;
+}
+
+//! Reads the access method and columns from an index definition from pg_indexes
+/*! E.g. "CREATE INDEX grades_idx ON public.grades USING btree (student_id, grade DESC)".
+  Expressions are kept as they are, and will not match any column. */
+static bool parseIndexDef(const std::string &def, IndexInfo &index)
+{
+  size_t using_pos = def.find(" USING ");
+  if (using_pos == std::string::npos) return false;
+  size_t open = def.find('(', using_pos);
+  if (open == std::string::npos) return false;
+  index.method = trim(def.substr(using_pos + 7, open - using_pos - 7));
+  int depth = 0;
+  std::string column;
+  for (size_t i=open+1; i<def.size(); i++)
+  {
+    char c = def[i];
+    if (depth == 0 && (c == ',' || c == ')'))
+    {
+      //keep the column name only, without ordering or operator class
+      std::string name = trim(column);
+      if (name.find('(') == std::string::npos) name = name.substr(0, name.find(' '));
+      index.columns.push_back(name);
+      column.clear();
+      if (c == ')') return true;
+      continue;
+    }
+    if (c == '(') depth++;
+    if (c == ')') depth--;
+    column += c;
+  }
+  return false;
+}
+
+static std::string quoteLiteral(const std::string &str)
+{
+  std::string result("'");
+  for (size_t i=0; i<str.size(); i++)
+  {
+    if (str[i] == '\'') result += '\'';
+    result += str[i];
+  }
+  return result + "'";
+}
+
+static bool loadTables(PGconn *conn, std::map<std::string, TableInfo> &tables)
+{
+  PGresult *result = PQexec(conn, "SELECT tablename, indexname, indexdef FROM pg_indexes "
+                            "WHERE schemaname NOT IN ('pg_catalog', 'information_schema');");
+  if (PQresultStatus(result) != PGRES_TUPLES_OK)
+  {
+    std::cerr << "Reading pg_indexes failed: " << PQresultErrorMessage(result);
+    PQclear(result);
+    return false;
+  }
+  for (int i=0; i<PQntuples(result); i++)
+  {
+    IndexInfo index;
+    index.name = PQgetvalue(result, i, 1);
+    if (!parseIndexDef(PQgetvalue(result, i, 2), index)) continue;
+    tables[PQgetvalue(result, i, 0)].indexes.push_back(index);
+  }
+  PQclear(result);
+
+  result = PQexec(conn, "SELECT relname, n_live_tup, seq_scan, COALESCE(idx_scan, 0) "
+                  "FROM pg_stat_user_tables;");
+  if (PQresultStatus(result) != PGRES_TUPLES_OK)
+  {
+    std::cerr << "Reading pg_stat_user_tables failed: " << PQresultErrorMessage(result);
+    PQclear(result);
+    return false;
+  }
+  for (int i=0; i<PQntuples(result); i++)
+  {
+    TableInfo &table = tables[PQgetvalue(result, i, 0)];
+    table.live_rows = atof(PQgetvalue(result, i, 1));
+    table.seq_scans = atof(PQgetvalue(result, i, 2));
+    table.index_scans = atof(PQgetvalue(result, i, 3));
+    table.has_stats = true;
+  }
+  PQclear(result);
+  return true;
+}
+
+static bool hasHypopg(PGconn *conn)
+{
+  PGresult *result = PQexec(conn, "SELECT 1 FROM pg_extension WHERE extname = 'hypopg';");
+  bool found = PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) > 0;
+  PQclear(result);
+  return found;
+}
+
+//! Returns the planner's total cost for the query, and whether the plan mentions the index
+static bool explainCost(PGconn *conn, const std::string &query, const std::string &index, 
+                        double &cost, bool &uses_index)
+{
+  PGresult *result = PQexec(conn, ("EXPLAIN " + query).c_str());
+  if (PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) == 0)
+  {
+    std::cerr << "    EXPLAIN failed: " << PQresultErrorMessage(result);
+    PQclear(result);
+    return false;
+  }
+  //the first line looks like "Seq Scan on grades  (cost=0.00..35.50 rows=10 width=12)"
+  std::string top(PQgetvalue(result, 0, 0));
+  size_t dots = top.find("..");
+  cost = dots == std::string::npos ? 0.0 : atof(top.c_str() + dots + 2);
+  uses_index = false;
+  for (int i=0; i<PQntuples(result) && !index.empty(); i++)
+  {
+    if (std::string(PQgetvalue(result, i, 0)).find(index) != std::string::npos) uses_index = true;
+  }
+  PQclear(result);
+  return true;
+}
+
+//! Tries out the suggested index as a hypothetical index, with the sample values of the filter
+static void tryHypothetical(PGconn *conn, const std::string &table, const std::string &create,
+                            const std::vector<FilterColumnUsage> &columns)
+{
+  std::string query("SELECT * FROM " + table + " WHERE ");
+  for (size_t i=0; i<columns.size(); i++)
+  {
+    if (i) query += " AND ";
+    if (columns[i].op == "in") query += columns[i].column + " = ANY(" + quoteLiteral(columns[i].sample) + ")";
+    else query += columns[i].column + " " + columns[i].op + " " + quoteLiteral(columns[i].sample);
+  }
+  double before, after;
+  bool used;
+  if (!explainCost(conn, query, "", before, used)) return;
+
+  PGresult *result = PQexec(conn, ("SELECT indexname FROM hypopg_create_index(" + 
+                                   quoteLiteral(create) + ");").c_str());
+  if (PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) == 0)
+  {
+    std::cerr << "    creating hypothetical index failed: " << PQresultErrorMessage(result);
+    PQclear(result);
+    return;
+  }
+  std::string index(PQgetvalue(result, 0, 0));
+  PQclear(result);
+  if (explainCost(conn, query, index, after, used))
+  {
+    std::cout << "    hypothetical index: cost " << before << " -> " << after 
+              << (used ? "" : " (the planner does not use it)") << "\n";
+  }
+  PQclear(PQexec(conn, "SELECT hypopg_reset();"));
+}
+
+static bool isRange(const std::string &op)
+{
+  return op == "<" || op == "<=" || op == ">" || op == ">=";
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2 || argc > 3)
+  {
+    std::cerr << "Usage: filter_index_advisor <stats file> [connection string]\n";
+    return -1;
+  }
+  FilterUsageStats stats;
+  stats.setEnabled(true);
+  if (!stats.load(argv[1])) return -1;
+
+  PGconn *conn = PQconnectdb(argc > 2 ? argv[2] : "");
+  if (PQstatus(conn) != CONNECTION_OK)
+  {
+    std::cerr << "Database connection failed: " << PQerrorMessage(conn);
+    PQfinish(conn);
+    return -1;
+  }
+  std::map<std::string, TableInfo> tables;
+  if (!loadTables(conn, tables))
+  {
+    PQfinish(conn);
+    return -1;
+  }
+  bool hypopg = hasHypopg(conn);
+  if (!hypopg) std::cout << "hypopg is not installed; suggested indexes are not tried out\n";
+
+  std::vector<FilterUsage> entries;
+  stats.getEntries(entries);
+  int suggestions = 0;
+  for (size_t e=0; e<entries.size(); e++)
+  {
+    const FilterUsage &entry = entries[e];
+    std::cout << "\n" << entry.getSignature() << "\n  " << entry.count << " uses, " 
+              << 1000.0 * entry.total_time / entry.count << " ms on average, " 
+              << 1000.0 * entry.max_time << " ms at most, " 
+              << (double)entry.rows / entry.count << " rows on average\n";
+    if (!entry.structured)
+    {
+      std::cout << "  not analyzed: the filter is not just comparisons joined by AND\n";
+      continue;
+    }
+
+    //the comparisons an index could answer, by table
+    std::map< std::string, std::vector<FilterColumnUsage> > by_table;
+    for (size_t c=0; c<entry.columns.size(); c++)
+    {
+      const FilterColumnUsage &column = entry.columns[c];
+      if (column.op == "=" || column.op == "in" || isRange(column.op))
+      {
+        by_table[column.table].push_back(column);
+      }
+      else if (column.op == "contains")
+      {
+        std::cout << "  " << column.column << ": 'value' = ANY(column) can not use an index\n";
+      }
+    }
+
+    std::map< std::string, std::vector<FilterColumnUsage> >::const_iterator it;
+    for (it=by_table.begin(); it!=by_table.end(); it++)
+    {
+      //equality columns first, then a single range column
+      std::vector<std::string> index_columns;
+      std::vector<FilterColumnUsage> used;
+      std::string range;
+      for (size_t c=0; c<it->second.size(); c++)
+      {
+        const FilterColumnUsage &column = it->second[c];
+        if (isRange(column.op)) continue;
+        if (std::find(index_columns.begin(), index_columns.end(), column.column) == index_columns.end())
+        {
+          index_columns.push_back(column.column);
+        }
+        used.push_back(column);
+      }
+      for (size_t c=0; c<it->second.size(); c++)
+      {
+        const FilterColumnUsage &column = it->second[c];
+        if (!isRange(column.op)) continue;
+        if (range.empty() && std::find(index_columns.begin(), index_columns.end(), 
+                                       column.column) == index_columns.end())
+        {
+          range = column.column;
+          index_columns.push_back(range);
+        }
+        if (column.column == range) used.push_back(column);
+      }
+
+      const TableInfo &table = tables[baseName(it->first)];
+      std::string covering;
+      for (size_t i=0; i<table.indexes.size() && covering.empty(); i++)
+      {
+        const IndexInfo &index = table.indexes[i];
+        if (index.method != "btree" || index.columns.empty()) continue;
+        if (std::find(index_columns.begin(), index_columns.end(), index.columns[0]) != index_columns.end())
+        {
+          covering = index.name;
+        }
+      }
+      if (!covering.empty())
+      {
+        std::cout << "  " << it->first << ": served by index " << covering << "\n";
+        continue;
+      }
+      if (table.has_stats)
+      {
+        std::cout << "  " << it->first << ": " << table.live_rows << " rows, " << table.seq_scans 
+                  << " sequential scans, " << table.index_scans << " index scans\n";
+        if (table.live_rows < MIN_TABLE_ROWS)
+        {
+          std::cout << "  " << it->first << ": no index needed, the table is small\n";
+          continue;
+        }
+      }
+      std::string create("CREATE INDEX ON " + it->first + " (");
+      for (size_t c=0; c<index_columns.size(); c++) create += (c ? ", " : "") + index_columns[c];
+      create += ")";
+      std::cout << "  suggested: " << create << ";\n";
+      suggestions++;
+      if (hypopg) tryHypothetical(conn, it->first, create, used);
+    }
+  }
+  std::cout << "\n" << entries.size() << " filter shapes, " << suggestions << " suggested indexes\n";
+  PQfinish(conn);
+  return 0;
+}
@@ -0,0 +1,459 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#include "database_interface/logical_replication.h"
+
+#include <libpq-fe.h>
+
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <sys/select.h>
+
+namespace database_interface {
+
+//! Microseconds between the Unix epoch and the PostgreSQL epoch (2000-01-01)
+static const long long PG_EPOCH_OFFSET = 946684800LL * 1000000LL;
+
+//! How often we report our position to the server, in seconds, if it does not ask first
+static const double STATUS_INTERVAL = 10.0;
+
+static bool parseLsn(const std::string &str, unsigned long long &lsn)
+{
+  unsigned int high, low;
+  if (sscanf(str.c_str(), "%X/%X", &high, &low) != 2) return false;
+  lsn = ((unsigned long long) high << 32) | low;
+  return true;
+}
+
+static std::string formatLsn(unsigned long long lsn)
+{
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%X/%X", (unsigned int) (lsn >> 32), (unsigned int) lsn);
+  return buffer;
+}
+
+//! Reads the network byte order fields of a replication message
+class MessageReader
+{
+ private:
+  const char *data_;
+  size_t left_;
+  bool ok_;
+
+  unsigned long long readInt(size_t bytes)
+  {
+    if (left_ < bytes) { ok_ = false; left_ = 0; return 0; }
+    unsigned long long value = 0;
+    for (size_t i=0; i<bytes; i++) value = (value << 8) | (unsigned char) data_[i];
+    data_ += bytes;
+    left_ -= bytes;
+    return value;
+  }
+
+ public:
+  MessageReader(const char *data, size_t length) : data_(data), left_(length), ok_(true) {}
+
+  bool ok() const {return ok_;}
+  char readByte() {return (char) readInt(1);}
+  unsigned int readInt16() {return (unsigned int) readInt(2);}
+  unsigned int readInt32() {return (unsigned int) readInt(4);}
+  unsigned long long readInt64() {return readInt(8);}
+
+  std::string readString()
+  {
+    const char *end = (const char*) memchr(data_, '\0', left_);
+    if (!end) { ok_ = false; left_ = 0; return std::string(); }
+    std::string str(data_, end - data_);
+    left_ -= end - data_ + 1;
+    data_ = end + 1;
+    return str;
+  }
+
+  std::string readBytes(size_t length)
+  {
+    if (left_ < length) { ok_ = false; left_ = 0; return std::string(); }
+    std::string str(data_, length);
+    data_ += length;
+    left_ -= length;
+    return str;
+  }
+};
+
+static void writeInt(std::string &buffer, unsigned long long value, size_t bytes)
+{
+  for (size_t i=bytes; i>0; i--) buffer.push_back( (char) ((value >> (8*(i-1))) & 0xff) );
+}
+
+//! Reads the TupleData part of an INSERT, UPDATE or DELETE message
+static bool readTuple(MessageReader &reader, std::vector<ReplicationValue> &values)
+{
+  unsigned int num_columns = reader.readInt16();
+  values.resize(num_columns);
+  for (unsigned int c=0; c<num_columns && reader.ok(); c++)
+  {
+    char kind = reader.readByte();
+    values[c].text.clear();
+    if (kind == 'n') values[c].kind = ReplicationValue::NULL_VALUE;
+    else if (kind == 'u') values[c].kind = ReplicationValue::UNCHANGED;
+    else if (kind == 't')
+    {
+      values[c].kind = ReplicationValue::TEXT;
+      values[c].text = reader.readBytes(reader.readInt32());
+    }
+    else
+    {
+      ROS_ERROR("Replication: unknown column value kind %c", kind);
+      return false;
+    }
+  }
+  return reader.ok();
+}
+
+LogicalReplicationClient::LogicalReplicationClient(const PostgresqlDatabaseConfig &config) :
+  connection_(NULL), streaming_(false), confirmed_lsn_(0), received_lsn_(0), in_transaction_(false)
+{
+  std::string conn_info("replication=database");
+  //adding empty strings can cause weird things, as they are not expected to be empty
+  if (!config.getHost().empty()) conn_info += " host=" + config.getHost();
+  if (!config.getPort().empty()) conn_info += " port=" + config.getPort();
+  if (!config.getUser().empty()) conn_info += " user=" + config.getUser();
+  if (!config.getPassword().empty()) conn_info += " password=" + config.getPassword();
+  if (!config.getDBname().empty()) conn_info += " dbname=" + config.getDBname();
+  connection_ = PQconnectdb(conn_info.c_str());
+  if (PQstatus(connection_) != CONNECTION_OK)
+  {
+    ROS_ERROR("Replication connection failed with error message: %s", PQerrorMessage(connection_));
+  }
+}
+
+LogicalReplicationClient::~LogicalReplicationClient()
+{
+  if (streaming_ && isConnected()) 
+  {
+    //let the server know how far we got before we leave
+    sendStatus(false);
+  }
+  PQfinish(connection_);
+}
+
+bool LogicalReplicationClient::isConnected() const
+{
+  return connection_ && PQstatus(connection_) == CONNECTION_OK;
+}
+
+bool LogicalReplicationClient::createSlot(const std::string &slot_name)
+{
+  if (!isConnected()) return false;
+  std::string query("CREATE_REPLICATION_SLOT " + slot_name + " LOGICAL pgoutput NOEXPORT_SNAPSHOT");
+  PGresult *result = PQexec(connection_, query.c_str());
+  bool success = (PQresultStatus(result) == PGRES_TUPLES_OK);
+  if (!success)
+  {
+    const char *state = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+    //42710 is duplicate_object: the slot is already there, which is what we wanted
+    if (state && std::string(state) == "42710") success = true;
+    else ROS_ERROR("Replication slot creation failed. Error: %s", PQresultErrorMessage(result));
+  }
+  PQclear(result);
+  return success;
+}
+
+void LogicalReplicationClient::subscribe(const std::string &table, const ChangeCallback &callback)
+{
+  callbacks_.insert(std::pair<std::string, ChangeCallback>(table, callback));
+}
+
+bool LogicalReplicationClient::start(const std::string &slot_name, const std::string &publication,
+                                     const std::string &start_lsn)
+{
+  if (!isConnected()) return false;
+  unsigned long long lsn;
+  if (!parseLsn(start_lsn, lsn))
+  {
+    ROS_ERROR("Replication: invalid start position %s", start_lsn.c_str());
+    return false;
+  }
+  std::string query("START_REPLICATION SLOT " + slot_name + " LOGICAL " + formatLsn(lsn) + 
+                    " (proto_version '1', publication_names '" + publication + "')");
+  PGresult *result = PQexec(connection_, query.c_str());
+  if (PQresultStatus(result) != PGRES_COPY_BOTH)
+  {
+    ROS_ERROR("Replication start failed. Error: %s", PQresultErrorMessage(result));
+    PQclear(result);
+    return false;
+  }
+  PQclear(result);
+  streaming_ = true;
+  in_transaction_ = false;
+  confirmed_lsn_ = received_lsn_ = lsn;
+  last_status_time_ = ros::WallTime::now();
+  return true;
+}
+
+/*! The flush position is what the server uses to release the slot, so we only report the
+  end of the transactions that we have completely handed over to the callbacks. */
+bool LogicalReplicationClient::sendStatus(bool reply_requested)
+{
+  ros::WallTime now = ros::WallTime::now();
+  long long now_usec = (long long) now.sec * 1000000LL + now.nsec / 1000 - PG_EPOCH_OFFSET;
+  std::string message("r");
+  writeInt(message, received_lsn_, 8);
+  writeInt(message, confirmed_lsn_, 8);
+  writeInt(message, confirmed_lsn_, 8);
+  writeInt(message, (unsigned long long) now_usec, 8);
+  writeInt(message, reply_requested ? 1 : 0, 1);
+  if (PQputCopyData(connection_, message.data(), message.size()) != 1 || PQflush(connection_) != 0)
+  {
+    ROS_ERROR("Replication status update failed. Error: %s", PQerrorMessage(connection_));
+    return false;
+  }
+  last_status_time_ = now;
+  return true;
+}
+
+bool LogicalReplicationClient::handleCopyData(const char *data, size_t length)
+{
+  MessageReader reader(data, length);
+  char type = reader.readByte();
+  if (type == 'k')
+  {
+    //primary keepalive
+    unsigned long long wal_end = reader.readInt64();
+    reader.readInt64();
+    bool reply_requested = reader.readByte();
+    if (!reader.ok()) return false;
+    //if we have confirmed everything before this, there is nothing in between for us; not
+    //so inside a transaction, whose callbacks have not all run yet
+    if (!in_transaction_ && received_lsn_ == confirmed_lsn_ && wal_end > confirmed_lsn_) 
+    {
+      received_lsn_ = confirmed_lsn_ = wal_end;
+    }
+    if (reply_requested) return sendStatus(false);
+    return true;
+  }
+  if (type == 'w')
+  {
+    //WAL data, which carries one pgoutput message
+    unsigned long long start = reader.readInt64();
+    reader.readInt64();
+    reader.readInt64();
+    if (!reader.ok()) return false;
+    if (start > received_lsn_) received_lsn_ = start;
+    const size_t header_length = 1 + 3*8;
+    return handleMessage(data + header_length, length - header_length);
+  }
+  ROS_ERROR("Replication: unknown stream message %c", type);
+  return false;
+}
+
+bool LogicalReplicationClient::handleMessage(const char *data, size_t length)
+{
+  MessageReader reader(data, length);
+  char type = reader.readByte();
+  switch(type)
+  {
+  case 'B':
+    in_transaction_ = true;
+    return true;
+  case 'O':
+  case 'Y':
+  case 'M':
+    //origin, type and custom messages carry nothing we need
+    return true;
+  case 'C':
+  {
+    reader.readByte();
+    reader.readInt64();
+    unsigned long long end_lsn = reader.readInt64();
+    if (!reader.ok()) return false;
+    //all callbacks for this transaction have run
+    in_transaction_ = false;
+    confirmed_lsn_ = end_lsn;
+    if (end_lsn > received_lsn_) received_lsn_ = end_lsn;
+    return true;
+  }
+  case 'R':
+  {
+    ReplicationRelation relation;
+    relation.id = reader.readInt32();
+    relation.schema = reader.readString();
+    relation.name = reader.readString();
+    reader.readByte();
+    unsigned int num_columns = reader.readInt16();
+    for (unsigned int c=0; c<num_columns && reader.ok(); c++)
+    {
+      reader.readByte();
+      relation.columns.push_back(reader.readString());
+      reader.readInt32();
+      reader.readInt32();
+    }
+    if (!reader.ok()) return false;
+    relations_[relation.id] = relation;
+    return true;
+  }
+  case 'I':
+  case 'U':
+  case 'D':
+  {
+    std::map<unsigned int, ReplicationRelation>::const_iterator it = relations_.find(reader.readInt32());
+    if (it == relations_.end())
+    {
+      ROS_ERROR("Replication: change to an unknown relation");
+      return false;
+    }
+    ReplicationChange change;
+    change.type = (type == 'I' ? ReplicationChange::INSERT : 
+                   type == 'U' ? ReplicationChange::UPDATE : ReplicationChange::DELETE);
+    change.relation = &it->second;
+    char part = reader.readByte();
+    if (part == 'K' || part == 'O')
+    {
+      if (!readTuple(reader, change.old_values)) return false;
+      if (type != 'D') part = reader.readByte();
+    }
+    if (part == 'N' && !readTuple(reader, change.new_values)) return false;
+    if (!reader.ok()) return false;
+    return dispatch(change);
+  }
+  case 'T':
+  {
+    unsigned int num_relations = reader.readInt32();
+    reader.readByte();
+    for (unsigned int r=0; r<num_relations && reader.ok(); r++)
+    {
+      std::map<unsigned int, ReplicationRelation>::const_iterator it = relations_.find(reader.readInt32());
+      if (it == relations_.end()) continue;
+      ReplicationChange change;
+      change.type = ReplicationChange::TRUNCATE;
+      change.relation = &it->second;
+      if (!dispatch(change)) return false;
+    }
+    return reader.ok();
+  }
+  default:
+    ROS_ERROR("Replication: unknown pgoutput message %c", type);
+    return false;
+  }
+}
+
+bool LogicalReplicationClient::dispatch(const ReplicationChange &change)
+{
+  std::string names[2] = {change.relation->name, change.relation->schema + "." + change.relation->name};
+  for (int n=0; n<2; n++)
+  {
+    std::pair<std::multimap<std::string, ChangeCallback>::const_iterator,
+              std::multimap<std::string, ChangeCallback>::const_iterator> range = 
+      callbacks_.equal_range(names[n]);
+    for (std::multimap<std::string, ChangeCallback>::const_iterator it=range.first; it!=range.second; it++)
+    {
+      if (!it->second(change))
+      {
+        ROS_ERROR("Replication: failed to apply a change to table %s", change.relation->name.c_str());
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool LogicalReplicationClient::spinOnce(double timeout)
+{
+  if (!streaming_ || !isConnected()) return false;
+  ros::WallTime end = ros::WallTime::now() + ros::WallDuration(timeout);
+  while (true)
+  {
+    char *buffer = NULL;
+    int length = PQgetCopyData(connection_, &buffer, 1);
+    if (length > 0)
+    {
+      bool success = handleCopyData(buffer, length);
+      PQfreemem(buffer);
+      if (!success) 
+      {
+        //the rest of the stream cannot be applied on top of what we failed to handle
+        streaming_ = false;
+        return false;
+      }
+      continue;
+    }
+    if (length == -1)
+    {
+      //the server has ended the stream
+      PGresult *result = PQgetResult(connection_);
+      ROS_ERROR("Replication stream ended. Error: %s", PQresultErrorMessage(result));
+      PQclear(result);
+      streaming_ = false;
+      return false;
+    }
+    if (length == -2)
+    {
+      ROS_ERROR("Replication stream failed. Error: %s", PQerrorMessage(connection_));
+      streaming_ = false;
+      return false;
+    }
+
+    //nothing buffered; wait for the socket
+    ros::WallTime now = ros::WallTime::now();
+    if ( (now - last_status_time_).toSec() > STATUS_INTERVAL && !sendStatus(false) ) return false;
+    if (now >= end) break;
+    ros::WallDuration left = end - now;
+    struct timeval tv;
+    tv.tv_sec = left.sec;
+    tv.tv_usec = left.nsec / 1000;
+    fd_set fds;
+    int socket = PQsocket(connection_);
+    FD_ZERO(&fds);
+    FD_SET(socket, &fds);
+    if (select(socket + 1, &fds, NULL, NULL, &tv) < 0 && errno != EINTR)
+    {
+      ROS_ERROR("Replication: select failed: %s", strerror(errno));
+      return false;
+    }
+    if (!PQconsumeInput(connection_))
+    {
+      ROS_ERROR("Replication stream failed. Error: %s", PQerrorMessage(connection_));
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string LogicalReplicationClient::getConfirmedLsn() const
+{
+  return formatLsn(confirmed_lsn_);
+}
+
+} //namespace
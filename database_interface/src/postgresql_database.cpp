@@ -41,6 +41,25 @@
 
 #include <sstream>
 #include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <sys/select.h>
+#include <pthread.h>
+#include <boost/thread/tss.hpp>
+
+#include "db_probes.h"
+
+DB_PROBE_SEMAPHORE(query__start);
+DB_PROBE_SEMAPHORE(query__done);
+DB_PROBE_SEMAPHORE(connection__acquire);
+DB_PROBE_SEMAPHORE(result__receive);
+DB_PROBE_SEMAPHORE(connection__release);
+DB_PROBE_SEMAPHORE(row__decode__start);
+DB_PROBE_SEMAPHORE(row__decode__done);
+DB_PROBE_SEMAPHORE(notification__receive);
 
 namespace database_interface {
 
@@ -52,12 +71,49 @@ void operator>>(const YAML::Node& node, PostgresqlDatabaseConfig &options)
   options.host_ = node["host"].as<std::string>();
   options.port_ = node["port"].as<std::string>();
   options.dbname_ = node["dbname"].as<std::string>();
+  if (node["statement_timeout"])
+  {
+    options.statement_timeout_ = node["statement_timeout"].as<int>();
+  }
+  if (node["replicas"])
+  {
+    const YAML::Node &replicas = node["replicas"];
+    for (size_t i=0; i<replicas.size(); i++)
+    {
+      PostgresqlReplicaConfig replica;
+      replica.host = replicas[i]["host"].as<std::string>();
+      replica.port = replicas[i]["port"].as<std::string>();
+      options.replicas_.push_back(replica);
+    }
+  }
+  if (node["read_your_writes"])
+  {
+    options.read_your_writes_ = node["read_your_writes"].as<bool>();
+  }
 #else
   node["password"] >> options.password_;
   node["user"] >> options.user_;
   node["host"] >> options.host_;
   node["port"] >> options.port_;
   node["dbname"] >> options.dbname_;
+  if (const YAML::Node *timeout = node.FindValue("statement_timeout"))
+  {
+    *timeout >> options.statement_timeout_;
+  }
+  if (const YAML::Node *replicas = node.FindValue("replicas"))
+  {
+    for (size_t i=0; i<replicas->size(); i++)
+    {
+      PostgresqlReplicaConfig replica;
+      (*replicas)[i]["host"] >> replica.host;
+      (*replicas)[i]["port"] >> replica.port;
+      options.replicas_.push_back(replica);
+    }
+  }
+  if (const YAML::Node *read_your_writes = node.FindValue("read_your_writes"))
+  {
+    *read_your_writes >> options.read_your_writes_;
+  }
 #endif
 }
 
@@ -73,12 +129,77 @@ public:
   PGresultAutoPtr(PGresult *ptr) : result_(ptr){}
   ~PGresultAutoPtr(){PQclear(result_);}
   void reset(PGresult *ptr){PQclear(result_); result_=ptr;}
+  //! Gives up ownership of the result, which the caller must clear
+  PGresult* release(){PGresult *result = result_; result_ = NULL; return result;}
   PGresult* operator * (){return result_;}
 };
 
+void PostgresqlDatabase::TraceScope::begin(const char *operation, const DBClass *object)
+{
+  span_ = new TraceSpan;
+  span_->id = database_->next_span_id_++;
+  span_->operation = operation;
+  span_->parent_id = 0;
+  parent_ = database_->current_span_;
+  if (parent_) 
+  {
+    span_->parent_id = parent_->id;
+    span_->table = parent_->table;
+  }
+  if (object) span_->table = object->getPrimaryKeyField()->getTableName();
+  span_->rows = -1;
+  span_->bytes = -1;
+  span_->connection_id = 0;
+  span_->thread_id = (unsigned long) pthread_self();
+  database_->current_span_ = span_;
+  span_->start = ros::WallTime::now();
+}
 
-void PostgresqlDatabase::pgMDBconstruct(std::string host, std::string port, std::string user,
-						 std::string password, std::string dbname )
+void PostgresqlDatabase::TraceScope::finish()
+{
+  span_->end = ros::WallTime::now();
+  database_->current_span_ = parent_;
+  if (parent_ && !span_->error.empty() && parent_->error.empty()) parent_->error = span_->error;
+  //the sink might have been removed by an operation inside the span
+  if (database_->trace_sink_) database_->trace_sink_->record(*span_);
+  delete span_;
+}
+
+void PostgresqlDatabase::TraceScope::setConnection(PGconn *conn)
+{
+  if (span_) span_->connection_id = PQbackendPID(conn);
+}
+
+void PostgresqlDatabase::TraceScope::setResult(const PGresult *result)
+{
+  if (!span_) return;
+  ExecStatusType status = PQresultStatus(result);
+  if (status == PGRES_TUPLES_OK)
+  {
+    int rows = PQntuples(result), columns = PQnfields(result);
+    long long bytes = 0;
+    for (int r=0; r<rows; r++)
+    {
+      for (int c=0; c<columns; c++) bytes += PQgetlength(result, r, c);
+    }
+    span_->rows = rows;
+    span_->bytes = bytes;
+  }
+  else if (status == PGRES_COMMAND_OK)
+  {
+    const char *affected = PQcmdTuples(const_cast<PGresult*>(result));
+    if (affected[0]) span_->rows = atoll(affected);
+  }
+  else if (status == PGRES_FATAL_ERROR || status == PGRES_BAD_RESPONSE || status == PGRES_NONFATAL_ERROR)
+  {
+    span_->error = PQresultErrorMessage(result);
+    if (span_->error.empty()) span_->error = "query failed";
+  }
+}
+
+
+PGconn* PostgresqlDatabase::connect(std::string host, std::string port, std::string user,
+                                    std::string password, std::string dbname)
 {
   std::string conn_info;
   //adding empty strings can cause weird things, as they are not expected to be empty
@@ -87,42 +208,564 @@ void PostgresqlDatabase::pgMDBconstruct(std::string host, std::string port, std:
   if (!user.empty()) conn_info += " user=" + user;
   if (!password.empty()) conn_info += " password=" + password;
   if (!dbname.empty()) conn_info += " dbname=" + dbname;
-  connection_= PQconnectdb(conn_info.c_str());
+  return PQconnectdb(conn_info.c_str());
+}
+
+void PostgresqlDatabase::pgMDBconstruct(std::string host, std::string port, std::string user,
+						 std::string password, std::string dbname )
+{
+  connection_= connect(host, port, user, password, dbname);
   if (PQstatus(connection_)!=CONNECTION_OK) 
   {
     ROS_ERROR("Database connection failed with error message: %s", PQerrorMessage(connection_));
+    return;
   }
+  connection_states_[connection_].cancel_handle = PQgetCancel(connection_);
 }
 
 PostgresqlDatabase::PostgresqlDatabase(const PostgresqlDatabaseConfig &config)
-  : in_transaction_(false)
+  : next_replica_(0), primary_reads_(0), read_your_writes_(config.getReadYourWrites()), write_lsn_(0), 
+    in_transaction_(false), read_only_statements_(0), statement_timeout_(config.getStatementTimeout()), 
+    running_cancel_handle_(NULL), current_span_(NULL), next_span_id_(1),
+    key_block_size_(100), binary_results_(false)
 {
   pgMDBconstruct(config.getHost(), config.getPort(), config.getUser(), 
                  config.getPassword(), config.getDBname());
+  for (size_t i=0; i<config.getReplicas().size(); i++)
+  {
+    addReplica(config.getReplicas()[i].host, config.getReplicas()[i].port, config.getUser(),
+               config.getPassword(), config.getDBname());
+  }
 }
 
 PostgresqlDatabase::PostgresqlDatabase(std::string host, std::string port, std::string user,
 						 std::string password, std::string dbname )
-  : in_transaction_(false)
+  : next_replica_(0), primary_reads_(0), read_your_writes_(false), write_lsn_(0), 
+    in_transaction_(false), read_only_statements_(0), statement_timeout_(0), running_cancel_handle_(NULL),
+    current_span_(NULL), next_span_id_(1), key_block_size_(100), binary_results_(false)
 {
   pgMDBconstruct(host, port, user, password, dbname);
 }
 
 PostgresqlDatabase::~PostgresqlDatabase()
 {
+  {
+    boost::mutex::scoped_lock lock(cancel_mutex_);
+    std::map<PGconn*, ConnectionState>::iterator it;
+    for (it=connection_states_.begin(); it!=connection_states_.end(); it++)
+    {
+      if (it->second.cancel_handle) PQfreeCancel(it->second.cancel_handle);
+    }
+    connection_states_.clear();
+  }
+  for (size_t i=0; i<replica_connections_.size(); i++)
+  {
+    PQfinish(replica_connections_[i]);
+  }
   PQfinish(connection_);
 }
 
+/*! A replica that we fail to connect to is not used. */
+bool PostgresqlDatabase::addReplica(std::string host, std::string port, std::string user,
+                                    std::string password, std::string dbname)
+{
+  PGconn *replica = connect(host, port, user, password, dbname);
+  if (PQstatus(replica)!=CONNECTION_OK) 
+  {
+    ROS_ERROR("Database replica connection to %s failed with error message: %s", 
+              host.c_str(), PQerrorMessage(replica));
+    PQfinish(replica);
+    return false;
+  }
+  boost::mutex::scoped_lock lock(cancel_mutex_);
+  connection_states_[replica].cancel_handle = PQgetCancel(replica);
+  replica_connections_.push_back(replica);
+  return true;
+}
+
+static std::string numberToString(size_t number)
+{
+  std::ostringstream ss;
+  ss << number;
+  return ss.str();
+}
+
+//! Parses a WAL position in the "XXX/YYY" text format postgres uses into a number
+static bool parseLsn(const std::string &str, unsigned long long &lsn)
+{
+  unsigned int high, low;
+  if (sscanf(str.c_str(), "%X/%X", &high, &low) != 2) return false;
+  lsn = ((unsigned long long) high << 32) | low;
+  return true;
+}
+
+//! Identifies the shape of a statement in probes, as a (FNV-1a) hash of its fingerprint
+static unsigned long long probeFingerprint(const std::string &query)
+{
+  std::string fingerprint = fingerprintQuery(query);
+  unsigned long long hash = 14695981039346656037ULL;
+  for (size_t i=0; i<fingerprint.size(); i++)
+  {
+    hash ^= (unsigned char) fingerprint[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static std::string formatLsn(unsigned long long lsn)
+{
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%X/%X", (unsigned int) (lsn >> 32), (unsigned int) lsn);
+  return buffer;
+}
+
+/*! Replicas are used in turn. If read-your-writes is enabled, a replica is only used if it 
+  has replayed our last write; if no replica has, the read goes to the primary. Inside a 
+  transaction, and inside a PrimaryReadScope, everything goes to the primary.
+ */
+PGconn* PostgresqlDatabase::getReadConnection() const
+{
+  if (replica_connections_.empty() || in_transaction_ || primary_reads_) return connection_;
+  for (size_t i=0; i<replica_connections_.size(); i++)
+  {
+    PGconn *replica = replica_connections_[next_replica_];
+    next_replica_ = (next_replica_ + 1) % replica_connections_.size();
+    if (PQstatus(replica) != CONNECTION_OK) continue;
+    if (read_your_writes_ && write_lsn_ && !replicaCaughtUp(replica)) continue;
+    return replica;
+  }
+  return connection_;
+}
+
+/*! We remember how far each replica has been seen to get, so we only need to ask it again
+  if our writes have gone further than that.
+ */
+bool PostgresqlDatabase::replicaCaughtUp(PGconn *replica) const
+{
+  ConnectionState &state = connection_states_[replica];
+  if (state.replay_lsn >= write_lsn_) return true;
+
+  PGresultAutoPtr result( execQuery(replica, "SELECT pg_last_wal_replay_lsn();") );
+  if (PQresultStatus(*result) != PGRES_TUPLES_OK || !PQntuples(*result))
+  {
+    ROS_ERROR("Database replica replay position query failed. Error: %s", 
+              PQresultErrorMessage(*result));
+    return false;
+  }
+  if (PQgetisnull(*result, 0, 0) || !parseLsn(PQgetvalue(*result, 0, 0), state.replay_lsn))
+  {
+    return false;
+  }
+  return state.replay_lsn >= write_lsn_;
+}
+
+/*! Only needed if there are replicas and we want to read our own writes from them. Inside a 
+  transaction this is done on commit, since nothing is visible on the replicas before that. 
+*/
+void PostgresqlDatabase::recordWritePosition()
+{
+  if (!read_your_writes_ || replica_connections_.empty() || in_transaction_) return;
+  PGresultAutoPtr result( execQuery(connection_, "SELECT pg_current_wal_lsn();") );
+  if (PQresultStatus(*result) != PGRES_TUPLES_OK || !PQntuples(*result) ||
+      !parseLsn(PQgetvalue(*result, 0, 0), write_lsn_))
+  {
+    ROS_ERROR("Database write position query failed. Error: %s", PQresultErrorMessage(*result));
+    //we do not know where our writes are, so we can not trust the replicas
+    write_lsn_ = (unsigned long long) -1;
+  }
+}
+
+std::string PostgresqlDatabase::getConsistencyToken() const
+{
+  return formatLsn(write_lsn_);
+}
+
+bool PostgresqlDatabase::setConsistencyToken(const std::string &token)
+{
+  unsigned long long lsn;
+  if (!parseLsn(token, lsn))
+  {
+    ROS_ERROR("Database set consistency token: could not parse token %s", token.c_str());
+    return false;
+  }
+  if (lsn > write_lsn_) write_lsn_ = lsn;
+  read_your_writes_ = true;
+  return true;
+}
+
 bool PostgresqlDatabase::isConnected() const
 {
   if (PQstatus(connection_)==CONNECTION_OK) return true;
   else return false;
 }
 
+//! Number of statements sent by each thread, through all instances
+static boost::thread_specific_ptr<unsigned long> thread_round_trips;
+
+void PostgresqlDatabase::countRoundTrip(PGconn *conn, const std::string &query) const
+{
+  connection_states_[conn].round_trips++;
+  if (!thread_round_trips.get()) thread_round_trips.reset(new unsigned long(0));
+  (*thread_round_trips)++;
+  if (repeat_detector_.isEnabled() && !query.empty()) repeat_detector_.record(query);
+}
+
+void PostgresqlDatabase::getColumnTables(const DBClass *example, 
+                                         std::map<std::string, std::string> &column_tables)
+{
+  column_tables.clear();
+  const DBFieldBase *pk_field = example->getPrimaryKeyField();
+  column_tables[pk_field->getName()] = pk_field->getTableName();
+  for (size_t i=0; i<example->getNumFields(); i++)
+  {
+    column_tables[example->getField(i)->getName()] = example->getField(i)->getTableName();
+  }
+}
+
+/*! Only comparisons recorded as terms of the clause are described; anything else in the
+  clause (OR, comparisons between columns, hand written SQL) makes it unstructured. Columns
+  that are not fields of the class are attributed to its primary key table. */
+void PostgresqlDatabase::recordFilterUsage(const std::string &table, 
+                                           const std::map<std::string, std::string> &column_tables,
+                                           const FilterClause &clause, const ros::WallTime &start, 
+                                           int rows) const
+{
+  if (!filter_stats_.isEnabled() || clause.clause_.empty()) return;
+  FilterUsage usage;
+  usage.table = table;
+  usage.structured = clause.structured_;
+  for (size_t t=0; t<clause.terms_.size(); t++)
+  {
+    const FilterTerm &term = clause.terms_[t];
+    FilterColumnUsage column;
+    std::map<std::string, std::string>::const_iterator it = column_tables.find(term.column_);
+    column.table = (it != column_tables.end() ? it->second : table);
+    column.column = term.column_;
+    column.op = (term.op_ == "==" ? "=" : term.op_);
+    column.sample = term.op_ == "in" ? toArrayLiteral(term.values_) : term.value_;
+    usage.columns.push_back(column);
+  }
+  filter_stats_.record(usage, (ros::WallTime::now() - start).toSec(), rows);
+}
+
+unsigned long PostgresqlDatabase::getRoundTrips() const
+{
+  std::vector<unsigned long> counts;
+  getRoundTrips(counts);
+  unsigned long total = 0;
+  for (size_t i=0; i<counts.size(); i++) total += counts[i];
+  return total;
+}
+
+void PostgresqlDatabase::getRoundTrips(std::vector<unsigned long> &counts) const
+{
+  counts.clear();
+  counts.push_back(connection_states_[connection_].round_trips);
+  for (size_t i=0; i<replica_connections_.size(); i++)
+  {
+    counts.push_back(connection_states_[replica_connections_[i]].round_trips);
+  }
+}
+
+void PostgresqlDatabase::resetRoundTrips()
+{
+  std::map<PGconn*, ConnectionState>::iterator it;
+  for (it=connection_states_.begin(); it!=connection_states_.end(); it++) it->second.round_trips = 0;
+}
+
+unsigned long PostgresqlDatabase::getThreadRoundTrips()
+{
+  if (!thread_round_trips.get()) return 0;
+  return *thread_round_trips;
+}
+
+/*! The timeout is set with a SET command, which is only sent when the value on the
+  connection is not the one we want. It is not sent in a failed transaction, where it would
+  be refused; in that case the next statement is a ROLLBACK anyway.
+
+  The SET goes through execQuery like any other statement, so it obeys the deadline and is
+  captured and traced. The connection is marked as up to date before sending it, so that
+  execQuery does not come back here.
+ */
+bool PostgresqlDatabase::applyStatementTimeout(PGconn *conn) const
+{
+  int &session_timeout = connection_states_[conn].statement_timeout;
+  if (session_timeout == statement_timeout_) return true;
+  PGTransactionStatusType status = PQtransactionStatus(conn);
+  if (status != PQTRANS_IDLE && status != PQTRANS_INTRANS) return true;
+
+  std::ostringstream query;
+  query << "SET statement_timeout = " << statement_timeout_ << ";";
+  int previous_timeout = session_timeout;
+  session_timeout = statement_timeout_;
+  PGresultAutoPtr result( execQuery(conn, query.str()) );
+  if (PQresultStatus(*result) != PGRES_COMMAND_OK)
+  {
+    ROS_ERROR("Database set statement timeout failed. Error: %s", PQresultErrorMessage(*result));
+    session_timeout = previous_timeout;
+    return false;
+  }
+  return true;
+}
+
+/*! All statements go through here. The statement is sent asynchronously, and we wait on the
+  connection socket for the result. If a deadline is set and it passes while we are waiting,
+  the statement is cancelled; we then keep waiting for the (error) result the server sends 
+  back, so that the connection is free for the next statement.
+
+  Statements with parameters are prepared the first time they are seen on a connection
+  (see getPreparedStatement), so the server only plans them once.
+
+  Returns NULL only if we could not produce a result at all; callers can pass the result
+  straight to PQresultStatus, which treats NULL as a fatal error.
+ */
+PGresult* PostgresqlDatabase::execQuery(PGconn *conn, const std::string &query, int num_params,
+                                        const char* const *param_values, const int *param_lengths,
+                                        const int *param_formats, int result_format) const
+{
+  TraceScope trace(this, "network_wait");
+  trace.setConnection(conn);
+  unsigned long long fingerprint = 0;
+  if (DB_PROBE_ENABLED(query__start) || DB_PROBE_ENABLED(query__done)) fingerprint = probeFingerprint(query);
+  DB_PROBE3(query__start, fingerprint, query.c_str(), num_params);
+  ros::WallTime start = ros::WallTime::now();
+  if (!deadline_.isZero() && start >= deadline_)
+  {
+    ROS_ERROR("Database query: deadline expired before query was sent");
+    trace.setError("deadline expired");
+    return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+  }
+  if (!applyStatementTimeout(conn)) 
+  {
+    return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+  }
+
+  std::string statement_name;
+  if (num_params > 0)
+  {
+    PGresult *error = NULL;
+    statement_name = getPreparedStatement(conn, query, num_params, error);
+    if (error)
+    {
+      trace.setResult(error);
+      return error;
+    }
+  }
+
+  DB_PROBE2(connection__acquire, PQbackendPID(conn), conn != connection_);
+  int sent;
+  if (statement_name.empty())
+  {
+    sent = PQsendQueryParams(conn, query.c_str(), num_params, NULL, param_values, 
+                             param_lengths, param_formats, result_format);
+  }
+  else
+  {
+    sent = PQsendQueryPrepared(conn, statement_name.c_str(), num_params, param_values, 
+                               param_lengths, param_formats, result_format);
+  }
+  if (!sent)
+  {
+    ROS_ERROR("Database query: failed to send query. Error: %s", PQerrorMessage(conn));
+    trace.setError(PQerrorMessage(conn));
+    return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+  }
+  countRoundTrip(conn, query);
+  PGresult *result = waitForResult(conn);
+  trace.setResult(result);
+  if (capture_)
+  {
+    ExecStatusType status = PQresultStatus(result);
+    capture_->record(query, num_params, param_values, param_lengths, param_formats, result_format,
+                     PQbackendPID(conn), start, ros::WallTime::now(), 
+                     status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK, read_only_statements_ > 0);
+  }
+  DB_PROBE3(query__done, fingerprint, (int) PQresultStatus(result), PQntuples(result));
+  return result;
+}
+
+PGresult* PostgresqlDatabase::execQuery(PGconn *conn, const std::string &query, 
+                                        const FilterClause &clause, int result_format) const
+{
+  std::vector<const char*> param_values;
+  for (size_t i=0; i<clause.params_.size(); i++) param_values.push_back(clause.params_[i].c_str());
+  return execQuery(conn, query, param_values.size(), param_values.empty() ? NULL : &(param_values[0]),
+                   NULL, NULL, result_format);
+}
+
+/*! Waits for the statement just sent on the connection to complete, and collects its
+  result. If there are several results, the last one is returned, unless an earlier one 
+  is an error.
+ */
+PGresult* PostgresqlDatabase::waitForResult(PGconn *conn) const
+{
+  {
+    boost::mutex::scoped_lock lock(cancel_mutex_);
+    running_cancel_handle_ = connection_states_[conn].cancel_handle;
+  }
+
+  bool cancelled = false;
+  while (true)
+  {
+    if (!PQconsumeInput(conn)) break;
+    if (!PQisBusy(conn)) break;
+    if (!waitForInput(conn, cancelled)) break;
+  }
+
+  //collect all results; the last one is the one we return, unless an earlier one failed
+  PGresult *result = NULL;
+  while (PGresult *next = PQgetResult(conn))
+  {
+    ExecStatusType status = PQresultStatus(next);
+    bool failed = (status == PGRES_FATAL_ERROR || status == PGRES_BAD_RESPONSE);
+    if (result && PQresultStatus(result) == PGRES_FATAL_ERROR && !failed)
+    {
+      PQclear(next);
+      continue;
+    }
+    PQclear(result);
+    result = next;
+  }
+  DB_PROBE2(result__receive, PQbackendPID(conn), (int) PQresultStatus(result));
+  {
+    boost::mutex::scoped_lock lock(cancel_mutex_);
+    running_cancel_handle_ = NULL;
+  }
+  DB_PROBE1(connection__release, PQbackendPID(conn));
+  if (!result)
+  {
+    ROS_ERROR("Database query: no result received. Error: %s", PQerrorMessage(conn));
+    return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+  }
+  return result;
+}
+
+/*! Preparing costs one extra round trip, the first time a statement is seen. The number of 
+  statements prepared per connection is limited, so that statements built with varying
+  literals do not fill up the server; once the limit is reached, new statements are simply
+  not prepared, and an empty name is returned. If preparing fails, error is set to the
+  result describing the failure.
+ */
+std::string PostgresqlDatabase::getPreparedStatement(PGconn *conn, const std::string &query, 
+                                                     int num_params, PGresult* &error) const
+{
+  error = NULL;
+  std::map<std::string, std::string> &prepared = connection_states_[conn].prepared_statements;
+  std::map<std::string, std::string>::const_iterator it = prepared.find(query);
+  if (it != prepared.end()) return it->second;
+  if (prepared.size() >= MAX_PREPARED_STATEMENTS) return std::string();
+
+  std::string name("database_interface_" + numberToString(prepared.size()));
+  if (!PQsendPrepare(conn, name.c_str(), query.c_str(), num_params, NULL))
+  {
+    ROS_ERROR("Database query: failed to send statement preparation. Error: %s", PQerrorMessage(conn));
+    error = PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+    return std::string();
+  }
+  countRoundTrip(conn, std::string());
+  PGresult *result = waitForResult(conn);
+  if (PQresultStatus(result) != PGRES_COMMAND_OK)
+  {
+    error = result;
+    return std::string();
+  }
+  PQclear(result);
+  prepared[query] = name;
+  return name;
+}
+
+/*! Returns when there is something to read on the connection. If the deadline passes first,
+  the running statement is cancelled and we keep waiting, without a timeout, for what the
+  server sends back. Returns false if waiting fails.
+ */
+bool PostgresqlDatabase::waitForInput(PGconn *conn, bool &cancelled) const
+{
+  while (true)
+  {
+    int sock = PQsocket(conn);
+    fd_set input_mask;
+    FD_ZERO(&input_mask);
+    FD_SET(sock, &input_mask);
+    struct timeval timeout;
+    struct timeval *timeout_ptr = NULL;
+    if (!deadline_.isZero() && !cancelled)
+    {
+      double remaining = (deadline_ - ros::WallTime::now()).toSec();
+      if (remaining < 0) remaining = 0;
+      timeout.tv_sec = (long) remaining;
+      timeout.tv_usec = (long) ((remaining - timeout.tv_sec) * 1.0e6);
+      timeout_ptr = &timeout;
+    }
+    int ready = select(sock + 1, &input_mask, NULL, NULL, timeout_ptr);
+    if (ready < 0)
+    {
+      if (errno == EINTR) continue;
+      ROS_ERROR("Database query: select() on the database connection failed: %s", strerror(errno));
+      return false;
+    }
+    if (ready > 0) return true;
+    ROS_WARN("Database query: deadline expired, cancelling query");
+    cancel();
+    cancelled = true;
+  }
+}
+
+/*! The server session is replaced, so what we knew about it (prepared statements, the
+  statement timeout, the cancel handle) is forgotten. A transaction in progress is lost.
+ */
+bool PostgresqlDatabase::resetConnection(PGconn *conn) const
+{
+  ConnectionState &state = connection_states_[conn];
+  {
+    boost::mutex::scoped_lock lock(cancel_mutex_);
+    if (running_cancel_handle_ == state.cancel_handle) running_cancel_handle_ = NULL;
+    if (state.cancel_handle) PQfreeCancel(state.cancel_handle);
+    state.cancel_handle = NULL;
+  }
+  state.prepared_statements.clear();
+  state.statement_timeout = -1;
+  if (conn == connection_ && in_transaction_) 
+  {
+    ROS_ERROR("Database connection reset: the transaction in progress is lost");
+  }
+  PQreset(conn);
+  if (PQstatus(conn) != CONNECTION_OK)
+  {
+    ROS_ERROR("Database connection reset failed. Error: %s", PQerrorMessage(conn));
+    return false;
+  }
+  boost::mutex::scoped_lock lock(cancel_mutex_);
+  state.cancel_handle = PQgetCancel(conn);
+  return true;
+}
+
+/*! Sends a cancel request for the statement in progress. Returns true if a request was
+  sent, which does not guarantee that the statement is actually cancelled: it might 
+  already be finishing. 
+*/
+bool PostgresqlDatabase::cancel() const
+{
+  boost::mutex::scoped_lock lock(cancel_mutex_);
+  if (!running_cancel_handle_) return false;
+  char error_buffer[256];
+  if (!PQcancel(running_cancel_handle_, error_buffer, sizeof(error_buffer)))
+  {
+    ROS_ERROR("Database cancel failed with error message: %s", error_buffer);
+    return false;
+  }
+  return true;
+}
+
 /*! Returns true if the rollback query itself succeeds, false if it does not */
 bool PostgresqlDatabase::rollback()
 {
-  PGresultAutoPtr result((PQexec(connection_,"ROLLBACK;")));
+  //rollback must go through even if it is the deadline that made us roll back
+  ros::WallTime deadline = deadline_;
+  deadline_ = ros::WallTime();
+  PGresultAutoPtr result(execQuery(connection_, "ROLLBACK;"));
+  deadline_ = deadline;
+  //a SET statement_timeout inside the transaction has been undone as well
+  connection_states_[connection_].statement_timeout = -1;
   if (PQresultStatus(*result) != PGRES_COMMAND_OK)
   {
     ROS_ERROR("Rollback failed");
@@ -137,7 +780,7 @@ bool PostgresqlDatabase::begin()
 {
   if( in_transaction_ ) return true;
   //place a begin
-  PGresultAutoPtr result(PQexec(connection_, "BEGIN;"));
+  PGresultAutoPtr result(execQuery(connection_, "BEGIN;"));
   if (PQresultStatus(*result) != PGRES_COMMAND_OK)
   {
     ROS_ERROR("Database begin query failed. Error: %s", PQresultErrorMessage(*result));
@@ -150,20 +793,22 @@ bool PostgresqlDatabase::begin()
 /*! Returns true if the commit query itself succeeds, false if it does not */
 bool PostgresqlDatabase::commit()
 {
-  PGresultAutoPtr result(PQexec(connection_, "COMMIT;"));
+  PGresultAutoPtr result(execQuery(connection_, "COMMIT;"));
   if (PQresultStatus(*result) != PGRES_COMMAND_OK)
   {
     ROS_ERROR("Database commit query failed. Error: %s", PQresultErrorMessage(*result));
     return false;
   }
   in_transaction_ = false;
+  recordWritePosition();
   return true;
 }
 
 bool PostgresqlDatabase::getVariable(std::string name, std::string &value) const
 {
   std::string query("SELECT variable_value FROM variable WHERE variable_name=" + name);
-  PGresultAutoPtr result(PQexec(connection_, query.c_str()));  
+  ReadOnlyScope reading(this);
+  PGresultAutoPtr result(execQuery(getReadConnection(), query));  
   if (PQresultStatus(*result) != PGRES_TUPLES_OK)
   {
     ROS_ERROR("Database get variable query failed. Error: %s", PQresultErrorMessage(*result));
@@ -178,114 +823,172 @@ bool PostgresqlDatabase::getVariable(std::string name, std::string &value) const
   return true;
 }
 
-/*! The value is returned as a string; caller has to convert it. Returns false if the
-  query fails or the sequence is not found.
-*/
-bool PostgresqlDatabase::getSequence(std::string name, std::string &value)
+/*! In a binary COPY or result, fields that can decode the binary format of some SQL type get 
+  their column cast to that type; all others are sent as text, except bytea, which is already
+  what binary fields expect. The binary format of text is the text itself.
+ */
+static std::string selectColumn(const DBFieldBase *field, bool binary)
 {
-  std::string query("SELECT * FROM currval('" + name + "');");
-  PGresultAutoPtr result( PQexec(connection_, query.c_str()) );
-  if (PQresultStatus(*result) != PGRES_TUPLES_OK)
-  {
-    ROS_ERROR("Get sequence: query failed. Error: %s", PQresultErrorMessage(*result));
-    return false;
-  }
-  if (!PQntuples(*result))
-  {
-    ROS_ERROR("Get sequence: sequence %s not found", name.c_str());
-    return false;
-  }
-  const char *id_char = PQgetvalue(*result, 0, 0);
-  value.assign(id_char);
-  return true;
+  if (!binary) return field->getName();
+  std::string wire_type = field->getWireType();
+  if (!wire_type.empty()) return field->getName() + "::" + wire_type;
+  if (field->getType() == DBFieldBase::BINARY) return field->getName();
+  return field->getName() + "::text";
 }
 
-/*! Creates and runs the SQL query for retrieveing the list. Has been separated from the
-  rest of the getList function so that we can have only the part that instantiates the entries
-  separated from the parts that speak SQL, so that we don't have to have SQL in the header
-  of the PostgresqlDatabase class.
+/*! Decides which fields are to be retrieved, and creates the SQL query for retrieving them
+  (minus the WHERE clause). Has been separated from the rest of the getList function so that we
+  can have only the part that instantiates the entries separated from the parts that speak SQL, 
+  so that we don't have to have SQL in the header of the PostgresqlDatabase class.
+
+  If columns is NULL, the fields marked with getReadFromDatabase() in the example are retrieved.
+  Otherwise, exactly the fields named in columns are retrieved, regardless of their flags. In 
+  both cases the primary key is always retrieved, as the first column of the result.
 
-  See the general getList(...) documentation for more details. This function will run the 
-  query, return its raw result, and populate the fields and columns_ids vectors with the fields
-  that were retrieved and the columns in the result that they correspond to.
+  See the general getList(...) documentation for more details.
  */
-bool PostgresqlDatabase::getListRawResult(const DBClass *example, 
-						   std::vector<const DBFieldBase*> &fields, 
-						   std::vector<int> &column_ids,
-						   std::string where_clause,
-						   boost::shared_ptr<PGresultAutoPtr> &result, int &num_tuples) const
+bool PostgresqlDatabase::buildListPlan(const DBClass *example, const std::vector<std::string> *columns,
+                                       ListQueryPlan &plan, bool binary_copy, bool binary_results) const
 {
-  //we cannot handle binary results in here; libpq does not support binary results
-  //for just part of the query, so they all have to be text
-  if(example->getPrimaryKeyField()->getType() == DBFieldBase::BINARY)
+  TraceScope trace(this, "sql_build", example);
+  //libpq does not support binary results for just part of the query, so in binary mode
+  //every column is cast to a type whose binary format we can decode (see selectColumn)
+  plan.binary = binary_copy || binary_results;
+  const DBFieldBase *pk_field = example->getPrimaryKeyField();
+  if(pk_field->getType() == DBFieldBase::BINARY)
   {
-    ROS_ERROR("Database get list: can not use binary primary key (%s)", 
-	      example->getPrimaryKeyField()->getName().c_str());
+    ROS_ERROR("Database get list: can not use binary primary key (%s)", pk_field->getName().c_str());
     return false;
   }
 
-  std::string select_query;
-  select_query += "SELECT " + example->getPrimaryKeyField()->getName() + " ";  
-  fields.push_back(example->getPrimaryKeyField());
+  //decide which of the fields (by index) we want, in the order they will be in the query
+  std::vector<int> field_ids;
+  if (!columns)
+  {
+    for (size_t i=0; i<example->getNumFields(); i++)
+    {
+      if (!example->getField(i)->getReadFromDatabase()) continue;
+      if (example->getField(i)->getType()==DBFieldBase::BINARY && !binary_copy)
+      {
+        ROS_WARN("Database get list: binary field (%s) can not be loaded by default", 
+                 example->getField(i)->getName().c_str());
+        continue;
+      }
+      field_ids.push_back(i);
+    }
+  }
+  else
+  {
+    for (size_t c=0; c<columns->size(); c++)
+    {
+      if (columns->at(c) == pk_field->getName()) continue;
+      size_t i;
+      for (i=0; i<example->getNumFields(); i++)
+      {
+        if (example->getField(i)->getName() == columns->at(c)) break;
+      }
+      if (i == example->getNumFields())
+      {
+        ROS_ERROR("Database get list: projected column %s is not a field of the class",
+                  columns->at(c).c_str());
+        return false;
+      }
+      if (example->getField(i)->getType()==DBFieldBase::BINARY && !binary_copy)
+      {
+        ROS_ERROR("Database get list: binary field (%s) can not be projected", 
+                  example->getField(i)->getName().c_str());
+        return false;
+      }
+      field_ids.push_back(i);
+    }
+  }
+
+  plan.select_query = "SELECT " + selectColumn(pk_field, plan.binary) + " ";
+  plan.field_ids.clear();
+  plan.field_ids.push_back(-1);
 
   //we will store here the list of tables we will join on
   std::vector<std::string> join_tables;
   std::string join_clauses;
-  for (size_t i=0; i<example->getNumFields(); i++)
+  for (size_t f=0; f<field_ids.size(); f++)
   {
-    if (!example->getField(i)->getReadFromDatabase()) continue;
-
-    if (example->getField(i)->getType()==DBFieldBase::BINARY)
-    {
-      ROS_WARN("Database get list: binary field (%s) can not be loaded by default", 
-	       example->getField(i)->getName().c_str());
-      continue;
-    }
-
-    select_query += ", " + example->getField(i)->getName();
-    fields.push_back(example->getField(i));
-    if ( example->getField(i)->getTableName() != example->getPrimaryKeyField()->getTableName() )
+    const DBFieldBase *field = example->getField(field_ids[f]);
+    plan.select_query += ", " + selectColumn(field, plan.binary);
+    plan.field_ids.push_back(field_ids[f]);
+    if ( field->getTableName() != pk_field->getTableName() )
     {
       //check if we are already joining on this table
       bool already_join = false;
       for (size_t j=0; j<join_tables.size() && !already_join; j++)
       {
-	if (join_tables[j] == example->getField(i)->getTableName()) already_join = true;
+	if (join_tables[j] == field->getTableName()) already_join = true;
       }
       
       if (!already_join)
       {
 	const DBFieldBase *foreign_key = NULL;
-	if (!example->getForeignKey(example->getField(i)->getTableName(), foreign_key))
+	if (!example->getForeignKey(field->getTableName(), foreign_key))
 	{
 	  ROS_ERROR("Database get list: could not find foreign key for table %s", 
-		    example->getField(i)->getTableName().c_str());
+		    field->getTableName().c_str());
 	  return false;
 	}
-	join_clauses += " JOIN " + example->getField(i)->getTableName() + " USING (" 
+	join_clauses += " JOIN " + field->getTableName() + " USING (" 
 	  + foreign_key->getName() + ") ";
-	join_tables.push_back( example->getField(i)->getTableName() );
+	join_tables.push_back( field->getTableName() );
       }
     }
   }
 
-  select_query += " FROM " + example->getPrimaryKeyField()->getTableName() + " ";
+  plan.select_query += " FROM " + pk_field->getTableName() + " ";
+  plan.table = pk_field->getTableName();
+  getColumnTables(example, plan.column_tables);
 
   if (!join_clauses.empty())
   {
-    select_query += join_clauses;
+    plan.select_query += join_clauses;
   }
+  return true;
+}
+
+/*! The plan only depends on the class and the projected columns, so it is built the first
+  time a given combination is used and looked up afterwards. Returns NULL if the plan can
+  not be built.
+ */
+const PostgresqlDatabase::ListQueryPlan* 
+PostgresqlDatabase::getProjectionPlan(const std::string &class_name, const DBClass *example,
+                                      const Projection &projection) const
+{
+  std::string key = class_name + ":" + projection.getKey() + (binary_results_ ? "/binary" : "");
+  std::map<std::string, ListQueryPlan>::const_iterator it = list_plans_.find(key);
+  if (it != list_plans_.end()) return &(it->second);
 
-  if (!where_clause.empty())
+  ListQueryPlan plan;
+  if (!buildListPlan(example, &projection.getNames(), plan, false, binary_results_)) return NULL;
+  return &(list_plans_[key] = plan);
+}
+
+/*! Runs the query described by the plan and returns its raw result. The columns of the 
+  result are in the same order as the fields in the plan.
+ */
+bool PostgresqlDatabase::getListRawResult(const ListQueryPlan &plan,
+							   const FilterClause &clause,
+							   boost::shared_ptr<PGresultAutoPtr> &result, int &num_tuples) const
+{
+  std::string select_query(plan.select_query);
+  if (!clause.clause_.empty())
   {
-    select_query += " WHERE " + where_clause;
+    select_query += " WHERE " + clause.clause_;
   }
 
   select_query += ";";
 
   //ROS_INFO("Query: %s", select_query.c_str());
 
-  PGresult* raw_result = PQexec(connection_, select_query.c_str());
+  ros::WallTime start = ros::WallTime::now();
+  ReadOnlyScope reading(this, !plan.primary);
+  PGconn *conn = plan.primary ? connection_ : getReadConnection();
+  PGresult* raw_result = execQuery(conn, select_query, clause, plan.binary ? 1 : 0);
   result.reset( new PGresultAutoPtr(raw_result) );
   if (PQresultStatus(raw_result) != PGRES_TUPLES_OK)
   {
@@ -294,85 +997,530 @@ bool PostgresqlDatabase::getListRawResult(const DBClass *example,
   }
   
   num_tuples = PQntuples(raw_result);
-  if (!num_tuples) 
+  recordFilterUsage(plan.table, plan.column_tables, clause, start, num_tuples);
+  if (PQnfields(raw_result) != (int)plan.field_ids.size())
   {
-    return true;
+    ROS_ERROR("Database get list: expected %d columns in result, got %d", 
+              (int)plan.field_ids.size(), PQnfields(raw_result));
+    return false;
   }
-  
-  //store the column id's for each field we retrieved
-  for (size_t t=0; t<fields.size(); t++)
+  return true;
+}
+
+/*! Parses a single, already instantiated entry (an instance of DBClass) from a raw database
+  result, using the plan that the result was retrieved with. Helper function for getList(...)
+*/
+bool PostgresqlDatabase::populateListEntry(DBClass *entry, boost::shared_ptr<PGresultAutoPtr> result, 
+						    int row_num, const ListQueryPlan &plan) const
+{
+  DB_PROBE1(row__decode__start, row_num);
+  for (size_t t=0; t<plan.field_ids.size(); t++)
   {
-    int id =  PQfnumber(raw_result, fields[t]->getName().c_str());
-    if (id < 0)
+    const char* char_value =  PQgetvalue(**result, row_num, t);
+    size_t length = PQgetlength(**result, row_num, t);
+    DBFieldBase *entry_field;
+    if (plan.field_ids[t] < 0) entry_field = entry->getPrimaryKeyField();
+    else if ((size_t)plan.field_ids[t] < entry->getNumFields()) entry_field = entry->getField(plan.field_ids[t]);
+    else
     {
-      ROS_ERROR("Database get list: column %s missing in result", fields[t]->getName().c_str());
+      ROS_ERROR("Database get list: new entry missing field %d", plan.field_ids[t]);
+      DB_PROBE2(row__decode__done, row_num, 0);
       return false;
     }
-    column_ids.push_back(id);
-  }   
+    ros::WallTime decode_start;
+    if (field_stats_.isEnabled()) decode_start = ros::WallTime::now();
+    bool parsed;
+    if (!plan.binary) parsed = entry_field->fromText(char_value, length);
+    else if (PQgetisnull(**result, row_num, t))
+    {
+      //a recycled entry must not keep the value of the row it held before
+      entry_field->setToDefault();
+      continue;
+    }
+    else if (!entry_field->getWireType().empty()) parsed = entry_field->fromWireBinary(char_value, length);
+    else if (entry_field->getType() == DBFieldBase::BINARY) parsed = entry_field->fromBinary(char_value, length);
+    else parsed = entry_field->fromText(char_value, length);
+    if (field_stats_.isEnabled()) 
+    {
+      field_stats_.recordDecode(entry_field, (ros::WallTime::now() - decode_start).toSec(), length);
+    }
+    if ( !parsed )
+    {
+      ROS_ERROR("Database get list: failed to parse response \"%s\" for field \"%s\"",   
+                plan.binary ? "(binary)" : char_value, entry_field->getName().c_str()); 
+      DB_PROBE2(row__decode__done, row_num, 0);
+      return false;
+    }
+  }
+  DB_PROBE2(row__decode__done, row_num, 1);
   return true;
 }
 
-/*! Parses a single, already instantiated entry (an instance of DBClass) from a raw database
-  result, given the list of fields that were retrieved and their respective column ids in
-  the result. Helper function for getList(...)
-*/
-bool PostgresqlDatabase::populateListEntry(DBClass *entry, boost::shared_ptr<PGresultAutoPtr> result, 
-						    int row_num,
-						    const std::vector<const DBFieldBase*> &fields,
-						    const std::vector<int> &column_ids) const
+/*! Like buildListPlan(...) with no projection, except that the columns are read from the
+  rows returned by the function instead of from the tables of the class. The plan runs on
+  the primary.
+ */
+bool PostgresqlDatabase::buildFunctionPlan(const DBClass *example, const FunctionCall &call, 
+                                           ListQueryPlan &plan) const
+{
+  const DBFieldBase *pk_field = example->getPrimaryKeyField();
+  if(pk_field->getType() == DBFieldBase::BINARY)
+  {
+    ROS_ERROR("Database call function: can not use binary primary key (%s)", pk_field->getName().c_str());
+    return false;
+  }
+  plan.binary = binary_results_;
+  plan.primary = true;
+  plan.select_query = "SELECT " + selectColumn(pk_field, plan.binary) + " ";
+  plan.field_ids.clear();
+  plan.field_ids.push_back(-1);
+  for (size_t i=0; i<example->getNumFields(); i++)
+  {
+    const DBFieldBase *field = example->getField(i);
+    if (!field->getReadFromDatabase()) continue;
+    if (field->getType()==DBFieldBase::BINARY)
+    {
+      ROS_WARN("Database call function: binary field (%s) can not be loaded by default", 
+               field->getName().c_str());
+      continue;
+    }
+    plan.select_query += ", " + selectColumn(field, plan.binary);
+    plan.field_ids.push_back(i);
+  }
+  plan.select_query += " FROM " + call.getSql() + " ";
+  return true;
+}
+
+bool PostgresqlDatabase::callFunction(const FunctionCall &call)
+{
+  return callScalarFunction(call, NULL, NULL);
+}
+
+bool PostgresqlDatabase::callScalarFunction(const FunctionCall &call, DBFieldBase *result, bool *is_null)
+{
+  TraceScope trace(this, "callFunction");
+  std::string query("SELECT " + call.getSql() + ";");
+  PGresultAutoPtr pg_result( execQuery(connection_, query, call.getParameters()) );
+  if (PQresultStatus(*pg_result) != PGRES_TUPLES_OK)
+  {
+    ROS_ERROR("Database call function: %s failed. Error: %s", call.getName().c_str(), 
+              PQresultErrorMessage(*pg_result));
+    return false;
+  }
+  recordWritePosition();
+  if (!result) return true;
+  if (PQntuples(*pg_result) != 1 || PQnfields(*pg_result) != 1)
+  {
+    ROS_ERROR("Database call function: %s returned %d rows of %d columns, expected a single value", 
+              call.getName().c_str(), PQntuples(*pg_result), PQnfields(*pg_result));
+    return false;
+  }
+  *is_null = PQgetisnull(*pg_result, 0, 0);
+  if (*is_null) return true;
+  if (!result->fromText(PQgetvalue(*pg_result, 0, 0), PQgetlength(*pg_result, 0, 0)))
+  {
+    ROS_ERROR("Database call function: failed to parse result \"%s\" of %s", 
+              PQgetvalue(*pg_result, 0, 0), call.getName().c_str());
+    return false;
+  }
+  return true;
+}
+
+bool PostgresqlDatabase::copyOut(const DBClass *example, CopySink &sink, const FilterClause &clause) const
+{
+  TraceScope trace(this, "copyOut", example);
+  ListQueryPlan plan;
+  if (!buildListPlan(example, NULL, plan, true)) return false;
+  return copyOut(example, plan, clause, sink);
+}
+
+/*! The COPY is read asynchronously, so that the deadline can cancel it like any other
+  statement. Each chunk is passed to the sink as soon as it arrives. If the sink fails, the
+  COPY is cancelled, and the rest of the stream is read and dropped.
+
+  COPY does not take parameters, so those of the clause are written into it as literals.
+ */
+bool PostgresqlDatabase::copyOut(const DBClass *example, const ListQueryPlan &plan, 
+                                 const FilterClause &clause, CopySink &sink) const
+{
+  std::vector<std::string> columns;
+  for (size_t t=0; t<plan.field_ids.size(); t++)
+  {
+    if (plan.field_ids[t] < 0) columns.push_back(example->getPrimaryKeyField()->getName());
+    else columns.push_back(example->getField(plan.field_ids[t])->getName());
+  }
+  if (!sink.begin(columns)) return false;
+
+  std::string query("COPY (" + plan.select_query);
+  if (!clause.clause_.empty())
+  {
+    query += " WHERE " + clause.inlineParameters();
+  }
+  query += ") TO STDOUT (FORMAT binary);";
+
+  ReadOnlyScope reading(this, !plan.primary);
+  PGconn *conn = getReadConnection();
+  TraceScope trace(this, "network_wait");
+  trace.setConnection(conn);
+  ros::WallTime start = ros::WallTime::now();
+  if (!deadline_.isZero() && start >= deadline_)
+  {
+    ROS_ERROR("Database copy out: deadline expired before query was sent");
+    trace.setError("deadline expired");
+    return false;
+  }
+  if (!applyStatementTimeout(conn)) return false;
+  DB_PROBE2(connection__acquire, PQbackendPID(conn), conn != connection_);
+  if (!PQsendQuery(conn, query.c_str()))
+  {
+    ROS_ERROR("Database copy out: failed to send query. Error: %s", PQerrorMessage(conn));
+    return false;
+  }
+  countRoundTrip(conn, query);
+  {
+    boost::mutex::scoped_lock lock(cancel_mutex_);
+    running_cancel_handle_ = connection_states_[conn].cancel_handle;
+  }
+
+  bool cancelled = false;
+  bool success = true;
+  long long bytes = 0;
+  //wait for the server to start the COPY, or to fail
+  while (PQconsumeInput(conn) && PQisBusy(conn) && waitForInput(conn, cancelled)) {}
+  PGresult *result = PQgetResult(conn);
+  if (PQresultStatus(result) == PGRES_COPY_OUT)
+  {
+    PQclear(result);
+    while (true)
+    {
+      char *buffer = NULL;
+      int length = PQgetCopyData(conn, &buffer, 1);
+      if (length > 0)
+      {
+        bytes += length;
+        if (success && !sink.data(buffer, length))
+        {
+          ROS_ERROR("Database copy out: sink failed, cancelling copy");
+          success = false;
+          cancel();
+        }
+        PQfreemem(buffer);
+      }
+      else if (length == 0)
+      {
+        if (!waitForInput(conn, cancelled) || !PQconsumeInput(conn)) break;
+      }
+      else break;
+    }
+    result = PQgetResult(conn);
+    if (PQresultStatus(result) == PGRES_COPY_OUT)
+    {
+      //the copy was left unfinished, and libpq has no way out of it but a new session
+      ROS_ERROR("Database copy out: connection failed during the copy. Error: %s", PQerrorMessage(conn));
+      PQclear(result);
+      trace.setError(PQerrorMessage(conn));
+      if (capture_)
+      {
+        capture_->record(query, 0, NULL, NULL, NULL, 0, PQbackendPID(conn), start, ros::WallTime::now(), 
+                         false, read_only_statements_ > 0);
+      }
+      DB_PROBE1(connection__release, PQbackendPID(conn));
+      cancel();
+      resetConnection(conn);
+      return false;
+    }
+  }
+  trace.setBytes(bytes);
+  if (PQresultStatus(result) != PGRES_COMMAND_OK)
+  {
+    if (success) ROS_ERROR("Database copy out failed. Error: %s", PQresultErrorMessage(result));
+    trace.setResult(result);
+    success = false;
+  }
+  if (capture_)
+  {
+    capture_->record(query, 0, NULL, NULL, NULL, 0, PQbackendPID(conn), start, ros::WallTime::now(), 
+                     PQresultStatus(result) == PGRES_COMMAND_OK, read_only_statements_ > 0);
+  }
+  PQclear(result);
+  //the connection must be left with no pending results
+  while ( (result = PQgetResult(conn)) ) PQclear(result);
+  {
+    boost::mutex::scoped_lock lock(cancel_mutex_);
+    running_cancel_handle_ = NULL;
+  }
+  DB_PROBE1(connection__release, PQbackendPID(conn));
+  return success && sink.end();
+}
+
+bool PostgresqlDatabase::populateCopyEntry(DBClass *entry, const std::vector<const char*> &values,
+                                           const std::vector<size_t> &lengths, 
+                                           const ListQueryPlan &plan) const
+{
+  if (values.size() != plan.field_ids.size())
+  {
+    ROS_ERROR("Database copy list: expected %d columns, got %d", 
+              (int) plan.field_ids.size(), (int) values.size());
+    return false;
+  }
+  for (size_t t=0; t<plan.field_ids.size(); t++)
+  {
+    DBFieldBase *entry_field;
+    if (plan.field_ids[t] < 0) entry_field = entry->getPrimaryKeyField();
+    else if ((size_t)plan.field_ids[t] < entry->getNumFields()) entry_field = entry->getField(plan.field_ids[t]);
+    else
+    {
+      ROS_ERROR("Database copy list: new entry missing field %d", plan.field_ids[t]);
+      return false;
+    }
+    if (!values[t]) continue;
+    ros::WallTime decode_start;
+    if (field_stats_.isEnabled()) decode_start = ros::WallTime::now();
+    bool parsed;
+    if (!entry_field->getWireType().empty()) parsed = entry_field->fromWireBinary(values[t], lengths[t]);
+    else if (entry_field->getType() == DBFieldBase::BINARY) parsed = entry_field->fromBinary(values[t], lengths[t]);
+    else parsed = entry_field->fromText(values[t], lengths[t]);
+    if (field_stats_.isEnabled()) 
+    {
+      field_stats_.recordDecode(entry_field, (ros::WallTime::now() - decode_start).toSec(), lengths[t]);
+    }
+    if (!parsed)
+    {
+      ROS_ERROR("Database copy list: failed to parse value for field \"%s\"", 
+                entry_field->getName().c_str()); 
+      return false;
+    }
+  }
+  return true;
+}
+
+/*! The example is used *only* to indicate instances of what class we are counting. To perform
+  additional pruning, the where_clause is used. In the future, we might use the example to do
+  actual decisions on counting based on the contents of the fields.
+
+  The counting is performed only on the primary key of the given class.
+ */
+bool PostgresqlDatabase::countList(const DBClass *example, int &count, const FilterClause &clause) const
 {
-  for (size_t t=0; t<fields.size(); t++)
+  TraceScope trace(this, "countList", example);
+  const DBFieldBase* pk_field = example->getPrimaryKeyField();
+  
+  std::string query( "SELECT COUNT(" + pk_field->getName() + ") FROM " + pk_field->getTableName() );
+  if (!clause.clause_.empty())
+  {
+    query += " WHERE " + clause.clause_;
+  }
+  query += ";";
+
+  ROS_INFO("Query (count): %s", query.c_str());
+  ros::WallTime start = ros::WallTime::now();
+  ReadOnlyScope reading(this);
+  PGresultAutoPtr result( execQuery(getReadConnection(), query, clause) );
+			 
+  if (PQresultStatus(*result) != PGRES_TUPLES_OK)
+  {
+    ROS_ERROR("Database count list query failed. Error: %s", PQresultErrorMessage(*result));
+    return false;
+  }
+  const char *reply =  PQgetvalue(*result, 0, 0);
+  if (!DBStreamable<int>::streamableFromString(count, reply)) 
+  {
+    ROS_ERROR("Database count list failed. Could not understand reply: %s", reply);
+    return false;
+  }
+  if (filter_stats_.isEnabled())
+  {
+    std::map<std::string, std::string> column_tables;
+    getColumnTables(example, column_tables);
+    recordFilterUsage(pk_field->getTableName(), column_tables, clause, start, count);
+  }
+  return true;  
+}
+
+//! Escapes a string so it can be placed between single quotes in a query
+static std::string quoteLiteral(const std::string &str)
+{
+  std::string quoted("'");
+  for (size_t i=0; i<str.size(); i++)
+  {
+    if (str[i] == '\'') quoted += '\'';
+    quoted += str[i];
+  }
+  return quoted + "'";
+}
+
+/*! For XMIN tracking, the watermark is the oldest transaction that was still running when 
+  it was taken (the xmin of the current snapshot), reduced to the 32 bits that row xmin 
+  values have. Everything written by older transactions is visible to reads that follow.
+
+  For CHANGE_COLUMN tracking, it is the largest value of the change column. 
+ */
+bool PostgresqlDatabase::getChangeWatermark(const DBClass *example, const DeltaSyncConfig &config,
+                                            std::string &watermark) const
+{
+  std::string query;
+  if (config.change_tracking == DeltaSyncConfig::XMIN)
+  {
+    query = "SELECT txid_snapshot_xmin(txid_current_snapshot()) % 4294967296;";
+  }
+  else
+  {
+    query = "SELECT max(" + config.change_column + ") FROM " + 
+      example->getPrimaryKeyField()->getTableName() + ";";
+  }
+  ReadOnlyScope reading(this);
+  PGresultAutoPtr result( execQuery(getReadConnection(), query) );
+  if (PQresultStatus(*result) != PGRES_TUPLES_OK || !PQntuples(*result))
+  {
+    ROS_ERROR("Database get change watermark: query failed. Error: %s", PQresultErrorMessage(*result));
+    return false;
+  }
+  //an empty table has no maximum; everything that comes later is a change
+  watermark = PQgetisnull(*result, 0, 0) ? "" : PQgetvalue(*result, 0, 0);
+  return true;
+}
+
+/*! With XMIN tracking a row has changed if it was written by a transaction that is not older
+  than the since watermark. This is tested with age(), which is computed relative to the
+  current transaction and therefore keeps working when transaction ids wrap around (as long
+  as refreshes are less than two billion transactions apart). Frozen rows have the largest
+  possible age, so they never count as changed. Rows in all the tables the class is stored
+  in are checked. The until watermark is not needed, since rows newer than it are simply
+  seen again next time.
+
+  With CHANGE_COLUMN tracking, only the column in the primary key table is checked, and rows
+  newer than until are left for the next time, since until will be the next since. An empty
+  since means everything has changed.
+ */
+bool PostgresqlDatabase::getChangedClause(const DBClass *example, const DeltaSyncConfig &config, 
+                                          const std::string &since, const std::string &until,
+                                          std::string &where_clause) const
+{
+  std::string pk_table = example->getPrimaryKeyField()->getTableName();
+  if (config.change_tracking == DeltaSyncConfig::XMIN)
+  {
+    if (since.empty())
+    {
+      where_clause = "TRUE";
+      return true;
+    }
+    std::vector<std::string> tables(1, pk_table);
+    for (size_t i=0; i<example->getNumFields(); i++)
+    {
+      const DBFieldBase *field = example->getField(i);
+      if (!field->getReadFromDatabase() || field->getType() == DBFieldBase::BINARY) continue;
+      if (std::find(tables.begin(), tables.end(), field->getTableName()) == tables.end())
+      {
+        tables.push_back(field->getTableName());
+      }
+    }
+    where_clause = "(";
+    for (size_t t=0; t<tables.size(); t++)
+    {
+      if (t) where_clause += " OR ";
+      where_clause += "age(" + tables[t] + ".xmin) <= age(" + quoteLiteral(since) + "::xid)";
+    }
+    where_clause += ")";
+    return true;
+  }
+
+  if (config.change_column.empty())
+  {
+    ROS_ERROR("Database get changed clause: no change column given");
+    return false;
+  }
+  std::string column = pk_table + "." + config.change_column;
+  if (since.empty() && until.empty()) where_clause = "TRUE";
+  else if (since.empty()) where_clause = column + " <= " + quoteLiteral(until);
+  else if (until.empty()) where_clause = column + " > " + quoteLiteral(since);
+  else where_clause = "(" + column + " > " + quoteLiteral(since) + " AND " + 
+         column + " <= " + quoteLiteral(until) + ")";
+  return true;
+}
+
+bool PostgresqlDatabase::getDeletedKeys(const DBClass *example, const DeltaSyncConfig &config,
+                                        const std::string &since, std::vector<std::string> &keys) const
+{
+  keys.clear();
+  if (config.delete_tracking != DeltaSyncConfig::TOMBSTONE_TABLE || since.empty()) return true;
+
+  std::string query("SELECT " + example->getPrimaryKeyField()->getName() + " FROM " + config.tombstone_table);
+  if (config.change_tracking == DeltaSyncConfig::XMIN)
+  {
+    query += " WHERE age(xmin) <= age(" + quoteLiteral(since) + "::xid);";
+  }
+  else
+  {
+    query += " WHERE " + config.change_column + " > " + quoteLiteral(since) + ";";
+  }
+  ReadOnlyScope reading(this);
+  PGresultAutoPtr result( execQuery(getReadConnection(), query) );
+  if (PQresultStatus(*result) != PGRES_TUPLES_OK)
+  {
+    ROS_ERROR("Database get deleted keys: query failed. Error: %s", PQresultErrorMessage(*result));
+    return false;
+  }
+  for (int i=0; i<PQntuples(*result); i++)
   {
-    const char* char_value =  PQgetvalue(**result, row_num, column_ids[t]);
-    DBFieldBase *entry_field = entry->getField(fields[t]->getName());
-    if (!entry_field)
-    {
-      ROS_ERROR("Database get list: new entry missing field %s", fields[t]->getName().c_str());
-      return false;
-    }
-    if ( !entry_field->fromString(char_value) )
-    {
-      ROS_ERROR("Database get list: failed to parse response \"%s\" for field \"%s\"",   
-                char_value, fields[t]->getName().c_str()); 
-      return false;
-    }
+    keys.push_back(PQgetvalue(*result, i, 0));
   }
   return true;
 }
 
-/*! The example is used *only* to indicate instances of what class we are counting. To perform
-  additional pruning, the where_clause is used. In the future, we might use the example to do
-  actual decisions on counting based on the contents of the fields.
-
-  The counting is performed only on the primary key of the given class.
- */
-bool PostgresqlDatabase::countList(const DBClass *example, int &count, std::string where_clause) const
+/*! Only the primary key table is read, which makes this much cheaper than a getList when
+  only the set of existing instances is needed. */
+bool PostgresqlDatabase::getKeyList(const DBClass *example, std::vector<std::string> &keys, 
+                                    const FilterClause &clause) const
 {
+  TraceScope trace(this, "getKeyList", example);
   const DBFieldBase* pk_field = example->getPrimaryKeyField();
-  
-  std::string query( "SELECT COUNT(" + pk_field->getName() + ") FROM " + pk_field->getTableName() );
-  if (!where_clause.empty())
+  std::string query("SELECT " + pk_field->getName() + " FROM " + pk_field->getTableName());
+  if (!clause.clause_.empty())
   {
-    query += " WHERE " + where_clause;
+    query += " WHERE " + clause.clause_;
   }
   query += ";";
-
-  ROS_INFO("Query (count): %s", query.c_str());
-  PGresultAutoPtr result( PQexec(connection_, query.c_str()) );
-			 
+  ros::WallTime start = ros::WallTime::now();
+  ReadOnlyScope reading(this);
+  PGresultAutoPtr result( execQuery(getReadConnection(), query, clause) );
   if (PQresultStatus(*result) != PGRES_TUPLES_OK)
   {
-    ROS_ERROR("Database count list query failed. Error: %s", PQresultErrorMessage(*result));
+    ROS_ERROR("Database get key list: query failed. Error: %s", PQresultErrorMessage(*result));
     return false;
   }
-  const char *reply =  PQgetvalue(*result, 0, 0);
-  if (!DBStreamable<int>::streamableFromString(count, reply)) 
+  if (filter_stats_.isEnabled())
   {
-    ROS_ERROR("Database count list failed. Could not understand reply: %s", reply);
+    std::map<std::string, std::string> column_tables;
+    getColumnTables(example, column_tables);
+    recordFilterUsage(pk_field->getTableName(), column_tables, clause, start, PQntuples(*result));
+  }
+  keys.clear();
+  keys.reserve(PQntuples(*result));
+  for (int i=0; i<PQntuples(*result); i++)
+  {
+    keys.push_back(PQgetvalue(*result, i, 0));
+  }
+  return true;
+}
+
+/*! The result of a versioned save has a row with the new version if the save went through,
+  and no rows if the version in the database was not the one expected (or the instance is no
+  longer there). */
+bool PostgresqlDatabase::updateVersion(DBFieldBase *version_field, const PGresult *result, 
+                                       bool *conflict) const
+{
+  if (PQntuples(result) == 0)
+  {
+    if (conflict) *conflict = true;
+    else ROS_ERROR("Database save: instance was changed or deleted since it was read");
     return false;
   }
-  return true;  
+  if (!version_field->fromString(PQgetvalue(result, 0, 0)))
+  {
+    ROS_ERROR("Database save: failed to parse new version %s", PQgetvalue(result, 0, 0));
+    return false;
+  }
+  return true;
 }
 
 /*! The instance of DBClass that this implicitly refers to is the *owner* of the field that
@@ -380,14 +1528,43 @@ bool PostgresqlDatabase::countList(const DBClass *example, int &count, std::stri
   tables are joined based on the primary key. 
 
   TODO: fix this so that we don't always have to join on the primary key.
+
+  With a version field, the version is checked and incremented in the primary key table, 
+  and the field is only written if that succeeds:
+
+    UPDATE test_object SET field_a=$2, version = version + 1 WHERE id=$1 AND version=$3 
+    RETURNING version;
+
+  or, for a field in another table:
+
+    WITH p AS (UPDATE test_object SET version = version + 1 WHERE id=$4 AND version=$3 
+               RETURNING version),
+         u AS (UPDATE test_object_foreign SET field_b=$2 WHERE id=$1 AND EXISTS (SELECT 1 FROM p))
+    SELECT version FROM p;
  */
-bool PostgresqlDatabase::saveToDatabase(const DBFieldBase* field)
+bool PostgresqlDatabase::saveToDatabase(const DBFieldBase* field, bool *conflict)
 {
+  TraceScope trace(this, "saveToDatabase", field->getOwner());
+  if (conflict) *conflict = false;
   if (!field->getWritePermission())
   {
     ROS_ERROR("Database save field: field %s does not have write permission", field->getName().c_str());
     return false;
   }
+  const DBFieldBase* pk_field = field->getOwner()->getPrimaryKeyField();
+  DBFieldBase* version_field = field->getOwner()->getVersionField();
+  if (version_field == field)
+  {
+    ROS_ERROR("Database save field: version field %s is only changed by saving other fields", 
+              field->getName().c_str());
+    return false;
+  }
+  if (version_field && version_field->getTableName() != pk_field->getTableName())
+  {
+    ROS_ERROR("Database save field: version field %s must be in the primary key table",
+              version_field->getName().c_str());
+    return false;
+  }
 
   const DBFieldBase* key_field;
   if (field->getTableName() == field->getOwner()->getPrimaryKeyField()->getTableName()) 
@@ -408,13 +1585,36 @@ bool PostgresqlDatabase::saveToDatabase(const DBFieldBase* field)
  
   //prepare query with parameters so we can use binary data if needed
 
-  std::string query("UPDATE " + field->getTableName() + 
-		    " SET " + field->getName() + "=$2"
-		    " WHERE " + key_field->getName() + "=$1;");
+  std::string query;
+  if (!version_field)
+  {
+    query = "UPDATE " + field->getTableName() + 
+      " SET " + field->getName() + "=$2"
+      " WHERE " + key_field->getName() + "=$1;";
+  }
+  else if (field->getTableName() == pk_field->getTableName())
+  {
+    const std::string &version = version_field->getName();
+    query = "UPDATE " + field->getTableName() + 
+      " SET " + field->getName() + "=$2, " + version + " = " + version + " + 1"
+      " WHERE " + key_field->getName() + "=$1 AND " + version + "=$3 RETURNING " + version + ";";
+  }
+  else
+  {
+    const std::string &version = version_field->getName();
+    query = "WITH p AS (UPDATE " + pk_field->getTableName() + 
+      " SET " + version + " = " + version + " + 1"
+      " WHERE " + pk_field->getName() + "=$4 AND " + version + "=$3 RETURNING " + version + "),"
+      " u AS (UPDATE " + field->getTableName() + " SET " + field->getName() + "=$2"
+      " WHERE " + key_field->getName() + "=$1 AND EXISTS (SELECT 1 FROM p))"
+      " SELECT " + version + " FROM p;";
+  }
 
-  std::vector<const char*> param_values(2);
-  std::vector<int> param_lengths(2);
-  std::vector<int> param_formats(2);
+  int num_params = 2;
+  if (version_field) num_params = (field->getTableName() == pk_field->getTableName() ? 3 : 4);
+  std::vector<const char*> param_values(num_params);
+  std::vector<int> param_lengths(num_params);
+  std::vector<int> param_formats(num_params);
   //first parameter is always text
   std::string id_str;
   if (!key_field->toString(id_str))
@@ -426,6 +1626,8 @@ bool PostgresqlDatabase::saveToDatabase(const DBFieldBase* field)
   param_values[0] = id_str.c_str();
 
   //second parameter could be binary
+  ros::WallTime encode_start;
+  if (field_stats_.isEnabled()) encode_start = ros::WallTime::now();
   std::string value_str;
   if (field->getType() == DBFieldBase::TEXT)
   {
@@ -453,16 +1655,38 @@ bool PostgresqlDatabase::saveToDatabase(const DBFieldBase* field)
     ROS_ERROR("Database save field: unkown field type");
     return false;
   }
+  if (field_stats_.isEnabled())
+  {
+    field_stats_.recordEncode(field, (ros::WallTime::now() - encode_start).toSec(), 
+                              field->getType() == DBFieldBase::TEXT ? value_str.size() : param_lengths[1]);
+  }
+
+  //the version we expect, and the primary key to find it by
+  std::string version_str, pk_str;
+  if (version_field)
+  {
+    if (!version_field->toString(version_str) || !pk_field->toString(pk_str))
+    {
+      ROS_ERROR("Database save field: failed to convert version or primary key to string");
+      return false;
+    }
+    param_values[2] = version_str.c_str();
+    if (num_params > 3) param_values[3] = pk_str.c_str();
+  }
 
   //ROS_INFO("Save field query: %s $1=%s, $2=%s", query.c_str(), param_values[0], param_values[1]);
 
-  PGresultAutoPtr result( PQexecParams(connection_, query.c_str(), 2, 
-				       NULL, &param_values[0], &param_lengths[0], &param_formats[0], 0) );
-  if (PQresultStatus(*result) != PGRES_COMMAND_OK)
+  PGresultAutoPtr result( execQuery(connection_, query, num_params, 
+				       &param_values[0], &param_lengths[0], &param_formats[0], 0) );
+  ExecStatusType expected = (version_field ? PGRES_TUPLES_OK : PGRES_COMMAND_OK);
+  if (PQresultStatus(*result) != expected)
   {
     ROS_ERROR("Database save field: query failed. Error: %s", PQresultErrorMessage(*result));
     return false;
   }
+  countTableWrites(std::vector<std::string>(1, field->getTableName()));
+  recordWritePosition();
+  if (version_field && !updateVersion(version_field, *result, conflict)) return false;
   return true;
 }
 
@@ -473,6 +1697,7 @@ bool PostgresqlDatabase::saveToDatabase(const DBFieldBase* field)
  */
 bool PostgresqlDatabase::loadFromDatabase(DBFieldBase* field) const
 {
+  TraceScope trace(this, "loadFromDatabase", field->getOwner());
   const DBFieldBase* key_field = NULL;
   if (field->getTableName() == field->getOwner()->getPrimaryKeyField()->getTableName())
   {
@@ -509,7 +1734,8 @@ bool PostgresqlDatabase::loadFromDatabase(DBFieldBase* field) const
     return false;
   }
 
-  PGresultAutoPtr result( PQexecParams(connection_, query.c_str(), 0, NULL, NULL, NULL, NULL, data_type) );
+  ReadOnlyScope reading(this);
+  PGresultAutoPtr result( execQuery(getReadConnection(), query, 0, NULL, NULL, NULL, data_type) );
   if (PQresultStatus(*result) != PGRES_TUPLES_OK)
   {
     ROS_ERROR("Database load field: query failed. Error: %s", PQresultErrorMessage(*result));
@@ -536,7 +1762,9 @@ bool PostgresqlDatabase::loadFromDatabase(DBFieldBase* field) const
   else if (field->getType() == DBFieldBase::BINARY)
   {
     size_t length = PQgetlength(*result, 0, 0);
-    if (!field->fromBinary(result_char, length))
+    //the field can keep the result, and refer to the data in it instead of copying it
+    boost::shared_ptr<const void> holder(boost::shared_ptr<PGresult>(result.release(), PQclear));
+    if (!field->fromBinaryResult(result_char, length, holder))
     {
       ROS_ERROR("Database load field: failed to parse binary result length %d for field \"%s\"",
                 (int) length, field->getName().c_str()); 
@@ -552,122 +1780,189 @@ bool PostgresqlDatabase::loadFromDatabase(DBFieldBase* field) const
   return true;
 }
 
-/*! Inserts into the database the fields of an instance that go into a single table.
-
-  If that table is the table of the primary key, everything is inserted normally.
-
-  If not, the *first* entry in the vector of fields is expected to be the primary
-  key, with the value already set correctly. The table that we are inserting in is
-  expected to have a foreign key that references the primary key field of our class.
+/*! The value is read in chunks of chunk_size bytes (with substring), each written to the
+  file before the next one is read, so that only one chunk is in memory at a time. Unless
+  we are already in a transaction, the chunks are read in a REPEATABLE READ transaction of
+  their own, so that they all come from the same version of the value. The server's 
+  substring only takes int positions, so values are read up to INT_MAX bytes.
  */
-bool PostgresqlDatabase::insertIntoTable(std::string table_name,
-						  const std::vector<const DBFieldBase*> &fields)
+bool PostgresqlDatabase::loadToFile(const DBFieldBase* field, const std::string &filename, 
+                                    size_t chunk_size) const
 {
-  if (fields.empty())
+  TraceScope trace(this, "loadToFile", field->getOwner());
+  if (field->getType() != DBFieldBase::BINARY || !chunk_size || chunk_size >= (size_t) INT_MAX)
   {
-    ROS_ERROR("Insert into table: no columns to insert");
+    ROS_ERROR("Database load to file: field %s is not binary, or chunk size is 0 or too large", 
+              field->getName().c_str());
     return false;
   }
-
-  std::string query("INSERT INTO " + table_name + "(");
-
-  //the first field might be the foreign key
-  if (table_name == fields[0]->getTableName())
+  const DBFieldBase* key_field = field->getOwner()->getPrimaryKeyField();
+  if (field->getTableName() != key_field->getTableName() &&
+      !field->getOwner()->getForeignKey(field->getTableName(), key_field))
   {
-    //it's not, just any other field
-    query += fields[0]->getName();
+    ROS_ERROR("Database load to file: could not find foreign key for table %s", 
+              field->getTableName().c_str());
+    return false;
   }
-  else
+  std::string id_str;
+  if (!key_field->toString(id_str))
   {
-    //we are inserting the foreign key, which for now is always assumed to be referencing our primary key
-    const DBFieldBase *foreign_key = NULL;
-    if (!fields[0]->getOwner()->getForeignKey(table_name, foreign_key))
-    {
-      ROS_ERROR("Database insert into table: could not find foreign key for table %s", table_name.c_str());
-      return false;
-    }
-    query += foreign_key->getName();
+    ROS_ERROR("Database load to file: failed to convert key id value to string");
+    return false;
   }
 
-  for(size_t i=1; i<fields.size(); i++)
+  FILE *file = fopen(filename.c_str(), "wb");
+  if (!file)
   {
-    query += "," + fields[i]->getName();
+    ROS_ERROR("Database load to file: could not open %s for writing", filename.c_str());
+    return false;
   }
-  query += ")";
 
-  query += "VALUES(";
-  for (size_t i=0; i<fields.size(); i++)
+  //all chunks must come from the same connection, in the same transaction
+  ReadOnlyScope reading(this);
+  PGconn *conn = getReadConnection();
+  bool own_transaction = !in_transaction_;
+  if (own_transaction)
   {
-    if ( i!=0 && table_name!=fields[i]->getTableName())
+    PGresultAutoPtr result( execQuery(conn, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY;") );
+    if (PQresultStatus(*result) != PGRES_COMMAND_OK)
     {
-      ROS_ERROR("Database insert into table: field table does not match table name");
+      ROS_ERROR("Database load to file: failed to begin transaction. Error: %s", 
+                PQresultErrorMessage(*result));
+      fclose(file);
       return false;
     }
-    if (i!=0) query += ",";
-    std::ostringstream ss;
-    ss << i+1;
-    query += "$" + ss.str();
   }
-  query += ");";
-  
-  //ROS_INFO("Query: %s", query.c_str());
 
-  //now prepare the arguments
-  std::vector<std::string> param_strings(fields.size());
-  std::vector<const char*> param_values(fields.size());
-  std::vector<int> param_lengths(fields.size());
-  std::vector<int> param_formats(fields.size());
+  std::string query("SELECT substring(" + field->getName() + " FROM $2::int FOR $3::int) FROM " + 
+                    field->getTableName() + " WHERE " + key_field->getName() + "=$1;");
+  std::string length_str(numberToString(chunk_size));
+  bool success = true;
+  long long total = 0;
+  for (size_t offset = 1; success; offset += chunk_size)
+  {
+    if (offset > (size_t) INT_MAX - chunk_size)
+    {
+      ROS_ERROR("Database load to file: value of column %s is longer than the chunks can reach", 
+                field->getName().c_str());
+      success = false;
+      break;
+    }
+    std::string offset_str(numberToString(offset));
+    const char *param_values[3] = {id_str.c_str(), offset_str.c_str(), length_str.c_str()};
+    PGresultAutoPtr result( execQuery(conn, query, 3, param_values, NULL, NULL, 1) );
+    if (PQresultStatus(*result) != PGRES_TUPLES_OK)
+    {
+      ROS_ERROR("Database load to file: query failed. Error: %s", PQresultErrorMessage(*result));
+      success = false;
+      break;
+    }
+    if (PQntuples(*result) == 0 || PQgetisnull(*result, 0, 0))
+    {
+      ROS_ERROR("Database load to file: no value found for key value %s on column %s", 
+                id_str.c_str(), key_field->getName().c_str());
+      success = false;
+      break;
+    }
+    size_t length = PQgetlength(*result, 0, 0);
+    if (length && fwrite(PQgetvalue(*result, 0, 0), 1, length, file) != length)
+    {
+      ROS_ERROR("Database load to file: failed to write to %s", filename.c_str());
+      success = false;
+      break;
+    }
+    total += length;
+    if (length < chunk_size) break;
+  }
+  if (fclose(file) != 0) 
+  {
+    ROS_ERROR("Database load to file: failed to write to %s", filename.c_str());
+    success = false;
+  }
+  if (own_transaction)
+  {
+    PGresultAutoPtr result( execQuery(conn, "COMMIT;") );
+  }
+  trace.setBytes(total);
+  return success;
+}
+
+/*! Converts the values of the fields into statement parameters, which are appended to the
+  given lists. Text fields are sent as text, binary fields as binary. The strings must live
+  as long as the parameters are used. The conversions are timed into stats, if it is enabled.
+ */
+static bool bindFields(const std::vector<const DBFieldBase*> &fields, std::vector<std::string> &param_strings,
+                       std::vector<const char*> &param_values, std::vector<int> &param_lengths,
+                       std::vector<int> &param_formats, FieldCodecStats &stats)
+{
   for (size_t i=0; i<fields.size(); i++)
   {
+    ros::WallTime encode_start;
+    if (stats.isEnabled()) encode_start = ros::WallTime::now();
     if (fields[i]->getType() == DBFieldBase::TEXT)
     {
-      if (!fields[i]->toString(param_strings[i]))
+      std::string value;
+      if (!fields[i]->toString(value))
       {
-	ROS_ERROR("Database insert into table: could not parse field %s", fields[i]->getName().c_str());
+	ROS_ERROR("Database insert: could not parse field %s", fields[i]->getName().c_str());
 	return false;
       }
-      param_values[i] = param_strings[i].c_str();
-      param_formats[i] = 0;
+      param_strings.push_back(value);
+      //filled in once all strings are in place, as the list might be reallocated
+      param_values.push_back(NULL);
+      param_lengths.push_back(0);
+      param_formats.push_back(0);
     }
     else if (fields[i]->getType() == DBFieldBase::BINARY)
     {
+      const char *value;
       size_t length;
-      if (!fields[i]->toBinary(param_values[i], length))
+      if (!fields[i]->toBinary(value, length))
       {
-	ROS_ERROR("Database insert into table: could not binarize field %s", fields[i]->getName().c_str());
+	ROS_ERROR("Database insert: could not binarize field %s", fields[i]->getName().c_str());
 	return false;
       }
-      param_lengths[i] = length;
-      param_formats[i] = 1;
+      param_strings.push_back(std::string());
+      param_values.push_back(value);
+      param_lengths.push_back(length);
+      param_formats.push_back(1);
     }
     else
     {
-      ROS_ERROR("Database insert into table: unknown field type");
+      ROS_ERROR("Database insert: unknown field type");
       return false;
     }
+    if (stats.isEnabled())
+    {
+      stats.recordEncode(fields[i], (ros::WallTime::now() - encode_start).toSec(),
+                         param_formats.back() ? param_lengths.back() : param_strings.back().size());
+    }
   }
-
-  //and send the query
-  PGresultAutoPtr result( PQexecParams(connection_, query.c_str(), fields.size(), NULL, 
-				       &(param_values[0]), &(param_lengths[0]), &(param_formats[0]), 0) );
-  if (PQresultStatus(*result) != PGRES_COMMAND_OK)
-  {
-    ROS_ERROR("Database insert into table: query failed.\nError: %s.\nQuery: %s",
-              PQresultErrorMessage(*result), query.c_str());
-    return false;
-  }
-
   return true;
 }
 
+
 /*! Inserts only the fields marked with writeToDatabase.
 
   The primary key must either be inserted specifically (and thus marked with writeToDatabase)
   or have a default value associated with a sequence. In the latter case, the value is retrieved
   after insertion, and set to the primary key field of the instance.
+
+  All tables are written by a single statement, which is atomic by itself: the row in the 
+  primary key table is inserted in a WITH clause that returns the primary key, and the rows 
+  in the other tables take it from there. For example:
+
+    WITH p AS (INSERT INTO test_object (field_a) VALUES ($1) RETURNING id),
+         t1 AS (INSERT INTO test_object_foreign (id, field_b) VALUES ((SELECT id FROM p), $2))
+    SELECT p.id FROM p;
+
+  Fields marked with readFromDatabase but not writeToDatabase are filled by the server
+  (defaults, triggers); their tables return them, and they are set in the instance from the
+  same statement, so that they do not have to be loaded afterwards.
  */
 bool PostgresqlDatabase::insertIntoDatabase(DBClass* instance)
 {
+  TraceScope trace(this, "insertIntoDatabase", instance);
   //primary key must be text; its table is first
   DBFieldBase* pk_field = instance->getPrimaryKeyField();
   if (pk_field->getType() != DBFieldBase::TEXT)
@@ -679,10 +1974,13 @@ bool PostgresqlDatabase::insertIntoDatabase(DBClass* instance)
   //make lists of which fields go in which table
   std::vector<std::string> table_names;
   std::vector< std::vector<const DBFieldBase*> > table_fields;
+  //fields that are not written but are read; the server fills them, and we read them back
+  std::vector< std::vector<DBFieldBase*> > table_returned;
 
   //the first table we must insert into always belongs to the primary key
   table_names.push_back(pk_field->getTableName());
   table_fields.push_back( std::vector<const DBFieldBase*>() );
+  table_returned.push_back( std::vector<DBFieldBase*>() );
   
   bool insert_pk;
   if (pk_field->getWriteToDatabase())
@@ -736,85 +2034,303 @@ bool PostgresqlDatabase::insertIntoDatabase(DBClass* instance)
       //we are joining on primary key, so we will need to insert it in other table as well
       table_names.push_back( instance->getField(i)->getTableName() );
       table_fields.push_back( std::vector<const DBFieldBase*>() );
+      table_returned.push_back( std::vector<DBFieldBase*>() );
       //in all the other tables we must explicitly insert the value of our 
       //primary key as it is the foreign key in all other tables
       table_fields.back().push_back(pk_field);
       t = table_names.size() - 1;
     }
-    if ( !instance->getField(i)->getWriteToDatabase() ) continue;
-    if ( instance->getField(i)->getType() != DBFieldBase::TEXT )
+    if ( !instance->getField(i)->getWriteToDatabase() ) 
     {
-      ROS_WARN("Database insert: cannot insert binary field %s in database", 
-        instance->getField(i)->getName().c_str());
+      //filled by a default or a trigger; binary fields are not read by default (see getList)
+      if ( instance->getField(i)->getReadFromDatabase() && 
+           instance->getField(i)->getType() == DBFieldBase::TEXT )
+      {
+        table_returned[t].push_back(instance->getField(i));
+      }
       continue;
     }
-    //insert the field itself
+    //insert the field itself; binary fields are sent in binary format (see bindFields)
     table_fields[t].push_back(instance->getField(i));
   }
   
-  //BEGIN transaction
-  if (!begin()) return false;
+  std::string pk_name(pk_field->getName());
+  std::vector<std::string> param_strings;
+  std::vector<const char*> param_values;
+  std::vector<int> param_lengths;
+  std::vector<int> param_formats;
+  std::string query("WITH p AS (INSERT INTO " + table_names[0]);
+  std::string returned_columns, returned_tables(" FROM p");
+  for (size_t t=0; t<table_names.size(); t++)
+  {
+    std::string alias(t == 0 ? "p" : "t" + numberToString(t));
+    //in the other tables, the first field is the primary key, which comes from p
+    size_t first = (t == 0 ? 0 : 1);
+    std::string columns, values;
+    if (t != 0)
+    {
+      query += ", t" + numberToString(t) + " AS (INSERT INTO " + table_names[t];
+      columns = pk_name;
+      values = "(SELECT " + pk_name + " FROM p)";
+    }
+    for (size_t i=first; i<table_fields[t].size(); i++)
+    {
+      if (!columns.empty()) columns += ",";
+      if (!values.empty()) values += ",";
+      columns += table_fields[t][i]->getName();
+      values += "$" + numberToString(param_values.size() + i - first + 1);
+    }
+    if (columns.empty()) query += " DEFAULT VALUES";
+    else query += " (" + columns + ") VALUES (" + values + ")";
+    std::string returning;
+    if (t == 0) returning = pk_name;
+    for (size_t i=0; i<table_returned[t].size(); i++)
+    {
+      if (!returning.empty()) returning += ",";
+      returning += table_returned[t][i]->getName();
+      returned_columns += ", " + alias + "." + table_returned[t][i]->getName();
+    }
+    if (!returning.empty()) query += " RETURNING " + returning;
+    if (t != 0 && !table_returned[t].empty()) returned_tables += ", " + alias;
+    query += ")";
+
+    std::vector<const DBFieldBase*> fields(table_fields[t].begin() + first, table_fields[t].end());
+    if (!bindFields(fields, param_strings, param_values, param_lengths, param_formats,
+                    field_stats_)) return false;
+  }
+  //each insertion returns a single row, so the cross product is a single row as well
+  query += " SELECT p." + pk_name + returned_columns + returned_tables + ";";
+  for (size_t i=0; i<param_values.size(); i++)
+  {
+    if (param_formats[i] == 0) param_values[i] = param_strings[i].c_str();
+  }
 
-  //first we insert into the primary key's table
-  if (!insertIntoTable(table_names[0], table_fields[0])) 
+  PGresultAutoPtr result( execQuery(connection_, query, param_values.size(), 
+                                    param_values.empty() ? NULL : &(param_values[0]), 
+                                    param_lengths.empty() ? NULL : &(param_lengths[0]), 
+                                    param_formats.empty() ? NULL : &(param_formats[0]), 0) );
+  if (PQresultStatus(*result) != PGRES_TUPLES_OK || PQntuples(*result) != 1)
   {
-    rollback();
+    ROS_ERROR("Database insert: query failed.\nError: %s.\nQuery: %s",
+              PQresultErrorMessage(*result), query.c_str());
     return false;
   }
 
   //if we have to, retrieve the primary key
-  if (!insert_pk)
+  if (!insert_pk && !pk_field->fromString(PQgetvalue(*result, 0, 0)))
   {
-    std::string sequence_value;
-    if (!getSequence(pk_field->getSequenceName(), sequence_value) || !pk_field->fromString(sequence_value))
+    ROS_ERROR("Database insert: failed to parse primary key %s after insertion", PQgetvalue(*result, 0, 0));
+    return false;
+  }
+  //read back what the server filled in, in the order it was asked for. The row is in by now,
+  //so a value we can not parse is only reported: failing would have the caller insert again
+  int column = 1;
+  for (size_t t=0; t<table_returned.size(); t++)
+  {
+    for (size_t i=0; i<table_returned[t].size(); i++, column++)
     {
-      ROS_ERROR("Database insert: failed to retrieve primary key after insertion");
-      rollback();
-      return false;
+      //a NULL leaves the field as it was
+      if (PQgetisnull(*result, 0, column)) continue;
+      const char *value = PQgetvalue(*result, 0, column);
+      if (!table_returned[t][i]->fromString(value))
+      {
+        ROS_WARN("Database insert: failed to parse value \"%s\" of field %s after insertion", 
+                 value, table_returned[t][i]->getName().c_str());
+      }
     }
   }
+  countTableWrites(table_names);
+  recordWritePosition();
+  return true;
+}
+
+/*! Like insertIntoDatabase, all tables are written by a single statement. The primary key 
+  table is updated in a WITH clause that returns the primary key, and the other tables are 
+  only updated for the key it returned. With a version field, the primary key table update
+  also checks and increments the version, so that nothing is written on a conflict:
+
+    WITH p AS (UPDATE test_object SET field_a=$2, version = version + 1 
+               WHERE id=$1 AND version=$4 RETURNING id, version),
+         t1 AS (UPDATE test_object_foreign SET field_b=$3 WHERE id=(SELECT id FROM p))
+    SELECT version FROM p;
+ */
+bool PostgresqlDatabase::saveToDatabase(DBClass* instance, bool *conflict)
+{
+  TraceScope trace(this, "saveToDatabase", instance);
+  if (conflict) *conflict = false;
+  const DBFieldBase* pk_field = instance->getPrimaryKeyField();
+  DBFieldBase* version_field = instance->getVersionField();
+  if (version_field && version_field->getTableName() != pk_field->getTableName())
+  {
+    ROS_ERROR("Database save: version field %s must be in the primary key table",
+              version_field->getName().c_str());
+    return false;
+  }
 
-  //insert into the rest of the tables
-  for (size_t i=1; i<table_names.size(); i++)
+  //the fields to write, by table; the primary key table is first
+  std::vector<std::string> table_names(1, pk_field->getTableName());
+  std::vector< std::vector<const DBFieldBase*> > table_fields(1);
+  for (size_t i=0; i<instance->getNumFields(); i++)
   {
-    if (!insertIntoTable(table_names[i], table_fields[i]))
+    const DBFieldBase *field = instance->getField(i);
+    if (!field->getWriteToDatabase() || field == version_field) continue;
+    if (!field->getWritePermission())
     {
-      rollback();
+      ROS_ERROR("Database save: field %s does not have write permission", field->getName().c_str());
       return false;
     }
+    size_t t = std::find(table_names.begin(), table_names.end(), field->getTableName()) - table_names.begin();
+    if (t == table_names.size())
+    {
+      const DBFieldBase* foreign_key = NULL;
+      if (!instance->getForeignKey(field->getTableName(), foreign_key) || foreign_key != pk_field)
+      {
+        ROS_ERROR("Database save: table %s is not joined on the primary key", 
+                  field->getTableName().c_str());
+        return false;
+      }
+      table_names.push_back(field->getTableName());
+      table_fields.push_back(std::vector<const DBFieldBase*>());
+    }
+    table_fields[t].push_back(field);
   }
 
-  //COMMIT transaction
-  if (!commit()) return false;
+  std::string pk_name(pk_field->getName());
+  std::vector<std::string> param_strings;
+  std::vector<const char*> param_values;
+  std::vector<int> param_lengths;
+  std::vector<int> param_formats;
+  std::vector<const DBFieldBase*> key(1, pk_field);
+  if (!bindFields(key, param_strings, param_values, param_lengths, param_formats,
+                  field_stats_)) return false;
+
+  std::string query("WITH p AS (");
+  for (size_t t=0; t<table_names.size(); t++)
+  {
+    std::string assignments;
+    for (size_t i=0; i<table_fields[t].size(); i++)
+    {
+      if (!assignments.empty()) assignments += ", ";
+      assignments += table_fields[t][i]->getName() + "=$" + numberToString(param_values.size() + i + 1);
+    }
+    if (!bindFields(table_fields[t], param_strings, param_values, param_lengths, param_formats,
+                    field_stats_)) return false;
+    if (t != 0)
+    {
+      query += ", t" + numberToString(t) + " AS (UPDATE " + table_names[t] + " SET " + assignments + 
+        " WHERE " + pk_name + "=(SELECT " + pk_name + " FROM p))";
+      continue;
+    }
+    if (version_field)
+    {
+      const std::string &version = version_field->getName();
+      if (!assignments.empty()) assignments += ", ";
+      assignments += version + " = " + version + " + 1";
+      std::vector<const DBFieldBase*> expected(1, version_field);
+      if (!bindFields(expected, param_strings, param_values, param_lengths, param_formats,
+                      field_stats_)) return false;
+      query += "UPDATE " + table_names[0] + " SET " + assignments + " WHERE " + pk_name + "=$1 AND " + 
+        version + "=$" + numberToString(param_values.size()) + " RETURNING " + pk_name + ", " + version + ")";
+    }
+    else if (!assignments.empty())
+    {
+      query += "UPDATE " + table_names[0] + " SET " + assignments + " WHERE " + pk_name + "=$1"
+        " RETURNING " + pk_name + ")";
+    }
+    else
+    {
+      //nothing to change in the primary key table; we only need to know the instance exists
+      query += "SELECT " + pk_name + " FROM " + table_names[0] + " WHERE " + pk_name + "=$1)";
+    }
+  }
+  query += " SELECT " + (version_field ? version_field->getName() : pk_name) + " FROM p;";
+  for (size_t i=0; i<param_values.size(); i++)
+  {
+    if (param_formats[i] == 0) param_values[i] = param_strings[i].c_str();
+  }
 
+  PGresultAutoPtr result( execQuery(connection_, query, param_values.size(), &(param_values[0]), 
+                                    &(param_lengths[0]), &(param_formats[0]), 0) );
+  if (PQresultStatus(*result) != PGRES_TUPLES_OK)
+  {
+    ROS_ERROR("Database save: query failed.\nError: %s.\nQuery: %s",
+              PQresultErrorMessage(*result), query.c_str());
+    return false;
+  }
+  countTableWrites(table_names);
+  recordWritePosition();
+  if (version_field) return updateVersion(version_field, *result, conflict);
+  if (PQntuples(*result) == 0)
+  {
+    ROS_ERROR("Database save: instance not found");
+    return false;
+  }
   return true;
 }
 
-/*! Deletes a row from a table based on the value of the specified field */
-bool PostgresqlDatabase::deleteFromTable(std::string table_name, const DBFieldBase *key_field)
+/*! Uses nextval over generate_series, which works with any sequence; a sequence does not
+  need to be created with a matching INCREMENT BY for this.
+*/
+bool PostgresqlDatabase::reserveSequenceValues(const std::string &sequence, size_t count,
+                                               std::vector<std::string> &values)
 {
-  std::string id_str;
-  if (!key_field->toString(id_str))
+  std::string count_str(numberToString(count));
+  const char *param_values[2] = {sequence.c_str(), count_str.c_str()};
+  PGresultAutoPtr result( execQuery(connection_, "SELECT nextval($1::regclass) FROM generate_series(1, $2::int);", 
+                                    2, param_values) );
+  if (PQresultStatus(*result) != PGRES_TUPLES_OK)
   {
-    ROS_ERROR("Database delete from table: failed to convert key id value to string");
+    ROS_ERROR("Database reserve sequence values failed. Error: %s", PQresultErrorMessage(*result));
     return false;
   }
+  values.clear();
+  for (int i=0; i<PQntuples(*result); i++)
+  {
+    values.push_back(PQgetvalue(*result, i, 0));
+  }
+  return true;
+}
 
-  std::string query("DELETE FROM " + table_name + " WHERE " + key_field->getName() + "=" + id_str);
-  PGresultAutoPtr result( PQexec(connection_, query.c_str()) );
-  if (PQresultStatus(*result) != PGRES_COMMAND_OK)
+bool PostgresqlDatabase::allocatePrimaryKey(DBClass *instance)
+{
+  DBFieldBase *pk_field = instance->getPrimaryKeyField();
+  std::string sequence(pk_field->getSequenceName());
+  if (sequence.empty())
   {
-    ROS_ERROR("Database delete from table: query failed. Error: %s", PQresultErrorMessage(*result));
+    ROS_ERROR("Database allocate primary key: field %s has no sequence", pk_field->getName().c_str());
     return false;
   }
+  std::deque<std::string> &keys = reserved_keys_[sequence];
+  if (keys.empty())
+  {
+    std::vector<std::string> values;
+    if (!reserveSequenceValues(sequence, key_block_size_, values)) return false;
+    keys.insert(keys.end(), values.begin(), values.end());
+  }
+  if (!pk_field->fromString(keys.front()))
+  {
+    ROS_ERROR("Database allocate primary key: failed to parse key %s", keys.front().c_str());
+    return false;
+  }
+  keys.pop_front();
+  pk_field->setWriteToDatabase(true);
   return true;
 }
 
 /*! It removes the entry from the table that holds our primary key, but also from 
-  other tables that might hold our fields. Those tables have to be removed first.
+  other tables that might hold our fields. Those tables have to be removed first. All
+  deletions are done by a single statement, with those from the other tables in a WITH 
+  clause:
+
+    WITH t1 AS (DELETE FROM test_object_foreign WHERE id = $1)
+    DELETE FROM test_object WHERE id = $1;
+
+  The foreign key constraints are only checked at the end of the statement, when all
+  the rows are gone.
 */
 bool PostgresqlDatabase::deleteFromDatabase(DBClass* instance)
 {
+  TraceScope trace(this, "deleteFromDatabase", instance);
   std::vector<std::string> table_names;
   std::vector<const DBFieldBase*> table_fields;
   DBFieldBase* pk_field = instance->getPrimaryKeyField();
@@ -847,30 +2363,37 @@ bool PostgresqlDatabase::deleteFromDatabase(DBClass* instance)
     table_fields.push_back( pk_field );
   }
 
-  //BEGIN transaction
-  if (!begin()) return false;
-  
-  //delete from all tables, but primary key table goes last
-  for (int i=(int)table_names.size()-1; i>=0; i--)
+  std::string id_str;
+  if (!pk_field->toString(id_str))
   {
-    if (!deleteFromTable(table_names[i], table_fields[i]))
-    {
-      rollback();
-      return false;
-    }
+    ROS_ERROR("Database delete: failed to convert primary key value to string");
+    return false;
   }
 
-  //COMMIT transaction
-  if (!commit()) return false;
+  std::string query;
+  for (size_t t=1; t<table_names.size(); t++)
+  {
+    query += (t == 1 ? "WITH t" : ", t") + numberToString(t) + " AS (DELETE FROM " + 
+      table_names[t] + " WHERE " + table_fields[t]->getName() + " = $1) ";
+  }
+  query += "DELETE FROM " + table_names[0] + " WHERE " + table_fields[0]->getName() + " = $1;";
 
+  const char *param_values[1] = {id_str.c_str()};
+  PGresultAutoPtr result( execQuery(connection_, query, 1, param_values) );
+  if (PQresultStatus(*result) != PGRES_COMMAND_OK)
+  {
+    ROS_ERROR("Database delete: query failed. Error: %s", PQresultErrorMessage(*result));
+    return false;
+  }
+  countTableWrites(table_names);
+  recordWritePosition();
   return true;
-
 }
 
 /*! Listens to a specified channel using the Postgresql LISTEN-function.*/
 bool PostgresqlDatabase::listenToChannel(std::string channel) {
   std::string query = "LISTEN " + channel;
-  PGresultAutoPtr result = PQexec(connection_,query.c_str());
+  PGresultAutoPtr result(execQuery(connection_, query));
   if (PQresultStatus(*result) != PGRES_COMMAND_OK)
       {
           ROS_WARN("LISTEN command failed: %s", PQerrorMessage(connection_));
@@ -884,7 +2407,7 @@ bool PostgresqlDatabase::listenToChannel(std::string channel) {
 bool PostgresqlDatabase::unlistenToChannel(std::string channel)
 {
   std::string query = "UNLISTEN " + channel + " ;";
-  PGresultAutoPtr result = PQexec(connection_,query.c_str());
+  PGresultAutoPtr result(execQuery(connection_, query));
   if (PQresultStatus(*result) != PGRES_COMMAND_OK)
   {
     ROS_WARN("UNLISTEN command failed: %s", PQerrorMessage(connection_));
@@ -894,12 +2417,126 @@ bool PostgresqlDatabase::unlistenToChannel(std::string channel)
   return true;
 }
 
+bool PostgresqlDatabase::refreshMaterializedView(const std::string &view, bool concurrently)
+{
+  TraceScope trace(this, "refreshMaterializedView");
+  std::string query("REFRESH MATERIALIZED VIEW ");
+  if (concurrently) query += "CONCURRENTLY ";
+  query += view + ";";
+  PGresultAutoPtr result( execQuery(connection_, query) );
+  if (PQresultStatus(*result) != PGRES_COMMAND_OK)
+  {
+    ROS_ERROR("Database refresh of materialized view %s failed. Error: %s", view.c_str(),
+              PQresultErrorMessage(*result));
+    return false;
+  }
+  recordWritePosition();
+  return true;
+}
+
+/*! The view is taken to be fresh as of now; it is not refreshed until one of its triggers 
+  fires. */
+bool PostgresqlDatabase::manageMaterializedView(const MaterializedViewConfig &config)
+{
+  if (!config.channel.empty() && !listenToChannel(config.channel)) return false;
+  MaterializedViewState state;
+  state.config = config;
+  state.last_refresh = ros::WallTime::now();
+  state.writes = 0;
+  state.notified = false;
+  materialized_views_.push_back(state);
+  return true;
+}
+
+void PostgresqlDatabase::countTableWrites(const std::vector<std::string> &tables)
+{
+  for (size_t v=0; v<materialized_views_.size(); v++)
+  {
+    const std::vector<std::string> &sources = materialized_views_[v].config.source_tables;
+    for (size_t t=0; t<tables.size(); t++)
+    {
+      if (std::find(sources.begin(), sources.end(), tables[t]) != sources.end())
+      {
+        materialized_views_[v].writes++;
+        break;
+      }
+    }
+  }
+}
+
+bool PostgresqlDatabase::notifyMaterializedViews(const std::string &channel)
+{
+  bool found = false;
+  for (size_t v=0; v<materialized_views_.size(); v++)
+  {
+    if (materialized_views_[v].config.channel != channel) continue;
+    materialized_views_[v].notified = true;
+    found = true;
+  }
+  return found;
+}
+
+/*! Notifications on other channels that arrive meanwhile are kept, and returned by the next 
+  calls to checkNotify(...).
+ */
+bool PostgresqlDatabase::refreshMaterializedViews()
+{
+  if (materialized_views_.empty()) return true;
+  //collect the notifications that have arrived
+  if (!PQconsumeInput(connection_))
+  {
+    ROS_ERROR("Consume input failed with error message: %s", PQerrorMessage(connection_));
+    return false;
+  }
+  PGnotify *notify;
+  while ((notify = PQnotifies(connection_)) != NULL)
+  {
+    Notification no;
+    no.channel = notify->relname;
+    no.sending_pid = notify->be_pid;
+    no.payload = notify->extra;
+    PQfreemem(notify);
+    DB_PROBE3(notification__receive, no.channel.c_str(), no.sending_pid, no.payload.c_str());
+    if (!notifyMaterializedViews(no.channel)) pending_notifications_.push_back(no);
+  }
+  if (in_transaction_) return true;
+
+  bool success = true;
+  ros::WallTime now = ros::WallTime::now();
+  for (size_t v=0; v<materialized_views_.size(); v++)
+  {
+    MaterializedViewState &state = materialized_views_[v];
+    bool due = state.notified ||
+      (state.config.write_threshold && state.writes >= state.config.write_threshold) ||
+      (state.config.refresh_period > 0 && (now - state.last_refresh).toSec() >= state.config.refresh_period);
+    if (!due) continue;
+    //writes made while the refresh runs may or may not be in it, so they are counted again
+    unsigned int writes = state.writes;
+    if (!refreshMaterializedView(state.config.view, state.config.concurrently))
+    {
+      success = false;
+      continue;
+    }
+    state.last_refresh = now;
+    state.writes -= writes;
+    state.notified = false;
+  }
+  return success;
+}
+
 /*! Checks for a received NOTIFY and returns it. Returns false if there is a connection problem.
     If there isn't a notification retreived, the Notification-object will have empty strings and
     "0" as sending_pid.
  */
 bool PostgresqlDatabase::checkNotify(Notification &no)
 {
+  //some may have been received already, while refreshing materialized views
+  if (!pending_notifications_.empty())
+  {
+    no = pending_notifications_.front();
+    pending_notifications_.pop_front();
+    return true;
+  }
   PGnotify *notify;
   //check for a notify on the connection
   if (!PQconsumeInput(connection_))
@@ -914,6 +2551,8 @@ bool PostgresqlDatabase::checkNotify(Notification &no)
     no.sending_pid = notify->be_pid;
     no.payload = notify->extra;
     PQfreemem(notify);
+    DB_PROBE3(notification__receive, no.channel.c_str(), no.sending_pid, no.payload.c_str());
+    notifyMaterializedViews(no.channel);
   }
   else
   {
@@ -928,6 +2567,7 @@ bool PostgresqlDatabase::checkNotify(Notification &no)
 /*! Checks for a notify and just exits, if there's an error or a received NOTIFY */
 bool PostgresqlDatabase::waitForNotify(Notification &no)
 {
+  if (!pending_notifications_.empty()) return checkNotify(no);
   int sock;
   fd_set input_mask;
   while (true)
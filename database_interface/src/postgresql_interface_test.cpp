@@ -35,15 +35,190 @@
 // Author(s): Matei Ciocarlie
 
 #include <algorithm>
+#include <limits>
+#include <stdlib.h>
+#include <unistd.h>
 #include <vector>
 #include <boost/shared_ptr.hpp>
 
 #include "database_interface/postgresql_database.h"
+#include "database_interface/db_capture.h"
 
 #include "database_interface/database_test_object.h"
 
 #include <ros/ros.h>
 
+//! Checks that a timestamp parses to the given time, and formats back to the expected text
+bool checkTimestamp(const std::string &text, int64_t usec, const std::string &formatted)
+{
+  database_interface::DBTimestamp timestamp;
+  if (!database_interface::parseTimestamp(text.c_str(), text.size(), timestamp) || timestamp.usec != usec)
+  {
+    ROS_ERROR("Failed to parse timestamp %s", text.c_str());
+    return false;
+  }
+  std::string result = database_interface::formatTimestamp(timestamp);
+  database_interface::DBTimestamp again;
+  if (result != formatted || !database_interface::parseTimestamp(result.c_str(), result.size(), again) ||
+      again != timestamp)
+  {
+    ROS_ERROR("Timestamp %s formatted as %s", text.c_str(), result.c_str());
+    return false;
+  }
+  return true;
+}
+
+//! Tests the text codecs of the typed fields; does not need the database
+bool testCodecs()
+{
+  if (!checkTimestamp("2013-05-02 14:03:27.25+02", 1367496207250000LL, "2013-05-02 12:03:27.250000+00") ||
+      !checkTimestamp("1969-12-31 23:59:59.5", -500000LL, "1969-12-31 23:59:59.500000+00") ||
+      !checkTimestamp("2000-02-29T00:00:00Z", 951782400000000LL, "2000-02-29 00:00:00.000000+00") ||
+      !checkTimestamp("infinity", std::numeric_limits<int64_t>::max(), "infinity"))
+  {
+    return false;
+  }
+  database_interface::DBTimestamp timestamp;
+  if (database_interface::parseTimestamp("2013-05-02 25:00:00", 19, timestamp))
+  {
+    ROS_ERROR("Parsed timestamp with invalid hour");
+    return false;
+  }
+
+  database_interface::DBDate date;
+  if (!database_interface::parseDate("1900-03-01", 10, date) || 
+      database_interface::formatDate(date) != "1900-03-01")
+  {
+    ROS_ERROR("Date round trip failed: %s", database_interface::formatDate(date).c_str());
+    return false;
+  }
+
+  database_interface::DBUuid uuid, plain;
+  std::string braced("{A0EEBC99-9C0B-4EF8-BB6D-6BB9BD380A11}");
+  std::string bare("a0eebc999c0b4ef8bb6d6bb9bd380a11");
+  if (!database_interface::parseUuid(braced.c_str(), braced.size(), uuid) || 
+      !database_interface::parseUuid(bare.c_str(), bare.size(), plain) || uuid != plain ||
+      database_interface::formatUuid(uuid) != "a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11")
+  {
+    ROS_ERROR("UUID round trip failed: %s", database_interface::formatUuid(uuid).c_str());
+    return false;
+  }
+  if (database_interface::parseUuid(bare.c_str(), bare.size() - 1, uuid))
+  {
+    ROS_ERROR("Parsed truncated UUID");
+    return false;
+  }
+
+  int64_t integer;
+  if (!database_interface::parseInt64("-9223372036854775808", 20, integer) || 
+      integer != std::numeric_limits<int64_t>::min() ||
+      database_interface::parseInt64("9223372036854775808", 19, integer) ||
+      database_interface::parseInt64("12a", 3, integer))
+  {
+    ROS_ERROR("Integer parsing failed");
+    return false;
+  }
+
+  float real;
+  if (!database_interface::parseFloat("1.5", 3, real) || real != 1.5f ||
+      !database_interface::parseFloat("-Infinity", 9, real) || real != -std::numeric_limits<float>::infinity() ||
+      !database_interface::parseFloat("NaN", 3, real) || real == real)
+  {
+    ROS_ERROR("Float parsing failed");
+    return false;
+  }
+
+  //a NULL in the database resets the field, also when the instance is reused
+  database_interface::DBField<int64_t> field(database_interface::DBFieldBase::TEXT, NULL, 
+                                             "field", "table", true);
+  if (!field.fromString("42") || field.get() != 42)
+  {
+    ROS_ERROR("Failed to set field from text");
+    return false;
+  }
+  field.setToDefault();
+  if (field.get() != 0)
+  {
+    ROS_ERROR("Field not reset to its default");
+    return false;
+  }
+  return true;
+}
+
+//! Tests that statements recorded by a CaptureWriter are read back intact; does not need the database
+bool testCapture()
+{
+  char filename[] = "/tmp/postgresql_interface_testXXXXXX";
+  int fd = mkstemp(filename);
+  if (fd < 0)
+  {
+    ROS_ERROR("Failed to create capture file");
+    return false;
+  }
+  close(fd);
+
+  std::string query("SELECT * FROM test WHERE a = $1 AND b = $2 AND c = $3");
+  std::string binary(300, 'x');
+  binary[0] = '\0';
+  const char* values[3] = {"text value", NULL, binary.data()};
+  int lengths[3] = {0, 0, (int) binary.size()};
+  int formats[3] = {0, 0, 1};
+  ros::WallTime start = ros::WallTime::now();
+  {
+    database_interface::CaptureWriter writer(filename);
+    if (!writer.isOpen())
+    {
+      ROS_ERROR("Failed to open capture file for writing");
+      unlink(filename);
+      return false;
+    }
+    //the third statement started before the second one, as if it finished in another thread
+    writer.record(query, 3, values, lengths, formats, 1, 1234,
+                  start + ros::WallDuration(0, 1000000), start + ros::WallDuration(0, 1250000), true, true);
+    writer.record("BEGIN;", 0, NULL, NULL, NULL, 0, 1234,
+                  start + ros::WallDuration(0, 5000000), start + ros::WallDuration(0, 5100000), false, false);
+    writer.record(query, 3, values, lengths, formats, 0, 99,
+                  start + ros::WallDuration(0, 3000000), start + ros::WallDuration(0, 3010000), true, false);
+  }
+
+  database_interface::CaptureReader reader(filename);
+  std::vector<database_interface::CapturedStatement> statements;
+  database_interface::CapturedStatement statement;
+  while (reader.next(statement)) statements.push_back(statement);
+  unlink(filename);
+  if (statements.size() != 3)
+  {
+    ROS_ERROR("Read back %zd captured statements instead of 3", statements.size());
+    return false;
+  }
+  if (statements[0].query != query || statements[1].query != "BEGIN;" || statements[2].query != query ||
+      statements[0].connection_id != 1234 || statements[2].connection_id != 99 ||
+      statements[0].result_format != 1 || statements[2].result_format != 0 ||
+      !statements[0].ok || statements[1].ok || !statements[0].read_only || statements[2].read_only ||
+      statements[0].duration_usec != 250 || statements[1].duration_usec != 100)
+  {
+    ROS_ERROR("Captured statement read back with different values");
+    return false;
+  }
+  long long second = statements[1].start_usec - statements[0].start_usec;
+  long long third = statements[2].start_usec - statements[0].start_usec;
+  if (second < 3999 || second > 4001 || third < 1999 || third > 2001)
+  {
+    ROS_ERROR("Captured start times read back as %lld and %lld usec after the first", second, third);
+    return false;
+  }
+  const std::vector<database_interface::CapturedParameter> &params = statements[2].params;
+  if (params.size() != 3 || !statements[1].params.empty() ||
+      params[0].kind != database_interface::CapturedParameter::TEXT || params[0].value != "text value" ||
+      params[1].kind != database_interface::CapturedParameter::NULL_VALUE ||
+      params[2].kind != database_interface::CapturedParameter::BINARY || params[2].value != binary)
+  {
+    ROS_ERROR("Captured parameters read back with different values");
+    return false;
+  }
+  return true;
+}
+
 //! A little test program for the model database
 int main(int argc, char **argv)
 {
@@ -51,6 +226,19 @@ int main(int argc, char **argv)
   bool TEST_DELETION = true;
   size_t NUM_OBJECTS = 2;
 
+  if (!testCodecs())
+  {
+    ROS_ERROR("Codec tests failed");
+    return -1;
+  }
+  ROS_INFO("Codec tests successful");
+  if (!testCapture())
+  {
+    ROS_ERROR("Capture tests failed");
+    return -1;
+  }
+  ROS_INFO("Capture tests successful");
+
   database_interface::PostgresqlDatabase database("wgs36", "5432", "willow", 
 							   "willow", "database_test");
   if (!database.isConnected())
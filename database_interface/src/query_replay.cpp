@@ -0,0 +1,378 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+/*! Usage: query_replay [options] <capture file> [connection string]
+
+  Replays the statements recorded by a CaptureWriter (see PostgresqlDatabase::setCapture)
+  against a database, to benchmark it, or the library, with a real workload. The connection
+  string is in the usual libpq format; if it is left out, the PGHOST, PGDATABASE, ... 
+  environment variables are used.
+
+  Options:
+    --speed <factor>      replay at the given multiple of the original pace (default 1)
+    --max-speed           send each statement as soon as the previous one on its connection
+                          is done
+    --concurrency <n>     the number of connections to replay on; by default, as many as 
+                          were captured
+    --read-only           only replay the statements that were sent as reads (by getList,
+                          countList, loadFromDatabase, ...), which do not change the database
+
+  The statements of each captured connection are replayed in order on the same replay 
+  connection, so transactions stay intact. With fewer replay connections than captured ones, 
+  captured connections share replay connections, and their statements are serialized.
+  Statements with parameters are prepared, as PostgresqlDatabase does.
+
+  At the end, the time taken by each statement shape is compared with the capture, and the
+  lag (how late statements were sent compared to the schedule) is reported; a large lag 
+  means the database could not keep up with the requested pace.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <libpq-fe.h>
+
+#include "database_interface/db_capture.h"
+
+using namespace database_interface;
+
+//! Orders statements by the time they were sent in the capture
+static bool earlierStart(const CapturedStatement &a, const CapturedStatement &b)
+{
+  return a.start_usec < b.start_usec;
+}
+
+//! Timing of the statements of one shape
+struct ShapeStats
+{
+  unsigned long count;
+  unsigned long errors;
+  double captured_time;
+  double replay_time;
+  ShapeStats() : count(0), errors(0), captured_time(0), replay_time(0) {}
+};
+
+//! Orders shapes by decreasing replay time
+static bool moreReplayTime(const std::pair<std::string, ShapeStats> &a, 
+                           const std::pair<std::string, ShapeStats> &b)
+{
+  return a.second.replay_time > b.second.replay_time;
+}
+
+//! Replays statements on its own connection, in the order they are queued
+class ReplayWorker
+{
+ private:
+  PGconn *conn_;
+  std::map<std::string, std::string> prepared_;
+  std::deque<const CapturedStatement*> queue_;
+  bool done_;
+  boost::mutex mutex_;
+  boost::condition_variable condition_;
+
+  bool execute(const CapturedStatement &statement);
+
+ public:
+  std::map<std::string, ShapeStats> stats;
+  double max_lag;
+
+  ReplayWorker(PGconn *conn) : conn_(conn), done_(false), max_lag(0) {}
+  ~ReplayWorker() {PQfinish(conn_);}
+
+  void push(const CapturedStatement *statement)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    queue_.push_back(statement);
+    condition_.notify_one();
+  }
+
+  //! Lets the worker finish once its queue is empty
+  void finish()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    done_ = true;
+    condition_.notify_one();
+  }
+
+  void run(const boost::posix_time::ptime &replay_start, double speed);
+};
+
+bool ReplayWorker::execute(const CapturedStatement &statement)
+{
+  std::vector<const char*> values(statement.params.size());
+  std::vector<int> lengths(statement.params.size());
+  std::vector<int> formats(statement.params.size());
+  for (size_t i=0; i<statement.params.size(); i++)
+  {
+    const CapturedParameter &param = statement.params[i];
+    values[i] = param.kind == CapturedParameter::NULL_VALUE ? NULL : param.value.c_str();
+    lengths[i] = param.value.size();
+    formats[i] = param.kind == CapturedParameter::BINARY ? 1 : 0;
+  }
+  int num_params = statement.params.size();
+  PGresult *result;
+  if (!num_params)
+  {
+    result = PQexecParams(conn_, statement.query.c_str(), 0, NULL, NULL, NULL, NULL, 
+                          statement.result_format);
+  }
+  else
+  {
+    std::map<std::string, std::string>::iterator it = prepared_.find(statement.query);
+    if (it == prepared_.end())
+    {
+      std::string name("query_replay_" + boost::lexical_cast<std::string>(prepared_.size()));
+      PGresult *prepare = PQprepare(conn_, name.c_str(), statement.query.c_str(), num_params, NULL);
+      bool ok = PQresultStatus(prepare) == PGRES_COMMAND_OK;
+      PQclear(prepare);
+      if (!ok) return false;
+      it = prepared_.insert(std::make_pair(statement.query, name)).first;
+    }
+    result = PQexecPrepared(conn_, it->second.c_str(), num_params, &values[0], &lengths[0], 
+                            &formats[0], statement.result_format);
+  }
+  ExecStatusType status = PQresultStatus(result);
+  PQclear(result);
+  if (status == PGRES_COPY_OUT)
+  {
+    char *buffer;
+    while (PQgetCopyData(conn_, &buffer, 0) > 0) PQfreemem(buffer);
+    result = PQgetResult(conn_);
+    status = PQresultStatus(result);
+    PQclear(result);
+    while ( (result = PQgetResult(conn_)) ) PQclear(result);
+  }
+  return status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK;
+}
+
+void ReplayWorker::run(const boost::posix_time::ptime &replay_start, double speed)
+{
+  while (true)
+  {
+    const CapturedStatement *statement;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (queue_.empty() && !done_) condition_.wait(lock);
+      if (queue_.empty()) return;
+      statement = queue_.front();
+      queue_.pop_front();
+    }
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    if (speed > 0)
+    {
+      double scheduled = statement->start_usec / speed / 1.0e6;
+      double lag = (start - replay_start).total_microseconds() / 1.0e6 - scheduled;
+      max_lag = std::max(max_lag, lag);
+    }
+    bool ok = execute(*statement);
+    boost::posix_time::ptime end = boost::posix_time::microsec_clock::universal_time();
+    ShapeStats &shape = stats[statement->query];
+    shape.count++;
+    if (!ok) shape.errors++;
+    shape.captured_time += statement->duration_usec / 1.0e6;
+    shape.replay_time += (end - start).total_microseconds() / 1.0e6;
+  }
+}
+
+static void usage()
+{
+  std::cerr << "Usage: query_replay [--speed <factor> | --max-speed] [--concurrency <n>] [--read-only]\n"
+            << "                    <capture file> [connection string]\n";
+}
+
+//! A short, single-line form of a statement, for the report
+static std::string abbreviate(const std::string &query)
+{
+  std::string result;
+  for (size_t i=0; i<query.size() && result.size() < 100; i++)
+  {
+    result += (query[i] == '\n' || query[i] == '\t') ? ' ' : query[i];
+  }
+  if (result.size() < query.size()) result += "...";
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  double speed = 1.0;
+  int concurrency = 0;
+  bool read_only = false;
+  std::vector<std::string> args;
+  for (int i=1; i<argc; i++)
+  {
+    std::string arg(argv[i]);
+    if (arg == "--speed" && i+1 < argc) 
+    {
+      speed = atof(argv[++i]);
+      if (speed <= 0)
+      {
+        std::cerr << "The speed must be positive\n";
+        return -1;
+      }
+    }
+    else if (arg == "--max-speed") speed = 0;
+    else if (arg == "--concurrency" && i+1 < argc) concurrency = atoi(argv[++i]);
+    else if (arg == "--read-only") read_only = true;
+    else if (arg.compare(0, 2, "--") == 0)
+    {
+      usage();
+      return -1;
+    }
+    else args.push_back(arg);
+  }
+  if (args.empty() || args.size() > 2)
+  {
+    usage();
+    return -1;
+  }
+
+  CaptureReader reader(args[0]);
+  if (!reader.isOpen()) return -1;
+  std::vector<CapturedStatement> statements;
+  CapturedStatement statement;
+  size_t skipped = 0;
+  while (reader.next(statement)) 
+  {
+    if (read_only && !statement.read_only) skipped++;
+    else statements.push_back(statement);
+  }
+  //statements are recorded when they finish, so they are not quite in the order they started
+  std::stable_sort(statements.begin(), statements.end(), earlierStart);
+  std::cout << statements.size() << " statements to replay";
+  if (skipped) std::cout << ", " << skipped << " writes skipped";
+  std::cout << "\n";
+  if (statements.empty()) return 0;
+
+  //the replay connection of each captured connection, in order of first use
+  std::map<int, size_t> assignment;
+  for (size_t s=0; s<statements.size(); s++)
+  {
+    if (!assignment.count(statements[s].connection_id))
+    {
+      size_t worker = assignment.size();
+      assignment[statements[s].connection_id] = worker;
+    }
+  }
+  if (concurrency <= 0) concurrency = assignment.size();
+  std::vector< boost::shared_ptr<ReplayWorker> > workers;
+  for (int w=0; w<concurrency; w++)
+  {
+    PGconn *conn = PQconnectdb(args.size() > 1 ? args[1].c_str() : "");
+    if (PQstatus(conn) != CONNECTION_OK)
+    {
+      std::cerr << "Database connection failed: " << PQerrorMessage(conn);
+      PQfinish(conn);
+      return -1;
+    }
+    workers.push_back(boost::shared_ptr<ReplayWorker>(new ReplayWorker(conn)));
+  }
+
+  boost::posix_time::ptime replay_start = boost::posix_time::microsec_clock::universal_time();
+  boost::thread_group threads;
+  for (size_t w=0; w<workers.size(); w++)
+  {
+    threads.create_thread(boost::bind(&ReplayWorker::run, workers[w].get(), replay_start, speed));
+  }
+  //statements are handed to their worker when they are due, so that each worker only waits
+  //for its own previous statements
+  long long first_start = statements[0].start_usec;
+  for (size_t s=0; s<statements.size(); s++)
+  {
+    statements[s].start_usec -= first_start;
+    if (speed > 0)
+    {
+      boost::posix_time::ptime due = replay_start + 
+        boost::posix_time::microseconds((long long) (statements[s].start_usec / speed));
+      boost::this_thread::sleep(due);
+    }
+    workers[assignment[statements[s].connection_id] % workers.size()]->push(&statements[s]);
+  }
+  for (size_t w=0; w<workers.size(); w++) workers[w]->finish();
+  threads.join_all();
+  double replay_time = 
+    (boost::posix_time::microsec_clock::universal_time() - replay_start).total_microseconds() / 1.0e6;
+
+  //merge the statistics of all workers
+  std::map<std::string, ShapeStats> stats;
+  double max_lag = 0;
+  for (size_t w=0; w<workers.size(); w++)
+  {
+    std::map<std::string, ShapeStats>::const_iterator it;
+    for (it=workers[w]->stats.begin(); it!=workers[w]->stats.end(); it++)
+    {
+      ShapeStats &shape = stats[it->first];
+      shape.count += it->second.count;
+      shape.errors += it->second.errors;
+      shape.captured_time += it->second.captured_time;
+      shape.replay_time += it->second.replay_time;
+    }
+    max_lag = std::max(max_lag, workers[w]->max_lag);
+  }
+  std::vector< std::pair<std::string, ShapeStats> > shapes(stats.begin(), stats.end());
+  std::sort(shapes.begin(), shapes.end(), moreReplayTime);
+
+  double captured_span = (statements.back().start_usec + statements.back().duration_usec) / 1.0e6;
+  unsigned long errors = 0;
+  for (size_t i=0; i<shapes.size(); i++) errors += shapes[i].second.errors;
+  std::cout << "Replayed " << statements.size() << " statements on " << workers.size() 
+            << " connections in " << replay_time << " s (captured: " << captured_span << " s), " 
+            << statements.size() / std::max(replay_time, 1.0e-6) << " statements/s, " 
+            << errors << " errors\n";
+  if (speed > 0) std::cout << "Largest lag behind the schedule: " << 1000.0 * max_lag << " ms\n";
+  std::cout << "\n   count  errors  captured ms/stmt  replay ms/stmt  statement\n";
+  for (size_t i=0; i<shapes.size(); i++)
+  {
+    const ShapeStats &shape = shapes[i].second;
+    char line[128];
+    snprintf(line, sizeof(line), "%8lu %7lu %17.3f %15.3f  ", shape.count, shape.errors, 
+             1000.0 * shape.captured_time / shape.count, 1000.0 * shape.replay_time / shape.count);
+    std::cout << line << abbreviate(shapes[i].first) << "\n";
+  }
+  return 0;
+}
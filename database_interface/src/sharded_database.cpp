@@ -0,0 +1,158 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2009, Willow Garage, Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of the Willow Garage nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+
+#include "database_interface/sharded_database.h"
+
+namespace database_interface {
+
+ShardedDatabase::ShardedDatabase(const std::vector<PostgresqlDatabaseConfig> &configs)
+{
+  for (size_t i=0; i<configs.size(); i++)
+  {
+    shards_.push_back( boost::shared_ptr<PostgresqlDatabase>(new PostgresqlDatabase(configs[i])) );
+  }
+}
+
+bool ShardedDatabase::isConnected() const
+{
+  if (shards_.empty()) return false;
+  for (size_t i=0; i<shards_.size(); i++)
+  {
+    if (!shards_[i]->isConnected()) return false;
+  }
+  return true;
+}
+
+/*! The shard is chosen with a FNV-1a hash of the text value of the primary key. This does
+  not depend on the platform or the process, so every client agrees on where an instance 
+  lives. Changing the number of shards moves most instances.
+ */
+bool ShardedDatabase::getShardIndex(const DBFieldBase *pk_field, size_t &index) const
+{
+  if (shards_.empty())
+  {
+    ROS_ERROR("Sharded database: no shards");
+    return false;
+  }
+  std::string key;
+  if (!pk_field->toString(key))
+  {
+    ROS_ERROR("Sharded database: failed to convert primary key %s to string", 
+              pk_field->getName().c_str());
+    return false;
+  }
+  unsigned int hash = 2166136261u;
+  for (size_t i=0; i<key.size(); i++)
+  {
+    hash ^= (unsigned char) key[i];
+    hash *= 16777619u;
+  }
+  index = hash % shards_.size();
+  return true;
+}
+
+bool ShardedDatabase::insertIntoDatabase(DBClass* instance)
+{
+  if (!instance->getPrimaryKeyField()->getWriteToDatabase())
+  {
+    ROS_ERROR("Sharded database insert: primary key %s must be set explicitly",
+              instance->getPrimaryKeyField()->getName().c_str());
+    return false;
+  }
+  size_t index;
+  if (!getShardIndex(instance->getPrimaryKeyField(), index)) return false;
+  return shards_[index]->insertIntoDatabase(instance);
+}
+
+bool ShardedDatabase::deleteFromDatabase(DBClass* instance)
+{
+  size_t index;
+  if (!getShardIndex(instance->getPrimaryKeyField(), index)) return false;
+  return shards_[index]->deleteFromDatabase(instance);
+}
+
+bool ShardedDatabase::saveToDatabase(const DBFieldBase* field, bool *conflict)
+{
+  size_t index;
+  if (!getShardIndex(field->getOwner()->getPrimaryKeyField(), index)) return false;
+  return shards_[index]->saveToDatabase(field, conflict);
+}
+
+bool ShardedDatabase::saveToDatabase(DBClass* instance, bool *conflict)
+{
+  size_t index;
+  if (!getShardIndex(instance->getPrimaryKeyField(), index)) return false;
+  return shards_[index]->saveToDatabase(instance, conflict);
+}
+
+bool ShardedDatabase::loadFromDatabase(DBFieldBase* field) const
+{
+  size_t index;
+  if (!getShardIndex(field->getOwner()->getPrimaryKeyField(), index)) return false;
+  return shards_[index]->loadFromDatabase(field);
+}
+
+void ShardedDatabase::countShardList(size_t shard, const DBClass *example, int *count, 
+                                     const FilterClause &clause, char *success) const
+{
+  *success = shards_[shard]->countList(example, *count, clause);
+}
+
+bool ShardedDatabase::countList(const DBClass *example, int &count, const FilterClause &clause) const
+{
+  std::vector<int> counts(shards_.size(), 0);
+  std::vector<char> success(shards_.size(), 0);
+  boost::thread_group threads;
+  for (size_t i=0; i<shards_.size(); i++)
+  {
+    threads.create_thread(boost::bind(&ShardedDatabase::countShardList, this, i, example,
+                                      &counts[i], boost::cref(clause), &success[i]));
+  }
+  threads.join_all();
+
+  count = 0;
+  for (size_t i=0; i<shards_.size(); i++)
+  {
+    if (!success[i])
+    {
+      ROS_ERROR("Sharded database count list: query failed on shard %d", (int)i);
+      return false;
+    }
+    count += counts[i];
+  }
+  return true;
+}
+
+} //namespace
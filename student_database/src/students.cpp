@@ -265,5 +265,17 @@ int main(int argc, char **argv)
 	    << new_grade_seq.grade_id_.data() 
 	    << "\n";
 
+  //or get the key from the sequence before inserting; keys are reserved in blocks,
+  //so most grades get their key without asking the database
+  GradeWithSequence keyed_grade_seq;
+  keyed_grade_seq.student_id_.data() = 2;
+  keyed_grade_seq.grade_subject_.data() = "astronomy";
+  keyed_grade_seq.grade_grade_.data() = 3.5;
+  database.allocatePrimaryKey(&keyed_grade_seq);
+  std::cerr << "Inserting a grade with pre-allocated grade_id=" 
+	    << keyed_grade_seq.grade_id_.data() 
+	    << "\n";
+  database.insertIntoDatabase(&keyed_grade_seq);
+
   return 0;
 }